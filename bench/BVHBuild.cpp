@@ -0,0 +1,67 @@
+/*
+ * Scaling of the BVH build and refit with the number of threads
+ *
+ * Usage: benchBVHBuild [nPrims] [maxThreads]
+ * Build with CMAKE_BUILD_TYPE=Release for meaningful timings.
+ */
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <boost/timer/timer.hpp>
+
+#include "accel/BVH.hpp"
+#include "core/Random.hpp"
+
+using namespace photino;
+
+int main(int argc, char* argv[])
+{
+	std::size_t const nPrims = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+	                                    : 1 << 21;
+	unsigned int const maxThreads = argc > 2 ? std::atoi(argv[2])
+	                                         : nHardwareThreads();
+
+	// Small boxes clustered in a few blobs, as in typical scenes
+	Random rng(1);
+	std::vector<BoxAxisAligned<3>> bounds(nPrims);
+	for (std::size_t i = 0; i < nPrims; ++i)
+	{
+		Point<3> const blob(real(i % 7), real(i % 5), real(i % 3));
+		Point<3> p;
+		for (int j = 0; j < 3; ++j)
+			p[j] = 10 * blob[j] + 4 * rng.uniform();
+		bounds[i] = BoxAxisAligned<3>(p, p + Point<3>::Constant(0.01));
+	}
+
+	std::cout << nPrims << " primitives, " << ThreadPool::global().nWorkers()
+	          << " pool workers\n"
+	          << "threads    build ms  speedup    refit ms  speedup\n";
+	// Powers of two, and maxThreads
+	std::vector<unsigned int> counts;
+	for (unsigned int n = 1; n < maxThreads; n *= 2)
+		counts.push_back(n);
+	counts.push_back(maxThreads);
+
+	double build1 = 0, refit1 = 0;
+	for (unsigned int n : counts)
+	{
+		boost::timer::cpu_timer timer;
+		BVH bvh(bounds.data(), nPrims, 4, n);
+		double const build = timer.elapsed().wall * 1e-6;
+		timer.start();
+		bvh.refit(bounds.data(), n);
+		double const refit = timer.elapsed().wall * 1e-6;
+		if (n == 1)
+		{
+			build1 = build;
+			refit1 = refit;
+		}
+		std::cout << std::setw(7) << n << std::fixed << std::setprecision(1)
+		          << std::setw(12) << build << std::setw(9) << build1 / build
+		          << std::setw(12) << refit << std::setw(9) << refit1 / refit
+		          << std::endl;
+	}
+	return 0;
+}
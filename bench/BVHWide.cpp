@@ -0,0 +1,197 @@
+/*
+ * Agreement and throughput of the wide BVHs against the binary one
+ *
+ * The check traces axis-aligned rays lying on the bound planes of a grid of
+ * cubes, whose slab distances on the parallel axes are NaN, and fails if
+ * BVH4 or BVH8 find other hits than BVH. The timing traces random rays
+ * through small random boxes.
+ *
+ * Usage: benchBVHWide [nPrims] [nRays]
+ * Build with CMAKE_BUILD_TYPE=Release for meaningful timings.
+ */
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <boost/timer/timer.hpp>
+
+#include "accel/BVHWide.hpp"
+#include "core/Random.hpp"
+
+using namespace photino;
+
+namespace
+{
+
+/**
+ * @brief Shrinks the extent of the ray to its entry into the box, if it
+ *  enters it within its extent
+ */
+bool intersectBox(BoxAxisAligned<3> const& b, RenderRay<3>* const ray)
+{
+	real t0 = 0;
+	real t1 = ray->tMax();
+	for (int j = 0; j < 3; ++j)
+	{
+		int const n = ray->dirIsNeg(j);
+		real const tNear = ((n ? b.max() : b.min())[j] - ray->origin()[j]) *
+		                   ray->invDirection()[j];
+		real const tFar = ((n ? b.min() : b.max())[j] - ray->origin()[j]) *
+		                  ray->invDirection()[j];
+		// NaNs, from origins on a bound plane, fail both tests
+		if (tNear > t0) t0 = tNear;
+		if (tFar < t1) t1 = tFar;
+	}
+	if (t0 > t1 || t0 >= ray->tMax()) return false;
+	ray->tMax() = t0;
+	return true;
+}
+
+/**
+ * @brief Closest hits with the three hierarchies
+ */
+struct Hits
+{
+	real t[3];
+	bool any[3];
+};
+
+Hits trace(BVH const& bvh, BVH4 const& bvh4, BVH8 const& bvh8,
+           std::vector<BoxAxisAligned<3>> const& boxes,
+           RenderRay<3> const& ray)
+{
+	auto closest = [&boxes](uint32_t prim, RenderRay<3>* const r)
+	{
+		return intersectBox(boxes[prim], r);
+	};
+	auto any = [&boxes](uint32_t prim, RenderRay<3> const& r)
+	{
+		RenderRay<3> copy = r;
+		return intersectBox(boxes[prim], &copy);
+	};
+	Hits hits;
+	RenderRay<3> rays[3] = { ray, ray, ray };
+	bvh.intersect(&rays[0], closest);
+	bvh4.intersect(&rays[1], closest);
+	bvh8.intersect(&rays[2], closest);
+	for (int i = 0; i < 3; ++i)
+		hits.t[i] = rays[i].tMax();
+	hits.any[0] = bvh.intersectAny(ray, any);
+	hits.any[1] = bvh4.intersectAny(ray, any);
+	hits.any[2] = bvh8.intersectAny(ray, any);
+	return hits;
+}
+
+/**
+ * @brief Traces the rays along each axis, both ways, from outside a grid of
+ *  n^3 unit cubes, through the centres of their faces and along their edges
+ * @return Number of rays on which the hierarchies disagree
+ */
+int checkBoundPlanes(int n)
+{
+	std::vector<BoxAxisAligned<3>> boxes;
+	for (int x = 0; x < n; ++x)
+		for (int y = 0; y < n; ++y)
+			for (int z = 0; z < n; ++z)
+			{
+				Point<3> const p(x, y, z);
+				boxes.emplace_back(p, p + Point<3>::Constant(1));
+			}
+	BVH const bvh(boxes.data(), boxes.size(), 1, 1);
+	BVH4 const bvh4(bvh);
+	BVH8 const bvh8(bvh);
+
+	int nRays = 0, nWrong = 0;
+	for (int axis = 0; axis < 3; ++axis)
+		for (int sign = -1; sign <= 1; sign += 2)
+			for (int u = 0; u <= 2 * n; ++u)
+				for (int v = 0; v <= 2 * n; ++v)
+				{
+					// Even coordinates lie on bound planes
+					Point<3> o;
+					o[axis] = sign < 0 ? n + 5 : -5;
+					o[(axis + 1) % 3] = real(0.5) * u;
+					o[(axis + 2) % 3] = real(0.5) * v;
+					Vector<3> d = Vector<3>::Zero();
+					d[axis] = sign;
+					Hits const hits = trace(bvh, bvh4, bvh8, boxes,
+					                        RenderRay<3>(o, d));
+					++nRays;
+					if (hits.t[1] != hits.t[0] || hits.t[2] != hits.t[0] ||
+					    hits.any[1] != hits.any[0] || hits.any[2] != hits.any[0])
+					{
+						if (!nWrong)
+							std::cout << "Mismatch from (" << o.transpose()
+							          << ") along (" << d.transpose()
+							          << "): BVH " << hits.t[0] << ", BVH4 "
+							          << hits.t[1] << ", BVH8 " << hits.t[2]
+							          << '\n';
+						++nWrong;
+					}
+				}
+	std::cout << nWrong << " of " << nRays
+	          << " rays on bound planes differ from BVH\n";
+	return nWrong;
+}
+
+} // namespace <anonymous>
+
+int main(int argc, char* argv[])
+{
+	std::size_t const nPrims = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+	                                    : 1 << 20;
+	std::size_t const nRays = argc > 2 ? std::strtoull(argv[2], nullptr, 10)
+	                                   : 1 << 20;
+
+	if (checkBoundPlanes(4)) return 1;
+
+	// Small boxes scattered in the unit cube, rays between random points
+	Random rng(1);
+	auto randomPoint = [&rng]()
+	{
+		return Point<3>(rng.uniform(), rng.uniform(), rng.uniform());
+	};
+	std::vector<BoxAxisAligned<3>> boxes(nPrims);
+	for (BoxAxisAligned<3>& box : boxes)
+	{
+		Point<3> const p = randomPoint();
+		box = BoxAxisAligned<3>(p, p + Point<3>::Constant(0.005));
+	}
+	std::vector<RenderRay<3>> rays(nRays);
+	for (RenderRay<3>& ray : rays)
+	{
+		Point<3> const o = randomPoint();
+		ray = RenderRay<3>(o, randomPoint() - o);
+	}
+	BVH const bvh(boxes.data(), nPrims);
+	BVH4 const bvh4(bvh);
+	BVH8 const bvh8(bvh);
+
+	auto closest = [&boxes](uint32_t prim, RenderRay<3>* const r)
+	{
+		return intersectBox(boxes[prim], r);
+	};
+	auto time = [&](auto const& hierarchy)
+	{
+		real checksum = 0;
+		boost::timer::cpu_timer timer;
+		for (RenderRay<3> ray : rays)
+		{
+			hierarchy.intersect(&ray, closest);
+			checksum += std::min(ray.tMax(), real(2));
+		}
+		double const rate = nRays / (timer.elapsed().wall * 1e-3);
+		std::cout << std::fixed << std::setprecision(2) << std::setw(12)
+		          << rate << std::setw(16) << checksum << '\n';
+	};
+	std::cout << nPrims << " boxes, " << nRays << " rays\n"
+	          << "         Mrays/s        checksum\n";
+	std::cout << "BVH  ";
+	time(bvh);
+	std::cout << "BVH4 ";
+	time(bvh4);
+	std::cout << "BVH8 ";
+	time(bvh8);
+	return 0;
+}
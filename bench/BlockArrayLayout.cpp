@@ -0,0 +1,162 @@
+/*
+ * Lookup throughput and memory overhead of the BlockArray layouts
+ *
+ * Each query picks a random texel and an anisotropic footprint of the size a
+ * ray differential gives at that texture scale, then reads four taps spread
+ * over the footprint, either with operator() or with quad() for bilinear
+ * filtering. Queries are scattered over the whole array, as for incoherent
+ * secondary rays, so the taps of a query share cache lines only through the
+ * layout.
+ *
+ * Usage: benchBlockArrayLayout [m] [n] [nQueries]
+ * Build with CMAKE_BUILD_TYPE=Release for meaningful timings.
+ */
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <boost/timer/timer.hpp>
+
+#include "core/BlockArray.hpp"
+#include "core/Random.hpp"
+
+using namespace photino;
+
+namespace
+{
+
+/**
+ * @brief Tap positions of a query, 4 per query
+ */
+struct Taps
+{
+	std::vector<uint32_t> j, k;
+};
+
+/**
+ * @brief Random queries with footprints whose axes are at most footprint
+ *  texels long, clamped to the array
+ */
+Taps makeTaps(std::size_t m, std::size_t n, std::size_t nQueries,
+              real footprint)
+{
+	Random rng(7);
+	Taps taps;
+	taps.j.reserve(4 * nQueries);
+	taps.k.reserve(4 * nQueries);
+	auto clamp = [](real x, std::size_t size)
+	{
+		return (uint32_t) std::min<real>(std::max<real>(x, 0), real(size - 1));
+	};
+	for (std::size_t q = 0; q < nQueries; ++q)
+	{
+		real const j = rng.uniform() * m, k = rng.uniform() * n;
+		real const dj[2] = { footprint * (rng.uniform() - real(0.5)),
+		                     footprint * (rng.uniform() - real(0.5)) };
+		real const dk[2] = { footprint * (rng.uniform() - real(0.5)),
+		                     footprint * (rng.uniform() - real(0.5)) };
+		for (int i = 0; i < 4; ++i)
+		{
+			real const sx = i & 1 ? real(0.5) : real(-0.5);
+			real const sy = i & 2 ? real(0.5) : real(-0.5);
+			taps.j.push_back(clamp(j + sx * dj[0] + sy * dj[1], m));
+			taps.k.push_back(clamp(k + sx * dk[0] + sy * dk[1], n));
+		}
+	}
+	return taps;
+}
+
+/**
+ * @param[out] rates Millions of taps per second with operator() and with
+ *  quad()
+ */
+template <int logBlockSize, typename Layout>
+void timeLayout(std::size_t m, std::size_t n, Taps const& taps,
+                double* const rates)
+{
+	BlockArray<float, logBlockSize, Layout> array(m, n);
+	for (std::size_t j = 0; j < m; ++j)
+		for (std::size_t k = 0; k < n; ++k)
+			array(j, k) = float((j + k) & 255);
+
+	std::size_t const nTaps = taps.j.size();
+	float sum = 0;
+	boost::timer::cpu_timer timer;
+	for (std::size_t i = 0; i < nTaps; ++i)
+		sum += array(taps.j[i], taps.k[i]);
+	rates[0] = nTaps / (timer.elapsed().wall * 1e-3);
+
+	timer.start();
+	for (std::size_t i = 0; i < nTaps; ++i)
+	{
+		float quad[4];
+		array.quad(taps.j[i], taps.k[i], quad);
+		sum += quad[0] + quad[1] + quad[2] + quad[3];
+	}
+	rates[1] = nTaps / (timer.elapsed().wall * 1e-3);
+	// Keeps the lookups alive
+	if (sum < 0) std::cout << sum;
+}
+
+template <int logBlockSize>
+void timeLayouts(std::size_t m, std::size_t n, std::size_t nQueries)
+{
+	std::cout << "\nBlocks of " << (1 << logBlockSize) << "x"
+	          << (1 << logBlockSize) << ", Mtaps/s\n"
+	          << "footprint   row-major ()   Morton ()"
+	          << "   row-major quad   Morton quad\n";
+	for (real footprint : { real(1), real(4), real(16), real(64) })
+	{
+		Taps const taps = makeTaps(m, n, nQueries, footprint);
+		double rowMajor[2], morton[2];
+		timeLayout<logBlockSize, LayoutRowMajor>(m, n, taps, rowMajor);
+		timeLayout<logBlockSize, LayoutMorton>(m, n, taps, morton);
+		std::cout << std::fixed << std::setprecision(1) << std::setw(9)
+		          << footprint << std::setw(15) << rowMajor[0]
+		          << std::setw(12) << morton[0] << std::setw(17)
+		          << rowMajor[1] << std::setw(14) << morton[1] << '\n';
+	}
+}
+
+/**
+ * @brief Blocks allocated by LayoutMorton relative to LayoutRowMajor
+ */
+double paddingRatio(std::size_t m, std::size_t n, int logBlockSize)
+{
+	std::size_t const blockSize = std::size_t(1) << logBlockSize;
+	std::size_t const mBlocks = (m + blockSize - 1) / blockSize;
+	std::size_t const nBlocks = (n + blockSize - 1) / blockSize;
+	return double(LayoutMorton(mBlocks, nBlocks).nSlots()) /
+	       LayoutRowMajor(mBlocks, nBlocks).nSlots();
+}
+
+} // namespace <anonymous>
+
+int main(int argc, char* argv[])
+{
+	std::size_t const m = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+	                               : 4096;
+	std::size_t const n = argc > 2 ? std::strtoull(argv[2], nullptr, 10)
+	                               : 4096;
+	std::size_t const nQueries = argc > 3
+		? std::strtoull(argv[3], nullptr, 10) : 1 << 21;
+
+	std::cout << m << "x" << n << " floats, " << nQueries
+	          << " queries of 4 taps\n";
+	timeLayouts<2>(m, n, nQueries);
+	timeLayouts<5>(m, n, nQueries);
+
+	std::cout << "\nMorton blocks / row-major blocks\n"
+	          << "     size     4x4   32x32\n";
+	std::size_t const sizes[][2] = { { m, n }, { 1000, 1000 }, { 1920, 1080 },
+	                                 { 3000, 2000 }, { 4097, 4097 },
+	                                 { 8192, 3000 } };
+	for (auto const& size : sizes)
+		std::cout << std::setw(5) << size[0] << "x" << std::left
+		          << std::setw(5) << size[1] << std::right << std::fixed
+		          << std::setprecision(2) << std::setw(6)
+		          << paddingRatio(size[0], size[1], 2) << std::setw(8)
+		          << paddingRatio(size[0], size[1], 5) << '\n';
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Throughput of transform and bound workloads in the precision of real
+ *
+ * Run once in a default build and once in a build configured with
+ * -DPHOTINO_SINGLE_PRECISION=ON to compare double and float side by side.
+ * Every line names the type of real.
+ *
+ * Usage: benchPrecision [n]
+ * Build with CMAKE_BUILD_TYPE=Release for meaningful timings.
+ */
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <boost/timer/timer.hpp>
+
+#include "core/Random.hpp"
+#include "math/InterpTransform3.hpp"
+#include "math/Transform.hpp"
+
+using namespace photino;
+
+namespace
+{
+
+char const* const realName = sizeof(real) == sizeof(float) ? "float"
+                                                           : "double";
+
+/**
+ * @brief Prints the rate of n items processed since the timer started.
+ *  The checksum keeps the work from being optimised away.
+ */
+void report(char const* workload, std::size_t n,
+            boost::timer::cpu_timer const& timer, real checksum)
+{
+	double const rate = n / (timer.elapsed().wall * 1e-3);
+	std::cout << std::setw(8) << realName << "  " << std::left
+	          << std::setw(28) << workload << std::right << std::fixed
+	          << std::setprecision(3) << std::setw(10) << rate
+	          << std::scientific << std::setprecision(3) << std::setw(14)
+	          << checksum << '\n';
+}
+
+/**
+ * @brief Rotation about a tilted axis, then a scale and a translation
+ */
+Matrix<4> affineMatrix(real angle, real scale, real offset)
+{
+	Matrix<4> m = Matrix<4>::Identity();
+	m.topLeftCorner<3, 3>() = scale * Eigen::AngleAxis<real>(
+		angle, Vector<3>(1, 2, 3).normalized()).toRotationMatrix();
+	m.topRightCorner<3, 1>() = Vector<3>(offset, -offset, 2 * offset);
+	return m;
+}
+
+} // namespace <anonymous>
+
+int main(int argc, char* argv[])
+{
+	std::size_t const n = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+	                               : 1 << 20;
+
+	Random rng(3);
+	std::vector<real> soa[6];
+	for (std::vector<real>& component : soa)
+		component.resize(n);
+	std::vector<BoxAxisAligned<3>> boxes(n);
+	for (std::size_t k = 0; k < n; ++k)
+	{
+		Point<3> lower, upper;
+		for (int j = 0; j < 3; ++j)
+		{
+			lower[j] = 100 * rng.uniform() - 50;
+			upper[j] = lower[j] + rng.uniform();
+			soa[j][k] = lower[j];
+			soa[3 + j][k] = upper[j];
+		}
+		boxes[k] = BoxAxisAligned<3>(lower, upper);
+	}
+	real const* const lower[3] = { soa[0].data(), soa[1].data(),
+	                               soa[2].data() };
+	real const* const upper[3] = { soa[3].data(), soa[4].data(),
+	                               soa[5].data() };
+	std::vector<real> outSoA[6];
+	for (std::vector<real>& component : outSoA)
+		component.resize(n);
+	real* const lowerOut[3] = { outSoA[0].data(), outSoA[1].data(),
+	                            outSoA[2].data() };
+	real* const upperOut[3] = { outSoA[3].data(), outSoA[4].data(),
+	                            outSoA[5].data() };
+
+	TransformAffine<3> const tr0(affineMatrix(real(0.3), real(1.5), 2));
+	TransformAffine<3> const tr1(affineMatrix(real(1.9), real(0.7), -3));
+	InterpTransform3 const motion(&tr0, 0, &tr1, 1);
+
+	std::cout << n << " elements\n" << std::setw(8) << "real" << "  "
+	          << std::left << std::setw(28) << "workload" << std::right
+	          << std::setw(10) << "M/s" << std::setw(14) << "checksum" << '\n';
+
+	boost::timer::cpu_timer timer;
+	tr0.trPoints(lower, lowerOut, n);
+	report("trPoints (SoA)", n, timer, outSoA[0][n / 2]);
+
+	timer.start();
+	real sum = 0;
+	for (std::size_t k = 0; k < n; ++k)
+		sum += tr0.trPoint(boxes[k].min())[0];
+	report("trPoint", n, timer, sum);
+
+	timer.start();
+	tr0.trBoxesAA(lower, upper, lowerOut, upperOut, n);
+	report("trBoxesAA (SoA)", n, timer, outSoA[3][n / 2]);
+
+	std::vector<BoxAxisAligned<3>> boxesOut(n);
+	timer.start();
+	tr0.trBoxesAA(boxes.data(), boxesOut.data(), n);
+	report("trBoxesAA (AoS)", n, timer, boxesOut[n / 2].max()[0]);
+
+	timer.start();
+	sum = 0;
+	for (std::size_t k = 0; k < n; ++k)
+		sum += tr0.trBoxAA(boxes[k]).max()[0];
+	report("trBoxAA", n, timer, sum);
+
+	// Exact bounds solve for the zeros of the derivative of each corner
+	std::size_t const nMotion = n / 16;
+	timer.start();
+	sum = 0;
+	for (std::size_t k = 0; k < nMotion; ++k)
+		sum += motion.motionBounds(boxes[k]).max()[0];
+	report("motionBounds (box)", nMotion, timer, sum);
+
+	timer.start();
+	sum = 0;
+	for (std::size_t k = 0; k < nMotion; ++k)
+		sum += motion.motionBounds(boxes[k].min(), real(0.25),
+		                           real(0.75)).max()[0];
+	report("motionBounds (point, range)", nMotion, timer, sum);
+	return 0;
+}
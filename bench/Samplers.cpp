@@ -0,0 +1,134 @@
+/*
+ * Convergence and throughput of the samplers
+ *
+ * The error is the RMSE, over many pixels, of the estimate of a smooth 6D
+ * product integral whose value is 1. Throughput compares Sampler::getND with
+ * as many calls to Sampler::get1D.
+ *
+ * Usage: benchSamplers [nPixels]
+ * Build with CMAKE_BUILD_TYPE=Release for meaningful timings.
+ */
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+#include <boost/timer/timer.hpp>
+
+#include "sampling/HaltonSampler.hpp"
+#include "sampling/SobolSampler.hpp"
+#include "sampling/StratifiedSampler.hpp"
+
+using namespace photino;
+
+namespace
+{
+
+constexpr int const nDims = 6;
+
+/**
+ * @brief Integrates to 1 over the unit hypercube
+ */
+real integrand(real const* x)
+{
+	real result = 1;
+	for (int d = 0; d < nDims; ++d)
+		result *= 2 * x[d];
+	return result;
+}
+
+class IndependentSampler final: public Sampler
+{
+public:
+	IndependentSampler(uint32_t samplesPerPixel, uint64_t seed):
+		Sampler(samplesPerPixel, seed) {}
+	real get1D() override { ++dimension; return rng.uniform(); }
+};
+
+std::unique_ptr<Sampler> makeSampler(int kind, uint32_t spp)
+{
+	switch (kind)
+	{
+	case 0: return std::unique_ptr<Sampler>(new SobolSampler(spp, 7));
+	case 1: return std::unique_ptr<Sampler>(new HaltonSampler(spp, 7));
+	case 2: return std::unique_ptr<Sampler>(new StratifiedSampler(spp, 7));
+	default: return std::unique_ptr<Sampler>(new IndependentSampler(spp, 7));
+	}
+}
+char const* const names[] = { "Sobol", "Halton", "Stratified", "Independent" };
+
+} // namespace <anonymous>
+
+int main(int argc, char* argv[])
+{
+	uint64_t const nPixels = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+	                                  : 256;
+
+	std::cout << "RMSE of a 6D product integral over " << nPixels
+	          << " pixels\n" << std::setw(12) << "spp";
+	for (char const* name : names)
+		std::cout << std::setw(13) << name;
+	std::cout << '\n';
+	for (uint32_t spp = 16; spp <= 1024; spp *= 4)
+	{
+		std::cout << std::setw(12) << spp;
+		for (int kind = 0; kind < 4; ++kind)
+		{
+			std::unique_ptr<Sampler> const sampler = makeSampler(kind, spp);
+			double squares = 0;
+			for (uint64_t pixel = 0; pixel < nPixels; ++pixel)
+			{
+				double sum = 0;
+				for (uint32_t i = 0; i < spp; ++i)
+				{
+					real x[nDims];
+					sampler->startSample(pixel, i);
+					sampler->getND(x, nDims);
+					sum += integrand(x);
+				}
+				double const error = sum / spp - 1;
+				squares += error * error;
+			}
+			std::cout << std::setw(13) << std::scientific << std::setprecision(2)
+			          << std::sqrt(squares / nPixels);
+		}
+		std::cout << '\n';
+	}
+
+	// Throughput over the dimensions covered by every sampler
+	int const n = 16;
+	uint32_t const spp = 256;
+	std::cout << "\nMsamples/s (" << n << " dimensions)\n"
+	          << std::setw(12) << "" << std::setw(13) << "get1D"
+	          << std::setw(13) << "getND\n";
+	for (int kind = 0; kind < 3; ++kind)
+	{
+		std::unique_ptr<Sampler> const sampler = makeSampler(kind, spp);
+		double rates[2];
+		real checksum = 0;
+		for (int batched = 0; batched < 2; ++batched)
+		{
+			boost::timer::cpu_timer timer;
+			for (uint64_t pixel = 0; pixel < nPixels; ++pixel)
+				for (uint32_t i = 0; i < spp; ++i)
+				{
+					real x[n];
+					sampler->startSample(pixel, i);
+					if (batched)
+						sampler->getND(x, n);
+					else
+						for (int d = 0; d < n; ++d)
+							x[d] = sampler->get1D();
+					checksum += x[n - 1];
+				}
+			rates[batched] = double(nPixels * spp * n) /
+			                 (timer.elapsed().wall * 1e-3);
+		}
+		std::cout << std::setw(12) << names[kind] << std::fixed
+		          << std::setprecision(1) << std::setw(13) << rates[0]
+		          << std::setw(13) << rates[1]
+		          << (checksum < 0 ? "!" : "") << '\n';
+	}
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Throughput of the wavefront intersection with and without a SortStage
+ *
+ * Diffuse paths bounce inside a closed box filled with small random
+ * triangles. Without sorting, the rays of each bounce are incoherent after
+ * the first; sorting pays off when it costs less than it saves in traversal.
+ *
+ * Usage: benchWavefrontSort [sortBatchSize] [nThreads]
+ * Build with CMAKE_BUILD_TYPE=Release for meaningful timings.
+ */
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "core/Random.hpp"
+#include "render/Wavefront.hpp"
+
+using namespace photino;
+
+namespace
+{
+
+struct Triangle
+{
+	Point<3> p[3];
+	Vector<3> normal;
+};
+
+int const resolution = 512;
+int const maxDepth = 4;
+
+void addTriangle(std::vector<Triangle>* const triangles, Point<3> const& p0,
+                 Point<3> const& p1, Point<3> const& p2)
+{
+	Triangle t = { { p0, p1, p2 }, (p1 - p0).cross(p2 - p0).normalized() };
+	triangles->push_back(t);
+}
+
+/**
+ * @brief Walls of [-1, 1]^3 split in n x n quads, and nSmall triangles of
+ *  random orientation inside
+ */
+std::vector<Triangle> makeScene(int n, int nSmall)
+{
+	std::vector<Triangle> triangles;
+	for (int face = 0; face < 6; ++face)
+	{
+		int const axis = face / 2;
+		auto corner = [=](int i, int j)
+		{
+			Point<3> p;
+			p[axis] = face % 2 ? 1 : -1;
+			p[(axis + 1) % 3] = -1 + real(2 * i) / n;
+			p[(axis + 2) % 3] = -1 + real(2 * j) / n;
+			return p;
+		};
+		for (int i = 0; i < n; ++i)
+			for (int j = 0; j < n; ++j)
+			{
+				addTriangle(&triangles, corner(i, j), corner(i + 1, j),
+				            corner(i + 1, j + 1));
+				addTriangle(&triangles, corner(i, j), corner(i + 1, j + 1),
+				            corner(i, j + 1));
+			}
+	}
+	Random rng(1);
+	auto signedUniform = [&rng]() { return 2 * rng.uniform() - 1; };
+	for (int i = 0; i < nSmall; ++i)
+	{
+		Point<3> p[3];
+		Point<3> const centre(0.9 * signedUniform(), 0.9 * signedUniform(),
+		                      0.9 * signedUniform());
+		for (Point<3>& vertex : p)
+			vertex = centre + 0.03 * Point<3>(signedUniform(), signedUniform(),
+			                                  signedUniform());
+		addTriangle(&triangles, p[0], p[1], p[2]);
+	}
+	return triangles;
+}
+
+/**
+ * @brief Pinhole camera rays from near a wall, one per pixel
+ */
+class CameraStage final: public WavefrontStage
+{
+public:
+	char const* name() const override { return "Camera"; }
+	std::size_t nItems(WavefrontState const& state) const override
+	{
+		return state.nPaths;
+	}
+	void process(WavefrontState const& state, std::size_t first,
+	             std::size_t last, unsigned int) override
+	{
+		std::size_t n;
+		std::size_t const index = state.rays->reserve(last - first, &n);
+		for (std::size_t i = first; i < first + n; ++i)
+		{
+			std::size_t const pixel = state.firstPath + i;
+			real const x = (pixel % resolution + real(0.5)) / resolution;
+			real const y = (pixel / resolution + real(0.5)) / resolution;
+			RenderRay<3> const ray(Point<3>(0, 0, -0.99),
+			                       Vector<3>(1.8 * x - 0.9, 1.8 * y - 0.9, 1));
+			state.rays->set(index + i - first, ray, (uint32_t) pixel);
+		}
+	}
+};
+
+/**
+ * @brief Continues each path hit in a cosine-distributed direction
+ */
+class DiffuseStage final: public WavefrontStage
+{
+public:
+	explicit DiffuseStage(std::vector<Triangle> const& triangles):
+		triangles(triangles), nTraced(0) {}
+
+	char const* name() const override { return "Diffuse"; }
+	std::size_t nItems(WavefrontState const& state) const override
+	{
+		return state.rays->size();
+	}
+	void process(WavefrontState const& state, std::size_t first,
+	             std::size_t last, unsigned int) override
+	{
+		RayQueue const& rays = *state.rays;
+		Random rng;
+		rng.seed(first, state.firstPath + state.depth);
+		for (std::size_t i = first; i < last; ++i)
+		{
+			if (rays.prim[i] == RayQueue::noHit || state.depth == maxDepth)
+				continue;
+			RenderRay<3> const ray = rays.ray(i);
+			Vector<3> normal = triangles[rays.prim[i]].normal;
+			if (normal.dot(ray.direction()) > 0) normal = -normal;
+			Vector<3> d;
+			do
+				d = Vector<3>(2 * rng.uniform() - 1, 2 * rng.uniform() - 1,
+				              2 * rng.uniform() - 1);
+			while (d.squaredNorm() > 1);
+			Point<3> const p = ray(ray.tMax()) + real(1e-6) * normal;
+			state.nextRays->push(RenderRay<3>(p, d.normalized() + normal),
+			                     rays.path[i]);
+		}
+		nTraced += last - first;
+	}
+
+	std::vector<Triangle> const& triangles;
+	std::atomic<std::size_t> nTraced;
+};
+
+} // namespace <anonymous>
+
+int main(int argc, char* argv[])
+{
+	std::size_t const sortBatch = argc > 1
+		? std::strtoull(argv[1], nullptr, 10) : 4096;
+	unsigned int const nThreads = argc > 2 ? std::atoi(argv[2])
+	                                       : nHardwareThreads();
+
+	std::vector<Triangle> const triangles = makeScene(64, 200000);
+	std::vector<BoxAxisAligned<3>> bounds(triangles.size());
+	for (std::size_t i = 0; i < triangles.size(); ++i)
+		for (Point<3> const& p : triangles[i].p)
+			bounds[i] |= BoxAxisAligned<3>(p, p);
+	BVH const bvh(bounds.data(), bounds.size(), 4, nThreads);
+	auto intersector = [&triangles](uint32_t prim, RayPacket<4>* const packet,
+	                                int mask)
+	{
+		Triangle const& t = triangles[prim];
+		Pack<real, 4> u, v;
+		return intersectTriangle(packet, mask, t.p[0], t.p[1], t.p[2], &u, &v);
+	};
+
+	std::size_t const nPaths = resolution * resolution;
+	std::cout << triangles.size() << " triangles, " << nPaths << " paths, "
+	          << nThreads << " threads, sort batches of " << sortBatch
+	          << "\n      sort ms  intersect ms  Mrays/s (intersect)"
+	          << "  Mrays/s (sort + intersect)\n";
+	for (int sorted = 0; sorted < 2; ++sorted)
+	{
+		CameraStage camera;
+		SortStage sort(bvh.bounds(), sortBatch);
+		auto intersect = makeIntersectStage<4>(bvh, intersector);
+		DiffuseStage diffuse(triangles);
+		WavefrontPipeline pipeline(&camera, nPaths, maxDepth, nThreads);
+		if (sorted) pipeline.addStage(&sort);
+		pipeline.addStage(&intersect);
+		pipeline.addStage(&diffuse);
+		pipeline.run(nPaths);
+
+		double const sortTime = sorted ? pipeline.stageTime(1) * 1e-9 : 0;
+		double const intersectTime = pipeline.stageTime(1 + sorted) * 1e-9;
+		double const nRays = double(diffuse.nTraced.load());
+		std::cout << (sorted ? "yes" : " no") << std::fixed
+		          << std::setprecision(1) << std::setw(10) << sortTime * 1e3
+		          << std::setw(14) << intersectTime * 1e3
+		          << std::setprecision(2) << std::setw(21)
+		          << nRays / intersectTime * 1e-6 << std::setw(30)
+		          << nRays / (sortTime + intersectTime) * 1e-6 << '\n';
+	}
+	return 0;
+}
@@ -0,0 +1,607 @@
+#include "BVH.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <mutex>
+
+#include "../math/integers.hpp"
+
+namespace photino
+{
+
+namespace
+{
+
+/**
+ * @brief Temporary node used during construction, before flattening.
+ */
+struct BuildNode
+{
+	BoxAxisAligned<3> bounds;
+	BuildNode* children[2];
+	uint32_t first, nPrims;
+	uint8_t axis;
+};
+
+constexpr int const nBuckets = 12;
+/**
+ * @brief Cost of traversing an interior node relative to intersecting a
+ *  primitive
+ */
+constexpr real const costTraversal = 0.125;
+constexpr uint32_t const maxLeafSize = UINT16_MAX;
+/**
+ * @brief Ranges at least this large are bounded and binned by all threads
+ */
+constexpr uint32_t const parallelBinThreshold = 1 << 16;
+/**
+ * @brief Subtrees at least this large may be built by another thread
+ */
+constexpr uint32_t const parallelTaskThreshold = 1 << 12;
+
+/**
+ * @brief State shared by all the build tasks
+ */
+struct BuildShared
+{
+	BoxAxisAligned<3> const* primBounds;
+	std::vector<Point<3>> centroids;
+	uint32_t* indices;
+	uint32_t maxPrimsInNode;
+
+	unsigned int nThreads;
+	std::atomic<unsigned int> nBusy;
+	std::atomic<std::size_t> nNodes;
+
+	std::mutex arenasMutex;
+	std::vector<std::unique_ptr<MemoryPool>> arenas;
+
+	/**
+	 * @brief Creates a node arena for a new build task
+	 */
+	MemoryPool* newArena();
+};
+
+MemoryPool* BuildShared::newArena()
+{
+	std::lock_guard<std::mutex> lock(arenasMutex);
+	arenas.emplace_back(new MemoryPool);
+	return arenas.back().get();
+}
+
+struct Bins
+{
+	BoxAxisAligned<3> bounds[nBuckets];
+	uint32_t counts[nBuckets] = {};
+};
+
+/**
+ * @brief Largest number of primitives that a subtree rooted at the given
+ *  depth may hold, for its leaves to be at most BVH::maxDepth - 1 deep and
+ *  hold at most maxLeafSize primitives each.
+ */
+uint64_t depthBudget(int depth)
+{
+	int const levels = BVH::maxDepth - 1 - depth;
+	return levels >= 32 ? UINT64_MAX : uint64_t(maxLeafSize) << levels;
+}
+
+BuildNode* makeLeaf(BuildNode* const node, uint32_t begin, uint32_t end)
+{
+	node->children[0] = node->children[1] = nullptr;
+	node->first = begin;
+	node->nPrims = end - begin;
+	node->axis = 0;
+	return node;
+}
+
+/**
+ * @brief Computes the bounds of the primitives and of their centroids in the
+ *  given range, using all threads for large ranges.
+ */
+void boundRange(BuildShared* const shared, uint32_t begin, uint32_t end,
+                BoxAxisAligned<3>* const bounds,
+                BoxAxisAligned<3>* const centroidBounds)
+{
+	uint32_t const* const indices = shared->indices;
+	unsigned int const nChunks =
+		end - begin >= parallelBinThreshold ? shared->nThreads : 1;
+	std::vector<BoxAxisAligned<3>> partial(2 * nChunks);
+	parallelChunks(begin, end, nChunks,
+	               [&](std::size_t first, std::size_t last, unsigned int chunk)
+	{
+		BoxAxisAligned<3> b, c;
+		for (std::size_t i = first; i < last; ++i)
+		{
+			b |= shared->primBounds[indices[i]];
+			c |= shared->centroids[indices[i]];
+		}
+		partial[2 * chunk] = b;
+		partial[2 * chunk + 1] = c;
+	});
+	for (unsigned int i = 0; i < nChunks; ++i)
+	{
+		*bounds |= partial[2 * i];
+		*centroidBounds |= partial[2 * i + 1];
+	}
+}
+/**
+ * @brief Bins the primitives in the given range by their centroids along dim,
+ *  using all threads for large ranges.
+ */
+template <typename BucketOf> void
+binRange(BuildShared* const shared, uint32_t begin, uint32_t end,
+         BucketOf const& bucketOf, Bins* const bins)
+{
+	uint32_t const* const indices = shared->indices;
+	unsigned int const nChunks =
+		end - begin >= parallelBinThreshold ? shared->nThreads : 1;
+	std::vector<Bins> partial(nChunks);
+	parallelChunks(begin, end, nChunks,
+	               [&](std::size_t first, std::size_t last, unsigned int chunk)
+	{
+		Bins& local = partial[chunk];
+		for (std::size_t i = first; i < last; ++i)
+		{
+			int const b = bucketOf(indices[i]);
+			++local.counts[b];
+			local.bounds[b] |= shared->primBounds[indices[i]];
+		}
+	});
+	for (Bins const& local : partial)
+		for (int b = 0; b < nBuckets; ++b)
+		{
+			bins->counts[b] += local.counts[b];
+			bins->bounds[b] |= local.bounds[b];
+		}
+}
+
+BuildNode* buildRecursive(BuildShared* const shared, MemoryPool* const arena,
+                          uint32_t begin, uint32_t end, int depth)
+{
+	BuildNode* const node = arena->alloc_ctor<BuildNode>();
+	++shared->nNodes;
+
+	uint32_t* const indices = shared->indices;
+	BoxAxisAligned<3> centroidBounds;
+	boundRange(shared, begin, end, &node->bounds, &centroidBounds);
+
+	uint32_t const n = end - begin;
+	assert(n <= depthBudget(depth) && "Subtree too large for its depth");
+	if (n == 1 || depth >= BVH::maxDepth - 1)
+		return makeLeaf(node, begin, end);
+
+	int dim;
+	real const extent = maxExtent(centroidBounds, &dim);
+
+	uint32_t mid = begin + n / 2;
+	if (extent <= 0)
+	{
+		// Primitives cannot be separated by their centroids
+		if (n <= maxLeafSize)
+			return makeLeaf(node, begin, end);
+	}
+	else
+	{
+		// Bin the centroids along the split axis
+		real const lower = centroidBounds.min()[dim];
+		auto bucketOf = [&](uint32_t prim)
+		{
+			int b = (int) (nBuckets * ((shared->centroids[prim][dim] - lower)
+			                           / extent));
+			return std::min(b, nBuckets - 1);
+		};
+		Bins bins;
+		binRange(shared, begin, end, bucketOf, &bins);
+
+		// Sweep from the right to accumulate the areas of the right halves
+		real areaRight[nBuckets - 1];
+		uint32_t countRight[nBuckets - 1];
+		BoxAxisAligned<3> accum;
+		uint32_t count = 0;
+		for (int b = nBuckets - 1; b > 0; --b)
+		{
+			accum |= bins.bounds[b];
+			count += bins.counts[b];
+			areaRight[b - 1] = surfaceArea(accum);
+			countRight[b - 1] = count;
+		}
+
+		int minBucket = 0;
+		real minCost = INFINITY;
+		accum.setEmpty();
+		count = 0;
+		for (int b = 0; b < nBuckets - 1; ++b)
+		{
+			accum |= bins.bounds[b];
+			count += bins.counts[b];
+			real const cost = count * surfaceArea(accum) +
+			                  countRight[b] * areaRight[b];
+			if (cost < minCost)
+			{
+				minCost = cost;
+				minBucket = b;
+			}
+		}
+		real const area = surfaceArea(node->bounds);
+		minCost = costTraversal + (area > 0 ? minCost / area : n);
+
+		if (n <= shared->maxPrimsInNode && minCost >= n)
+			return makeLeaf(node, begin, end);
+
+		auto isLeft = [&](uint32_t prim) { return bucketOf(prim) <= minBucket; };
+		mid = (uint32_t) (std::partition(indices + begin, indices + end, isLeft)
+		                  - indices);
+		node->axis = (uint8_t) dim;
+	}
+	/*
+	 * Heavily clustered centroids may give a long chain of unbalanced SAH
+	 * splits. A child too large to fit within the depth budget, as the
+	 * traversal stacks hold maxDepth entries, is replaced by an object
+	 * median split, which halves the budget and the primitives.
+	 */
+	if (mid == begin || mid == end ||
+	    std::max(mid - begin, end - mid) > depthBudget(depth + 1))
+	{
+		mid = begin + n / 2;
+		auto isLess = [&](uint32_t p0, uint32_t p1)
+		{
+			return shared->centroids[p0][dim] < shared->centroids[p1][dim];
+		};
+		std::nth_element(indices + begin, indices + mid, indices + end, isLess);
+		node->axis = (uint8_t) dim;
+	}
+
+	node->first = begin;
+	node->nPrims = 0;
+
+	// Offer the first child to the thread pool if fewer than nThreads tasks
+	// are running
+	bool spawn = false;
+	if (std::min(mid - begin, end - mid) >= parallelTaskThreshold)
+	{
+		spawn = shared->nBusy.fetch_add(1) < shared->nThreads;
+		if (!spawn) --shared->nBusy;
+	}
+	if (spawn)
+	{
+		MemoryPool* const arenas[2] = { shared->newArena(), arena };
+		uint32_t const bounds[3] = { begin, mid, end };
+		ThreadPool::global().run(2, [&](unsigned int i)
+		{
+			node->children[i] = buildRecursive(shared, arenas[i], bounds[i],
+			                                   bounds[i + 1], depth + 1);
+		});
+		--shared->nBusy;
+	}
+	else
+	{
+		node->children[0] = buildRecursive(shared, arena, begin, mid, depth + 1);
+		node->children[1] = buildRecursive(shared, arena, mid, end, depth + 1);
+	}
+	return node;
+}
+
+uint32_t flatten(BuildNode const* node, BVHNode* const nodes,
+                 uint32_t* const offset)
+{
+	uint32_t const index = (*offset)++;
+	BVHNode& linear = nodes[index];
+	linear.bounds = node->bounds;
+	linear.axis = node->axis;
+	if (node->nPrims)
+	{
+		linear.primOffset = node->first;
+		linear.nPrims = (uint16_t) node->nPrims;
+	}
+	else
+	{
+		linear.nPrims = 0;
+		flatten(node->children[0], nodes, offset);
+		linear.secondChild = flatten(node->children[1], nodes, offset);
+	}
+	return index;
+}
+
+/**
+ * @return One past the last node of the subtree rooted at node i
+ */
+uint32_t subtreeEnd(BVHNode const* nodes, uint32_t i)
+{
+	while (!nodes[i].isLeaf())
+		i = nodes[i].secondChild;
+	return i + 1;
+}
+
+/**
+ * @brief State of a refit
+ */
+struct Refit
+{
+	BVHNode* nodes;
+	real* costs;
+	uint32_t const* indices;
+	BoxAxisAligned<3> const* primBounds;
+
+	/**
+	 * @brief Bounds node k and computes its SAH cost, from its primitives or
+	 *  from its children, which must be refitted.
+	 */
+	void node(uint32_t k) const;
+	/**
+	 * @brief Refits the subtree occupying the nodes [begin, end).
+	 */
+	void range(uint32_t begin, uint32_t end) const;
+	/**
+	 * @brief Collects the roots of the subtrees at the given depth, and the
+	 *  leaves above it.
+	 */
+	void collect(uint32_t i, int depth, int taskDepth,
+	             std::vector<uint32_t>* const tasks) const;
+	/**
+	 * @brief Refits the nodes above the given depth, whose descendants at
+	 *  that depth are refitted.
+	 */
+	void top(uint32_t i, int depth, int taskDepth) const;
+};
+
+void Refit::node(uint32_t k) const
+{
+	BVHNode& n = nodes[k];
+	if (n.isLeaf())
+	{
+		n.bounds.setEmpty();
+		for (uint32_t i = 0; i < n.nPrims; ++i)
+			n.bounds |= primBounds[indices[n.primOffset + i]];
+		costs[k] = n.nPrims;
+		return;
+	}
+	uint32_t const c0 = k + 1, c1 = n.secondChild;
+	n.bounds = nodes[c0].bounds;
+	n.bounds |= nodes[c1].bounds;
+	real const area = surfaceArea(n.bounds);
+	costs[k] = costTraversal + (area > 0 ?
+		(surfaceArea(nodes[c0].bounds) * costs[c0] +
+		 surfaceArea(nodes[c1].bounds) * costs[c1]) / area :
+		costs[c0] + costs[c1]);
+}
+void Refit::range(uint32_t begin, uint32_t end) const
+{
+	// Children follow their parent, so a reverse sweep refits them first
+	for (uint32_t k = end; k-- > begin;)
+		node(k);
+}
+void Refit::collect(uint32_t i, int depth, int taskDepth,
+                    std::vector<uint32_t>* const tasks) const
+{
+	if (depth == taskDepth || nodes[i].isLeaf())
+	{
+		tasks->push_back(i);
+		return;
+	}
+	collect(i + 1, depth + 1, taskDepth, tasks);
+	collect(nodes[i].secondChild, depth + 1, taskDepth, tasks);
+}
+void Refit::top(uint32_t i, int depth, int taskDepth) const
+{
+	if (depth == taskDepth || nodes[i].isLeaf()) return;
+	top(i + 1, depth + 1, taskDepth);
+	top(nodes[i].secondChild, depth + 1, taskDepth);
+	node(i);
+}
+
+/**
+ * @brief Copies a flattened hierarchy, replacing some of its subtrees with
+ *  newly built ones.
+ */
+struct Reflatten
+{
+	BVHNode const* nodes;
+	real const* buildCosts;
+	std::vector<uint32_t> const* roots; ///< Replaced subtrees, increasing
+	std::vector<BuildNode const*> const* subtrees; ///< Replacements
+
+	BVHNode* newNodes;
+	real* newBuildCosts;
+	/**
+	 * Whether each new node is, or is an ancestor of, a replacement
+	 */
+	std::vector<bool>* rebuilt;
+	uint32_t offset;
+
+	/**
+	 * @return Index of the copy of node i
+	 */
+	uint32_t copy(uint32_t i);
+};
+
+uint32_t Reflatten::copy(uint32_t i)
+{
+	uint32_t const index = offset;
+	auto const root = std::lower_bound(roots->begin(), roots->end(), i);
+	if (root != roots->end() && *root == i)
+	{
+		flatten((*subtrees)[root - roots->begin()], newNodes, &offset);
+		for (uint32_t k = index; k < offset; ++k)
+			(*rebuilt)[k] = true;
+		return index;
+	}
+
+	++offset;
+	newNodes[index] = nodes[i];
+	newBuildCosts[index] = buildCosts[i];
+	if (!nodes[i].isLeaf())
+	{
+		copy(i + 1);
+		newNodes[index].secondChild = copy(nodes[i].secondChild);
+		(*rebuilt)[index] = (*rebuilt)[index + 1] ||
+		                    (*rebuilt)[newNodes[index].secondChild];
+	}
+	return index;
+}
+
+} // namespace
+
+
+BVH::BVH(BoxAxisAligned<3> const* bounds, std::size_t nPrims,
+         int maxPrimsInNode, unsigned int nThreads):
+	nodeArray(nullptr), nNodesTotal(0), indices(nPrims),
+	maxLeafPrims((uint32_t) std::min(maxPrimsInNode, (int) maxLeafSize))
+{
+	if (!nPrims) return;
+	assert(nPrims <= UINT32_MAX && "Too many primitives");
+
+	BuildShared shared;
+	shared.primBounds = bounds;
+	shared.centroids.resize(nPrims);
+	shared.indices = indices.data();
+	shared.maxPrimsInNode = maxLeafPrims;
+	shared.nThreads = nThreads ? nThreads : 1;
+	shared.nBusy = 1;
+	shared.nNodes = 0;
+	parallelChunks(0, nPrims, nPrims >= parallelBinThreshold ? shared.nThreads : 1,
+	               [&](std::size_t first, std::size_t last, unsigned int)
+	{
+		for (std::size_t i = first; i < last; ++i)
+		{
+			indices[i] = (uint32_t) i;
+			shared.centroids[i] = bounds[i].center();
+		}
+	});
+
+	BuildNode const* const root =
+		buildRecursive(&shared, shared.newArena(), 0, (uint32_t) nPrims, 0);
+
+	// Merge the nodes of all arenas into one compact array. It is the first
+	// allocation so it is aligned to PHOTINO_MEMALIGN.
+	nNodesTotal = shared.nNodes;
+	nodeArray = pool.alloc<BVHNode>(nNodesTotal);
+	uint32_t offset = 0;
+	flatten(root, nodeArray, &offset);
+	assert(offset == nNodesTotal);
+
+	costs.resize(nNodesTotal);
+	buildCosts.resize(nNodesTotal);
+	refit(bounds, nThreads);
+	buildCosts = costs;
+}
+
+real BVH::refit(BoxAxisAligned<3> const* bounds, unsigned int nThreads)
+{
+	if (!nNodesTotal) return 1;
+	if (!nThreads) nThreads = 1;
+
+	Refit const refit = { nodeArray, costs.data(), indices.data(), bounds };
+	// Enough subtrees for the threads to balance their loads. The nodes above
+	// them are refitted afterwards.
+	int const taskDepth = nThreads > 1 ? log2Int(nThreads) + 3 : 0;
+	std::vector<uint32_t> tasks;
+	refit.collect(0, 0, taskDepth, &tasks);
+	std::atomic<std::size_t> next(0);
+	parallelChunks(0, nThreads, nThreads,
+	               [&](std::size_t, std::size_t, unsigned int)
+	{
+		for (std::size_t j; (j = next++) < tasks.size();)
+			refit.range(tasks[j], subtreeEnd(nodeArray, tasks[j]));
+	});
+	refit.top(0, 0, taskDepth);
+	return degradation();
+}
+real BVH::degradation() const
+{
+	return nNodesTotal && buildCosts[0] > 0 ? costs[0] / buildCosts[0] : 1;
+}
+
+std::size_t BVH::rebuildDegraded(BoxAxisAligned<3> const* bounds,
+                                 real maxDegradation, unsigned int nThreads)
+{
+	if (!nNodesTotal) return 0;
+
+	// Degraded subtrees to rebuild, in increasing order of their roots
+	std::vector<uint32_t> roots;
+	std::vector<int> depths;
+	auto degraded = [&](uint32_t i)
+	{
+		return !nodeArray[i].isLeaf() && costs[i] > maxDegradation * buildCosts[i];
+	};
+	auto find = [&](uint32_t i, int depth, auto const& recurse) -> void
+	{
+		if (nodeArray[i].isLeaf()) return;
+		uint32_t const c0 = i + 1, c1 = nodeArray[i].secondChild;
+		if (degraded(i))
+		{
+			// The degradation of a single child propagates to its ancestors,
+			// which need not be rebuilt
+			bool const d0 = degraded(c0), d1 = degraded(c1);
+			if (d0 != d1)
+				recurse(d0 ? c0 : c1, depth + 1, recurse);
+			else
+			{
+				roots.push_back(i);
+				depths.push_back(depth);
+			}
+			return;
+		}
+		recurse(c0, depth + 1, recurse);
+		recurse(c1, depth + 1, recurse);
+	};
+	find(0, 0, find);
+	if (roots.empty()) return 0;
+
+	BuildShared shared;
+	shared.primBounds = bounds;
+	shared.centroids.resize(indices.size());
+	shared.indices = indices.data();
+	shared.maxPrimsInNode = maxLeafPrims;
+	shared.nThreads = nThreads ? nThreads : 1;
+	shared.nBusy = 1;
+	shared.nNodes = 0;
+
+	// The primitives of a subtree are contiguous, from its leftmost leaf to
+	// its rightmost leaf
+	std::vector<BuildNode const*> subtrees(roots.size());
+	std::size_t nRemoved = 0;
+	for (std::size_t j = 0; j < roots.size(); ++j)
+	{
+		uint32_t first = roots[j];
+		while (!nodeArray[first].isLeaf()) ++first;
+		uint32_t const last = subtreeEnd(nodeArray, roots[j]) - 1;
+		uint32_t const begin = nodeArray[first].primOffset;
+		uint32_t const end = nodeArray[last].primOffset + nodeArray[last].nPrims;
+		for (uint32_t i = begin; i < end; ++i)
+			shared.centroids[indices[i]] = bounds[indices[i]].center();
+		subtrees[j] = buildRecursive(&shared, shared.newArena(), begin, end,
+		                             depths[j]);
+		nRemoved += last + 1 - roots[j];
+	}
+
+	std::size_t const n = nNodesTotal - nRemoved + shared.nNodes;
+	std::vector<BVHNode> nodes(n);
+	std::vector<real> newBuildCosts(n);
+	std::vector<bool> rebuilt(n, false);
+	Reflatten reflatten = { nodeArray, buildCosts.data(), &roots, &subtrees,
+	                        nodes.data(), newBuildCosts.data(), &rebuilt, 0 };
+	reflatten.copy(0);
+	assert(reflatten.offset == n);
+
+	setNodes(nodes.data(), n);
+	costs.resize(n);
+	refit(bounds, nThreads);
+	// The rebuilt subtrees and their ancestors start afresh
+	buildCosts.resize(n);
+	for (std::size_t k = 0; k < n; ++k)
+		buildCosts[k] = rebuilt[k] ? costs[k] : newBuildCosts[k];
+	return roots.size();
+}
+
+void BVH::setNodes(BVHNode const* nodes, std::size_t n)
+{
+	pool.freeAll();
+	nodeArray = pool.alloc<BVHNode>(n);
+	std::copy(nodes, nodes + n, nodeArray);
+	nNodesTotal = n;
+}
+
+} // namespace photino
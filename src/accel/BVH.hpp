@@ -0,0 +1,390 @@
+#ifndef PHOTINO_ACCEL_BVH_HPP_
+#define PHOTINO_ACCEL_BVH_HPP_
+
+#include <cstdint>
+#include <vector>
+
+#include "../core/MemoryPool.hpp"
+#include "../core/parallel.hpp"
+#include "../math/RayPacket.hpp"
+#include "../math/RenderRay.hpp"
+
+namespace photino
+{
+
+/**
+ * @brief Node of a flattened bounding volume hierarchy. Nodes are stored in
+ *  depth-first order, so the first child of an interior node immediately
+ *  follows it.
+ */
+struct alignas(32) BVHNode
+{
+	BoxAxisAligned<3> bounds;
+	union
+	{
+		uint32_t primOffset; ///< Leaf: Offset into \ref BVH::primIndices
+		uint32_t secondChild; ///< Interior: Index of the second child
+	};
+	uint16_t nPrims; ///< 0 for interior nodes
+	uint8_t axis; ///< Split axis of interior nodes
+
+	bool isLeaf() const;
+};
+
+/**
+ * @brief Bounding volume hierarchy built with the binned surface area
+ *  heuristic.
+ */
+class BVH final
+{
+public:
+	static constexpr int const maxDepth = 64;
+
+	/**
+	 * @param[in] bounds Bounds of the primitives
+	 * @param[in] nPrims Number of primitives
+	 * @param[in] maxPrimsInNode Maximum number of primitives in a leaf, unless
+	 *  the primitives cannot be separated.
+	 * @param[in] nThreads Number of threads used for construction. The
+	 *  resulting hierarchy does not depend on it.
+	 */
+	BVH(BoxAxisAligned<3> const* bounds, std::size_t nPrims,
+	    int maxPrimsInNode = 4, unsigned int nThreads = nHardwareThreads());
+	BVH(BVH const&) = delete;
+	BVH& operator=(BVH const&) = delete;
+
+	BoxAxisAligned<3> bounds() const;
+	std::size_t nPrims() const;
+	std::size_t nNodes() const;
+	BVHNode const* nodes() const;
+	/**
+	 * @brief Indices of the primitives, in the order referred to by the leaves
+	 */
+	uint32_t const* primIndices() const;
+
+	/**
+	 * The topology is kept, so the hierarchy degrades as the primitives move
+	 * relative to each other. See \ref degradation.
+	 *
+	 * @brief Recomputes the bounds of the nodes bottom-up, after the
+	 *  primitives moved. Disjoint subtrees are refitted in parallel.
+	 * @param[in] bounds New bounds of the primitives, in the order given at
+	 *  construction
+	 * @return \ref degradation
+	 */
+	real refit(BoxAxisAligned<3> const* bounds,
+	           unsigned int nThreads = nHardwareThreads());
+	/**
+	 * The SAH cost of a subtree is the expected cost of a ray traversing it,
+	 * given that the ray hits its root.
+	 *
+	 * @return Ratio of the current SAH cost of the hierarchy to its cost when
+	 *  it was built
+	 */
+	real degradation() const;
+	/**
+	 * A subtree is degraded if its degradation exceeds maxDegradation.
+	 * Subtrees are visited from the root. A degraded subtree with exactly one
+	 * degraded child is not rebuilt, since the child accounts for its
+	 * degradation, and the child is visited instead. Other degraded subtrees
+	 * are rebuilt from scratch with the SAH. The rest of the hierarchy is
+	 * copied.
+	 *
+	 * @brief Rebuilds the degraded subtrees.
+	 * @param[in] bounds Bounds of the primitives, as given to the last
+	 *  \ref refit
+	 * @return Number of subtrees rebuilt
+	 */
+	std::size_t rebuildDegraded(BoxAxisAligned<3> const* bounds,
+	                            real maxDegradation = 1.5,
+	                            unsigned int nThreads = nHardwareThreads());
+
+	/**
+	 * @brief Finds the closest intersection along the ray.
+	 * @param[inout] ray Its extent is shrunk to the closest intersection.
+	 * @param[in] intersector Called as intersector(primIndex, ray) for each
+	 *  candidate primitive. It must return true and shrink ray->tMax() upon
+	 *  hitting the primitive.
+	 * @return true if any primitive is hit
+	 */
+	template <typename Intersector> bool
+	intersect(RenderRay<3>* const ray, Intersector&& intersector) const;
+	/**
+	 * @brief See \ref intersect. The primitives of a leaf are intersected
+	 *  together, e.g. in SIMD lanes.
+	 * @param[in] intersector Called as intersector(primOffset, nPrims, ray)
+	 *  for each leaf reached, whose primitives are
+	 *  primIndices()[primOffset, primOffset + nPrims). It must return true and
+	 *  shrink ray->tMax() upon hitting any of them.
+	 */
+	template <typename LeafIntersector> bool
+	intersectLeaves(RenderRay<3>* const ray,
+	                LeafIntersector&& intersector) const;
+	/**
+	 * @brief Determines whether any primitive intersects the ray. Traversal
+	 *  stops upon the first intersection.
+	 * @param[in] predicate Called as predicate(primIndex, ray). Returns true if
+	 *  the primitive is hit.
+	 */
+	template <typename Predicate> bool
+	intersectAny(RenderRay<3> const&, Predicate&& predicate) const;
+	/**
+	 * Nodes are culled by the frustum of the packet, unless the packet fits
+	 * in one SIMD register, then tested against the active lanes. A packet
+	 * without a frustum, whose directions span several octants, is traced one
+	 * ray at a time, as are the lanes left below a node reached by at most
+	 * \ref maxSparseLanes of them, which would waste most of each test.
+	 *
+	 * @brief Finds the closest intersections of the lanes of a packet.
+	 * @param[inout] packet Prepared by \ref RayPacket::prepare. The extents
+	 *  of its lanes are shrunk to their closest intersections.
+	 * @param[in] mask Active lanes
+	 * @param[in] intersector Called as intersector(primIndex, packet, mask)
+	 *  for each candidate primitive and the lanes reaching it. It must shrink
+	 *  the extents of the lanes that hit the primitive and return their mask.
+	 * @return Mask of the lanes that hit any primitive
+	 */
+	template <int width, typename Intersector> int
+	intersect(RayPacket<width>* const packet, int mask,
+	          Intersector&& intersector) const;
+
+	/**
+	 * @brief Number of active lanes of a packet of the given width at or
+	 *  below which they are traced one at a time, 0 if never
+	 */
+	static constexpr int maxSparseLanes(int width);
+
+private:
+	/**
+	 * @brief \ref intersectLeaves in the subtree of the given node only
+	 */
+	template <typename LeafIntersector> bool
+	intersectSubtree(uint32_t root, RenderRay<3>* const ray,
+	                 LeafIntersector&& intersector) const;
+
+	/**
+	 * @brief Copies the nodes into the pool, which is emptied first.
+	 */
+	void setNodes(BVHNode const* nodes, std::size_t n);
+
+	MemoryPool pool;
+	BVHNode* nodeArray;
+	std::size_t nNodesTotal;
+	std::vector<uint32_t> indices;
+	uint32_t maxLeafPrims;
+	/**
+	 * SAH costs of the subtrees of every node, now and when last built
+	 */
+	std::vector<real> costs, buildCosts;
+};
+
+
+// Implementations
+
+inline bool BVHNode::isLeaf() const
+{
+	return nPrims > 0;
+}
+
+inline BoxAxisAligned<3> BVH::bounds() const
+{
+	return nNodesTotal ? nodeArray[0].bounds : BoxAxisAligned<3>();
+}
+inline std::size_t BVH::nPrims() const
+{
+	return indices.size();
+}
+inline std::size_t BVH::nNodes() const
+{
+	return nNodesTotal;
+}
+inline BVHNode const* BVH::nodes() const
+{
+	return nodeArray;
+}
+inline uint32_t const* BVH::primIndices() const
+{
+	return indices.data();
+}
+
+template <typename Intersector> inline bool
+BVH::intersect(RenderRay<3>* const ray, Intersector&& intersector) const
+{
+	return intersectLeaves(ray,
+		[&](uint32_t primOffset, uint32_t nPrims, RenderRay<3>* const r)
+		{
+			bool hit = false;
+			for (uint32_t i = 0; i < nPrims; ++i)
+				if (intersector(indices[primOffset + i], r))
+					hit = true;
+			return hit;
+		});
+}
+template <typename LeafIntersector> inline bool
+BVH::intersectLeaves(RenderRay<3>* const ray,
+                     LeafIntersector&& intersector) const
+{
+	if (!nNodesTotal) return false;
+	return intersectSubtree(0, ray, intersector);
+}
+template <typename LeafIntersector> inline bool
+BVH::intersectSubtree(uint32_t root, RenderRay<3>* const ray,
+                      LeafIntersector&& intersector) const
+{
+	bool hit = false;
+	uint32_t stack[maxDepth];
+	int stackSize = 0;
+	uint32_t current = root;
+	while (true)
+	{
+		BVHNode const& node = nodeArray[current];
+		if (intersectSlabs(node.bounds, *ray))
+		{
+			if (node.isLeaf())
+			{
+				if (intersector(node.primOffset, node.nPrims, ray))
+					hit = true;
+			}
+			else
+			{
+				// Visit the near child first
+				if (ray->dirIsNeg(node.axis))
+				{
+					stack[stackSize++] = current + 1;
+					current = node.secondChild;
+				}
+				else
+				{
+					stack[stackSize++] = node.secondChild;
+					++current;
+				}
+				continue;
+			}
+		}
+		if (!stackSize) break;
+		current = stack[--stackSize];
+	}
+	return hit;
+}
+template <typename Predicate> inline bool
+BVH::intersectAny(RenderRay<3> const& ray, Predicate&& predicate) const
+{
+	if (!nNodesTotal) return false;
+
+	uint32_t stack[maxDepth];
+	int stackSize = 0;
+	uint32_t current = 0;
+	while (true)
+	{
+		BVHNode const& node = nodeArray[current];
+		if (intersectSlabs(node.bounds, ray))
+		{
+			if (node.isLeaf())
+			{
+				for (uint32_t i = 0; i < node.nPrims; ++i)
+					if (predicate(indices[node.primOffset + i], ray))
+						return true;
+			}
+			else
+			{
+				stack[stackSize++] = node.secondChild;
+				++current;
+				continue;
+			}
+		}
+		if (!stackSize) break;
+		current = stack[--stackSize];
+	}
+	return false;
+}
+
+inline constexpr int BVH::maxSparseLanes(int width)
+{
+	// A packet in one register is tested as fast as a single ray
+	return width <= nativeWidth<real>() ? 0 : width / 4;
+}
+template <int width, typename Intersector> inline int
+BVH::intersect(RayPacket<width>* const packet, int mask,
+               Intersector&& intersector) const
+{
+	if (!nNodesTotal || !mask) return 0;
+
+	int hit = 0;
+	// Traces a lane through the subtree of root
+	auto intersectLane = [&](uint32_t root, int lane)
+	{
+		RenderRay<3> ray = packet->ray(lane);
+		bool const laneHit = intersectSubtree(root, &ray,
+			[&](uint32_t primOffset, uint32_t nPrims, RenderRay<3>* const r)
+			{
+				bool primHit = false;
+				for (uint32_t i = 0; i < nPrims; ++i)
+					if (intersector(indices[primOffset + i], packet, 1 << lane))
+						primHit = true;
+				r->tMax() = packet->tMax[lane];
+				return primHit;
+			});
+		if (laneHit) hit |= 1 << lane;
+	};
+	if (packet->octant < 0)
+	{
+		// Incoherent packet
+		for (int m = mask; m; m &= m - 1)
+			intersectLane(0, countTrailingZeros((uint32_t) m));
+		return hit;
+	}
+
+	struct StackEntry
+	{
+		uint32_t node;
+		int mask;
+	};
+	StackEntry stack[maxDepth];
+	int stackSize = 0;
+	uint32_t current = 0;
+	int active = mask;
+	while (true)
+	{
+		BVHNode const& node = nodeArray[current];
+		Pack<real, width> tNear;
+		// Packets within one register are tested as fast as their frustum
+		if ((width <= nativeWidth<real>() || intersectFrustum(node.bounds, *packet)) &&
+		    (active = intersectSlabs(node.bounds, *packet, active, &tNear)))
+		{
+			if (node.isLeaf())
+			{
+				for (uint32_t i = 0; i < node.nPrims; ++i)
+					hit |= intersector(indices[node.primOffset + i], packet, active);
+			}
+			else if (countSetBits((uint32_t) active) <= maxSparseLanes(width))
+			{
+				for (int m = active; m; m &= m - 1)
+					intersectLane(current, countTrailingZeros((uint32_t) m));
+			}
+			else
+			{
+				// All the directions share their signs, hence the near child
+				if (packet->octant >> node.axis & 1)
+				{
+					stack[stackSize++] = { current + 1, active };
+					current = node.secondChild;
+				}
+				else
+				{
+					stack[stackSize++] = { node.secondChild, active };
+					++current;
+				}
+				continue;
+			}
+		}
+		if (!stackSize) break;
+		--stackSize;
+		current = stack[stackSize].node;
+		active = stack[stackSize].mask;
+	}
+	return hit;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_ACCEL_BVH_HPP_
@@ -0,0 +1,400 @@
+#ifndef PHOTINO_ACCEL_BVHWIDE_HPP_
+#define PHOTINO_ACCEL_BVHWIDE_HPP_
+
+#include <cmath>
+#include <cstring>
+
+#include "BVH.hpp"
+#include "../math/integers.hpp"
+#include "../math/simd.hpp"
+
+namespace photino
+{
+
+/**
+ * The bounds of the children are stored in single precision SoA lanes,
+ * rounded outwards. bounds[0] holds the lower corners and bounds[1] the upper
+ * corners. Unused slots have empty bounds.
+ *
+ * @brief Node of a wide bounding volume hierarchy.
+ */
+template <int width>
+struct alignas(PHOTINO_MEMALIGN) BVHWideNode
+{
+	static constexpr uint32_t const invalid = UINT32_MAX;
+
+	float bounds[2][3][width];
+	/**
+	 * Node index of an interior child, or offset into the primitive indices of
+	 * a leaf child
+	 */
+	uint32_t child[width];
+	uint16_t nPrims[width]; ///< 0 for interior children
+
+	bool isLeaf(int i) const;
+};
+
+/**
+ * Each node tests one ray against all of its children at once and visits
+ * the children front to back.
+ *
+ * @brief Wide bounding volume hierarchy obtained by collapsing a binary BVH.
+ * @tparam width Number of children per node, 4 (SSE) or 8 (AVX)
+ */
+template <int width>
+class BVHWide final
+{
+public:
+	static constexpr int const maxStack = BVH::maxDepth * (width - 1);
+
+	explicit BVHWide(BVH const&);
+	BVHWide(BVHWide const&) = delete;
+	BVHWide& operator=(BVHWide const&) = delete;
+
+	std::size_t nNodes() const;
+	BVHWideNode<width> const* nodes() const;
+	uint32_t const* primIndices() const;
+
+	/**
+	 * @brief See \ref BVH::intersect
+	 */
+	template <typename Intersector> bool
+	intersect(RenderRay<3>* const ray, Intersector&& intersector) const;
+	/**
+	 * @brief See \ref BVH::intersectAny
+	 */
+	template <typename Predicate> bool
+	intersectAny(RenderRay<3> const&, Predicate&& predicate) const;
+
+private:
+	/**
+	 * @brief Reference to a child in the traversal stack
+	 */
+	struct StackEntry
+	{
+		uint32_t child;
+		uint16_t nPrims;
+		float tNear;
+	};
+
+	/**
+	 * @brief Collapses the subtree of the binary node into wide nodes.
+	 * @return Index of the wide node
+	 */
+	uint32_t collapse(BVH const&, uint32_t binaryNode,
+	                  std::vector<BVHWideNode<width>>* const);
+	/**
+	 * @brief Converts a ray extent to single precision, saturating at the
+	 *  largest float.
+	 */
+	static float toFloat(real);
+	/**
+	 * @brief Largest float not above x
+	 */
+	static float toFloatDown(real x);
+	/**
+	 * @brief Smallest float not below x
+	 */
+	static float toFloatUp(real x);
+	/**
+	 * The origin is rounded towards the near planes in oNear and towards the
+	 * far planes in oFar, so that the distances to the planes, which the
+	 * error of the origin would otherwise offset by up to half an ulp of its
+	 * coordinates, are underestimated to the near planes and overestimated
+	 * to the far ones. Hits near an origin far from zero are thus kept.
+	 *
+	 * @brief Broadcasts the origin and reciprocal direction to all lanes
+	 */
+	static void broadcast(RenderRay<3> const&, Pack<float, width>* const oNear,
+	                      Pack<float, width>* const oFar,
+	                      Pack<float, width>* const invDir);
+	/**
+	 * @brief Tests the ray against the children of a node.
+	 * @return Mask of the children hit
+	 */
+	int intersectChildren(BVHWideNode<width> const&, RenderRay<3> const&,
+	                      Pack<float, width> const oNear[3],
+	                      Pack<float, width> const oFar[3],
+	                      Pack<float, width> const invDir[3],
+	                      Pack<float, width>* const tNear) const;
+
+	MemoryPool pool;
+	BVHWideNode<width>* nodeArray;
+	std::size_t nNodesTotal;
+	std::vector<uint32_t> indices;
+};
+
+typedef BVHWide<4> BVH4;
+typedef BVHWide<8> BVH8;
+
+
+// Implementations
+
+template <int width> inline bool
+BVHWideNode<width>::isLeaf(int i) const
+{
+	return nPrims[i] > 0;
+}
+
+template <int width> inline
+BVHWide<width>::BVHWide(BVH const& bvh):
+	nodeArray(nullptr), nNodesTotal(0),
+	indices(bvh.primIndices(), bvh.primIndices() + bvh.nPrims())
+{
+	if (!bvh.nNodes()) return;
+
+	std::vector<BVHWideNode<width>> nodes;
+	collapse(bvh, 0, &nodes);
+
+	// First allocation of the pool, hence aligned to PHOTINO_MEMALIGN
+	nNodesTotal = nodes.size();
+	nodeArray = pool.alloc<BVHWideNode<width>>(nNodesTotal);
+	std::memcpy(nodeArray, nodes.data(), nNodesTotal * sizeof(BVHWideNode<width>));
+}
+
+template <int width> inline std::size_t
+BVHWide<width>::nNodes() const
+{
+	return nNodesTotal;
+}
+template <int width> inline BVHWideNode<width> const*
+BVHWide<width>::nodes() const
+{
+	return nodeArray;
+}
+template <int width> inline uint32_t const*
+BVHWide<width>::primIndices() const
+{
+	return indices.data();
+}
+
+template <int width> inline uint32_t
+BVHWide<width>::collapse(BVH const& bvh, uint32_t binaryNode,
+                         std::vector<BVHWideNode<width>>* const nodes)
+{
+	BVHNode const* const binary = bvh.nodes();
+
+	// Open the interior child with the largest area until the node is full
+	uint32_t children[width];
+	int nChildren = 0;
+	if (binary[binaryNode].isLeaf())
+		children[nChildren++] = binaryNode;
+	else
+	{
+		children[nChildren++] = binaryNode + 1;
+		children[nChildren++] = binary[binaryNode].secondChild;
+	}
+	while (nChildren < width)
+	{
+		int best = -1;
+		real bestArea = -1;
+		for (int i = 0; i < nChildren; ++i)
+		{
+			BVHNode const& node = binary[children[i]];
+			if (!node.isLeaf() && surfaceArea(node.bounds) > bestArea)
+			{
+				best = i;
+				bestArea = surfaceArea(node.bounds);
+			}
+		}
+		if (best < 0) break;
+		uint32_t const opened = children[best];
+		children[best] = opened + 1;
+		children[nChildren++] = binary[opened].secondChild;
+	}
+
+	uint32_t const index = (uint32_t) nodes->size();
+	nodes->emplace_back();
+	for (int i = 0; i < width; ++i)
+	{
+		float lower[3], upper[3];
+		uint32_t child = BVHWideNode<width>::invalid;
+		uint16_t nPrims = 0;
+		if (i < nChildren)
+		{
+			BVHNode const& node = binary[children[i]];
+			// Round outwards so that the bounds remain conservative
+			for (int j = 0; j < 3; ++j)
+			{
+				lower[j] = toFloatDown(node.bounds.min()[j]);
+				upper[j] = toFloatUp(node.bounds.max()[j]);
+			}
+			if (node.isLeaf())
+			{
+				child = node.primOffset;
+				nPrims = node.nPrims;
+			}
+			else
+				child = collapse(bvh, children[i], nodes);
+		}
+		else
+			for (int j = 0; j < 3; ++j)
+			{
+				lower[j] = std::numeric_limits<float>::infinity();
+				upper[j] = -std::numeric_limits<float>::infinity();
+			}
+
+		// The vector may have been reallocated by the recursion
+		BVHWideNode<width>& wide = (*nodes)[index];
+		for (int j = 0; j < 3; ++j)
+		{
+			wide.bounds[0][j][i] = lower[j];
+			wide.bounds[1][j][i] = upper[j];
+		}
+		wide.child[i] = child;
+		wide.nPrims[i] = nPrims;
+	}
+	return index;
+}
+
+template <int width> inline float
+BVHWide<width>::toFloat(real t)
+{
+	return (float) std::min(t, (real) std::numeric_limits<float>::max());
+}
+template <int width> inline float
+BVHWide<width>::toFloatDown(real x)
+{
+	float const f = (float) x;
+	return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity())
+	             : f;
+}
+template <int width> inline float
+BVHWide<width>::toFloatUp(real x)
+{
+	float const f = (float) x;
+	return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity())
+	             : f;
+}
+template <int width> inline void
+BVHWide<width>::broadcast(RenderRay<3> const& ray,
+                          Pack<float, width>* const oNear,
+                          Pack<float, width>* const oFar,
+                          Pack<float, width>* const invDir)
+{
+	typedef Pack<float, width> P;
+	for (int j = 0; j < 3; ++j)
+	{
+		// Along a negative direction the near plane is the upper one
+		float const down = toFloatDown(ray.origin()[j]);
+		float const up = toFloatUp(ray.origin()[j]);
+		oNear[j] = P::set1(ray.dirIsNeg(j) ? down : up);
+		oFar[j] = P::set1(ray.dirIsNeg(j) ? up : down);
+		invDir[j] = P::set1((float) ray.invDirection()[j]);
+	}
+}
+template <int width> inline int
+BVHWide<width>::intersectChildren(BVHWideNode<width> const& node,
+                                  RenderRay<3> const& ray,
+                                  Pack<float, width> const oNear[3],
+                                  Pack<float, width> const oFar[3],
+                                  Pack<float, width> const invDir[3],
+                                  Pack<float, width>* const tNear) const
+{
+	typedef Pack<float, width> P;
+	P t0 = P::set1(0);
+	P t1 = P::set1(toFloat(ray.tMax()));
+	for (int j = 0; j < 3; ++j)
+	{
+		P const near = P::load(node.bounds[ray.dirIsNeg(j)][j]);
+		P const far = P::load(node.bounds[1 - ray.dirIsNeg(j)][j]);
+		// NaNs, from origins on a plane parallel to the ray, are the first
+		// operands so that they are ignored as in the scalar test
+		t0 = max((near - oNear[j]) * invDir[j], t0);
+		t1 = min((far - oFar[j]) * invDir[j], t1);
+	}
+	// Conservative far distance, robust against rounding
+	t1 = t1 * P::set1(1 + 4 * std::numeric_limits<float>::epsilon());
+	*tNear = t0;
+	return maskLessEqual(t0, t1);
+}
+
+template <int width>
+template <typename Intersector> inline bool
+BVHWide<width>::intersect(RenderRay<3>* const ray,
+                          Intersector&& intersector) const
+{
+	if (!nNodesTotal) return false;
+
+	typedef Pack<float, width> P;
+	P oNear[3], oFar[3], invDir[3];
+	broadcast(*ray, oNear, oFar, invDir);
+
+	bool hit = false;
+	StackEntry stack[maxStack];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0 };
+	while (stackSize)
+	{
+		StackEntry const entry = stack[--stackSize];
+		if (entry.tNear > ray->tMax()) continue;
+
+		if (entry.nPrims)
+		{
+			for (uint32_t i = 0; i < entry.nPrims; ++i)
+				if (intersector(indices[entry.child + i], ray))
+					hit = true;
+			continue;
+		}
+
+		BVHWideNode<width> const& node = nodeArray[entry.child];
+		P tNear;
+		int mask = intersectChildren(node, *ray, oNear, oFar, invDir, &tNear);
+		if (!mask) continue;
+
+		// Sort the children hit far to near so the nearest is popped first
+		alignas(sizeof(P)) float tNears[width];
+		tNear.store(tNears);
+		int const base = stackSize;
+		for (; mask; mask &= mask - 1)
+		{
+			int const i = countTrailingZeros((uint32_t) mask);
+			StackEntry const child = { node.child[i], node.nPrims[i], tNears[i] };
+			int j = stackSize++;
+			for (; j > base && stack[j - 1].tNear < child.tNear; --j)
+				stack[j] = stack[j - 1];
+			stack[j] = child;
+		}
+	}
+	return hit;
+}
+template <int width>
+template <typename Predicate> inline bool
+BVHWide<width>::intersectAny(RenderRay<3> const& ray,
+                             Predicate&& predicate) const
+{
+	if (!nNodesTotal) return false;
+
+	typedef Pack<float, width> P;
+	P oNear[3], oFar[3], invDir[3];
+	broadcast(ray, oNear, oFar, invDir);
+
+	StackEntry stack[maxStack];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0 };
+	while (stackSize)
+	{
+		StackEntry const entry = stack[--stackSize];
+		if (entry.nPrims)
+		{
+			for (uint32_t i = 0; i < entry.nPrims; ++i)
+				if (predicate(indices[entry.child + i], ray))
+					return true;
+			continue;
+		}
+
+		BVHWideNode<width> const& node = nodeArray[entry.child];
+		P tNear;
+		int mask = intersectChildren(node, ray, oNear, oFar, invDir, &tNear);
+		for (; mask; mask &= mask - 1)
+		{
+			int const i = countTrailingZeros((uint32_t) mask);
+			stack[stackSize++] = { node.child[i], node.nPrims[i], 0 };
+		}
+	}
+	return false;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_ACCEL_BVHWIDE_HPP_
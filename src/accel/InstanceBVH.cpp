@@ -0,0 +1,32 @@
+#include "InstanceBVH.hpp"
+
+namespace photino
+{
+
+InstanceBVH::InstanceBVH(Instance const* instances, std::size_t nInstances,
+                         unsigned int nThreads):
+	instances(instances, instances + nInstances),
+	inverses(nInstances, TransformAffine<3>::identity())
+{
+	std::vector<BoxAxisAligned<3>> bounds(nInstances);
+	parallelChunks(0, nInstances, nThreads ? nThreads : 1,
+	               [&](std::size_t first, std::size_t last, unsigned int)
+	{
+		for (std::size_t i = first; i < last; ++i)
+		{
+			Instance const& instance = instances[i];
+			BoxAxisAligned<3> const object = instance.blas->bounds();
+			if (instance.motion)
+				bounds[i] = instance.motion->motionBounds(object);
+			else
+			{
+				bounds[i] = instance.transform->trBoxAA(object);
+				inverses[i] = inverse(*instance.transform);
+			}
+		}
+	});
+	// Entering an instance is costly, so leaves hold one where possible
+	top.reset(new BVH(bounds.data(), nInstances, 1, nThreads));
+}
+
+} // namespace photino
@@ -0,0 +1,175 @@
+#ifndef PHOTINO_ACCEL_INSTANCEBVH_HPP_
+#define PHOTINO_ACCEL_INSTANCEBVH_HPP_
+
+#include <memory>
+#include <vector>
+
+#include "BVH.hpp"
+#include "../math/InterpTransform3.hpp"
+
+namespace photino
+{
+
+/**
+ * @brief Placement of shared geometry in the world
+ */
+struct Instance
+{
+	BVH const* blas; ///< Bottom-level hierarchy, in object space
+	/**
+	 * Object to world transform, used if \ref motion is null
+	 */
+	TransformAffine<3> const* transform;
+	InterpTransform3 const* motion; ///< Animated object to world transform
+};
+
+/**
+ * A top-level BVH is built over the world bounds of the instances. A ray
+ * reaching an instance is transformed into object space and traverses the
+ * bottom-level BVH of the instance, which is shared by reference. The memory
+ * therefore grows with the unique geometry, plus a transform per instance.
+ *
+ * Transforms are affine and directions are not renormalised, so distances
+ * along a ray are the same in world and object space.
+ *
+ * @brief Two-level bounding volume hierarchy over instances
+ */
+class InstanceBVH final
+{
+public:
+	/**
+	 * @param[in] instances Instances, whose hierarchies and transforms must
+	 *  outlive the object.
+	 * @param[in] nInstances Number of instances
+	 * @param[in] nThreads Number of threads used to build the top level
+	 */
+	InstanceBVH(Instance const* instances, std::size_t nInstances,
+	            unsigned int nThreads = nHardwareThreads());
+	InstanceBVH(InstanceBVH const&) = delete;
+	InstanceBVH& operator=(InstanceBVH const&) = delete;
+
+	BoxAxisAligned<3> bounds() const;
+	std::size_t nInstances() const;
+	Instance const& instance(std::size_t) const;
+	/**
+	 * @brief Top-level hierarchy, whose primitives are the instances
+	 */
+	BVH const& tlas() const;
+
+	/**
+	 * @brief Transforms a world space ray into the object space of an
+	 *  instance, at the time of the ray.
+	 */
+	RenderRay<3> toObject(std::size_t instance, RenderRay<3> const&) const;
+	RayDifferential<3> toObject(std::size_t instance, real time,
+	                            RayDifferential<3> const&) const;
+
+	/**
+	 * @brief Finds the closest intersection along the ray.
+	 * @param[inout] ray Its extent is shrunk to the closest intersection.
+	 * @param[in] intersector Called as
+	 *  intersector(instanceIndex, primIndex, objectRay) for each candidate
+	 *  primitive, where objectRay is in the object space of the instance. It
+	 *  must return true and shrink objectRay->tMax() upon hitting the
+	 *  primitive.
+	 * @return true if any primitive is hit
+	 */
+	template <typename Intersector> bool
+	intersect(RenderRay<3>* const ray, Intersector&& intersector) const;
+	/**
+	 * @brief Determines whether any primitive intersects the ray.
+	 * @param[in] predicate Called as
+	 *  predicate(instanceIndex, primIndex, objectRay).
+	 */
+	template <typename Predicate> bool
+	intersectAny(RenderRay<3> const&, Predicate&& predicate) const;
+
+private:
+	/**
+	 * @brief Object from world transform at the given time
+	 */
+	TransformAffine<3> objectFromWorld(std::size_t instance, real time) const;
+
+	std::vector<Instance> instances;
+	/**
+	 * Inverses of the transforms of the static instances, precomputed so that
+	 * traversal does not copy them
+	 */
+	std::vector<TransformAffine<3>, Eigen::aligned_allocator<TransformAffine<3>>>
+		inverses;
+	std::unique_ptr<BVH> top;
+};
+
+
+// Implementations
+
+inline BoxAxisAligned<3> InstanceBVH::bounds() const
+{
+	return top->bounds();
+}
+inline std::size_t InstanceBVH::nInstances() const
+{
+	return instances.size();
+}
+inline Instance const& InstanceBVH::instance(std::size_t i) const
+{
+	return instances[i];
+}
+inline BVH const& InstanceBVH::tlas() const
+{
+	return *top;
+}
+
+inline TransformAffine<3>
+InstanceBVH::objectFromWorld(std::size_t i, real time) const
+{
+	return inverse(instances[i].motion->interpolate(time));
+}
+inline RenderRay<3>
+InstanceBVH::toObject(std::size_t i, RenderRay<3> const& r) const
+{
+	if (instances[i].motion)
+		return objectFromWorld(i, r.time()).trRay(r);
+	return inverses[i].trRay(r);
+}
+inline RayDifferential<3>
+InstanceBVH::toObject(std::size_t i, real time,
+                      RayDifferential<3> const& rd) const
+{
+	if (instances[i].motion)
+		return objectFromWorld(i, time).trRayD(rd);
+	return inverses[i].trRayD(rd);
+}
+
+template <typename Intersector> inline bool
+InstanceBVH::intersect(RenderRay<3>* const ray, Intersector&& intersector) const
+{
+	return top->intersect(ray, [&](uint32_t i, RenderRay<3>* const r)
+	{
+		RenderRay<3> objectRay = toObject(i, *r);
+		bool const hit = instances[i].blas->intersect(&objectRay,
+			[&](uint32_t prim, RenderRay<3>* const objRay)
+			{
+				return intersector(i, prim, objRay);
+			});
+		if (hit) r->tMax() = objectRay.tMax();
+		return hit;
+	});
+}
+template <typename Predicate> inline bool
+InstanceBVH::intersectAny(RenderRay<3> const& ray, Predicate&& predicate) const
+{
+	return top->intersectAny(ray, [&](uint32_t i, RenderRay<3> const& r)
+	{
+		RenderRay<3> const objectRay = toObject(i, r);
+		return instances[i].blas->intersectAny(objectRay,
+			[&](uint32_t prim, RenderRay<3> const& objRay)
+			{
+				return predicate(i, prim, objRay);
+			});
+	});
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_ACCEL_INSTANCEBVH_HPP_
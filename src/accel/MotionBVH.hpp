@@ -0,0 +1,323 @@
+#ifndef PHOTINO_ACCEL_MOTIONBVH_HPP_
+#define PHOTINO_ACCEL_MOTIONBVH_HPP_
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "BVH.hpp"
+#include "../math/InterpTransform3.hpp"
+
+namespace photino
+{
+
+/**
+ * @brief Node of a \ref MotionBVH. It holds one box per time segment, in the
+ *  same depth-first layout as \ref BVHNode.
+ */
+template <int nSegments>
+struct alignas(32) MotionBVHNode
+{
+	BoxAxisAligned<3> bounds[nSegments];
+	union
+	{
+		uint32_t primOffset; ///< Leaf: Offset into \ref MotionBVH::primIndices
+		uint32_t secondChild; ///< Interior: Index of the second child
+	};
+	uint16_t nPrims; ///< 0 for interior nodes
+	uint8_t axis; ///< Split axis of interior nodes
+
+	bool isLeaf() const;
+};
+
+/**
+ * The shutter interval [time0, time1] is split into nSegments segments of
+ * equal duration, and every node bounds its primitives over each of them
+ * separately. A ray only tests the boxes of the segment containing its time,
+ * which are much tighter than the swept bounds of fast-moving primitives.
+ *
+ * The topology is built by \ref BVH over the bounds of the whole shutter
+ * interval, then the per-segment bounds are refitted bottom-up.
+ *
+ * @brief Bounding volume hierarchy over moving primitives
+ * @tparam nSegments Number of time segments
+ */
+template <int nSegments>
+class MotionBVH final
+{
+	static_assert(nSegments >= 1, "At least one time segment is required");
+public:
+	static constexpr int const maxDepth = BVH::maxDepth;
+
+	/**
+	 * @param[in] bounds Bounds of the primitives over each segment, with
+	 *  bounds[i * nSegments + s] for primitive i and segment s. See
+	 *  \ref segmentBounds.
+	 * @param[in] nPrims Number of primitives
+	 * @param[in] time0 Start of the shutter interval
+	 * @param[in] time1 End of the shutter interval
+	 * @param[in] maxPrimsInNode See \ref BVH::BVH
+	 * @param[in] nThreads See \ref BVH::BVH
+	 */
+	MotionBVH(BoxAxisAligned<3> const* bounds, std::size_t nPrims,
+	          real time0, real time1, int maxPrimsInNode = 4,
+	          unsigned int nThreads = nHardwareThreads());
+	MotionBVH(MotionBVH const&) = delete;
+	MotionBVH& operator=(MotionBVH const&) = delete;
+
+	/**
+	 * @brief Bounds the motion of a box over each segment of the shutter
+	 *  interval.
+	 * @param[out] bounds Array of nSegments boxes
+	 */
+	static void segmentBounds(InterpTransform3 const&,
+	                          BoxAxisAligned<3> const& box,
+	                          real time0, real time1,
+	                          BoxAxisAligned<3>* const bounds);
+
+	/**
+	 * @brief Bounds over the whole shutter interval
+	 */
+	BoxAxisAligned<3> bounds() const;
+	BoxAxisAligned<3> bounds(int segment) const;
+	real startTime() const;
+	real endTime() const;
+	/**
+	 * @return Segment containing the instant, clamped to the shutter interval
+	 */
+	int segmentOf(real time) const;
+
+	std::size_t nPrims() const;
+	std::size_t nNodes() const;
+	MotionBVHNode<nSegments> const* nodes() const;
+	/**
+	 * @brief Indices of the primitives, in the order referred to by the leaves
+	 */
+	uint32_t const* primIndices() const;
+
+	/**
+	 * @brief See \ref BVH::intersect. The boxes tested are those of the
+	 *  segment containing ray->time().
+	 */
+	template <typename Intersector> bool
+	intersect(RenderRay<3>* const ray, Intersector&& intersector) const;
+	/**
+	 * @brief See \ref BVH::intersectAny
+	 */
+	template <typename Predicate> bool
+	intersectAny(RenderRay<3> const&, Predicate&& predicate) const;
+
+private:
+	MemoryPool pool;
+	MotionBVHNode<nSegments>* nodeArray;
+	std::size_t nNodesTotal;
+	std::vector<uint32_t> indices;
+	real time[2];
+	real segmentsPerTime;
+};
+
+
+// Implementations
+
+template <int nSegments> inline bool
+MotionBVHNode<nSegments>::isLeaf() const
+{
+	return nPrims > 0;
+}
+
+template <int nSegments> inline
+MotionBVH<nSegments>::MotionBVH(BoxAxisAligned<3> const* bounds,
+                                std::size_t nPrims, real time0, real time1,
+                                int maxPrimsInNode, unsigned int nThreads):
+	nodeArray(nullptr), nNodesTotal(0), indices(nPrims), time{time0, time1},
+	segmentsPerTime(time1 > time0 ? nSegments / (time1 - time0) : 0)
+{
+	if (!nPrims) return;
+
+	std::vector<BoxAxisAligned<3>> swept(nPrims);
+	for (std::size_t i = 0; i < nPrims; ++i)
+		for (int s = 0; s < nSegments; ++s)
+			swept[i] |= bounds[i * nSegments + s];
+	BVH const topology(swept.data(), nPrims, maxPrimsInNode, nThreads);
+	std::copy(topology.primIndices(), topology.primIndices() + nPrims,
+	          indices.begin());
+
+	nNodesTotal = topology.nNodes();
+	nodeArray = pool.alloc<MotionBVHNode<nSegments>>(nNodesTotal);
+	// Children follow their parent, so a reverse sweep refits them first
+	for (std::size_t i = nNodesTotal; i-- > 0;)
+	{
+		BVHNode const& source = topology.nodes()[i];
+		MotionBVHNode<nSegments>& node = nodeArray[i];
+		node.nPrims = source.nPrims;
+		node.axis = source.axis;
+		if (source.isLeaf())
+		{
+			node.primOffset = source.primOffset;
+			for (int s = 0; s < nSegments; ++s)
+			{
+				node.bounds[s].setEmpty();
+				for (uint32_t j = 0; j < node.nPrims; ++j)
+				{
+					uint32_t const prim = indices[node.primOffset + j];
+					node.bounds[s] |= bounds[prim * nSegments + s];
+				}
+			}
+		}
+		else
+		{
+			node.secondChild = source.secondChild;
+			for (int s = 0; s < nSegments; ++s)
+				node.bounds[s] = nodeArray[i + 1].bounds[s] |
+				                 nodeArray[node.secondChild].bounds[s];
+		}
+	}
+}
+
+template <int nSegments> inline void
+MotionBVH<nSegments>::segmentBounds(InterpTransform3 const& transform,
+                                    BoxAxisAligned<3> const& box,
+                                    real time0, real time1,
+                                    BoxAxisAligned<3>* const bounds)
+{
+	real const step = (time1 - time0) / nSegments;
+	for (int s = 0; s < nSegments; ++s)
+	{
+		real const end = s == nSegments - 1 ? time1 : time0 + (s + 1) * step;
+		bounds[s] = transform.motionBounds(box, time0 + s * step, end);
+	}
+}
+
+template <int nSegments> inline BoxAxisAligned<3>
+MotionBVH<nSegments>::bounds() const
+{
+	BoxAxisAligned<3> result;
+	if (nNodesTotal)
+		for (int s = 0; s < nSegments; ++s)
+			result |= nodeArray[0].bounds[s];
+	return result;
+}
+template <int nSegments> inline BoxAxisAligned<3>
+MotionBVH<nSegments>::bounds(int segment) const
+{
+	return nNodesTotal ? nodeArray[0].bounds[segment] : BoxAxisAligned<3>();
+}
+template <int nSegments> inline real
+MotionBVH<nSegments>::startTime() const
+{
+	return time[0];
+}
+template <int nSegments> inline real
+MotionBVH<nSegments>::endTime() const
+{
+	return time[1];
+}
+template <int nSegments> inline int
+MotionBVH<nSegments>::segmentOf(real ti) const
+{
+	real const s = (ti - time[0]) * segmentsPerTime;
+	// Also maps NaN to the first segment
+	if (!(s > 0)) return 0;
+	return s < nSegments ? (int) s : nSegments - 1;
+}
+template <int nSegments> inline std::size_t
+MotionBVH<nSegments>::nPrims() const
+{
+	return indices.size();
+}
+template <int nSegments> inline std::size_t
+MotionBVH<nSegments>::nNodes() const
+{
+	return nNodesTotal;
+}
+template <int nSegments> inline MotionBVHNode<nSegments> const*
+MotionBVH<nSegments>::nodes() const
+{
+	return nodeArray;
+}
+template <int nSegments> inline uint32_t const*
+MotionBVH<nSegments>::primIndices() const
+{
+	return indices.data();
+}
+
+template <int nSegments> template <typename Intersector> inline bool
+MotionBVH<nSegments>::intersect(RenderRay<3>* const ray,
+                                Intersector&& intersector) const
+{
+	if (!nNodesTotal) return false;
+
+	int const segment = segmentOf(ray->time());
+	bool hit = false;
+	uint32_t stack[maxDepth];
+	int stackSize = 0;
+	uint32_t current = 0;
+	while (true)
+	{
+		MotionBVHNode<nSegments> const& node = nodeArray[current];
+		if (intersectSlabs(node.bounds[segment], *ray))
+		{
+			if (node.isLeaf())
+			{
+				for (uint32_t i = 0; i < node.nPrims; ++i)
+					if (intersector(indices[node.primOffset + i], ray))
+						hit = true;
+			}
+			else
+			{
+				// Visit the near child first
+				if (ray->dirIsNeg(node.axis))
+				{
+					stack[stackSize++] = current + 1;
+					current = node.secondChild;
+				}
+				else
+				{
+					stack[stackSize++] = node.secondChild;
+					++current;
+				}
+				continue;
+			}
+		}
+		if (!stackSize) break;
+		current = stack[--stackSize];
+	}
+	return hit;
+}
+template <int nSegments> template <typename Predicate> inline bool
+MotionBVH<nSegments>::intersectAny(RenderRay<3> const& ray,
+                                   Predicate&& predicate) const
+{
+	if (!nNodesTotal) return false;
+
+	int const segment = segmentOf(ray.time());
+	uint32_t stack[maxDepth];
+	int stackSize = 0;
+	uint32_t current = 0;
+	while (true)
+	{
+		MotionBVHNode<nSegments> const& node = nodeArray[current];
+		if (intersectSlabs(node.bounds[segment], ray))
+		{
+			if (node.isLeaf())
+			{
+				for (uint32_t i = 0; i < node.nPrims; ++i)
+					if (predicate(indices[node.primOffset + i], ray))
+						return true;
+			}
+			else
+			{
+				stack[stackSize++] = node.secondChild;
+				++current;
+				continue;
+			}
+		}
+		if (!stackSize) break;
+		current = stack[--stackSize];
+	}
+	return false;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_ACCEL_MOTIONBVH_HPP_
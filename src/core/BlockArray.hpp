@@ -1,6 +1,7 @@
 #ifndef PHOTINO_CORE_BLOCKARRAY_HPP_
 #define PHOTINO_CORE_BLOCKARRAY_HPP_
 
+#include <algorithm>
 #include <cstdint>
 
 extern "C"
@@ -13,7 +14,63 @@ extern "C"
 namespace photino
 {
 
-template <typename T, int logBlockSize>
+/**
+ * @brief Blocks stored row by row, each block with row-major contents.
+ */
+class LayoutRowMajor final
+{
+public:
+	LayoutRowMajor(std::size_t mBlocks, std::size_t nBlocks);
+
+	/**
+	 * @brief Number of blocks allocated
+	 */
+	std::size_t nSlots() const;
+	/**
+	 * @brief Position of block (jBlock, kBlock) among the allocated blocks
+	 */
+	std::size_t slot(std::size_t jBlock, std::size_t kBlock) const;
+	/**
+	 * @brief Position of element (j, k) within a block of side 2^logBlockSize
+	 */
+	template <int logBlockSize> static
+	std::size_t offset(std::size_t j, std::size_t k);
+
+private:
+	std::size_t mBlocks, nBlocks;
+};
+/**
+ * The block grid is padded to a power of two in each dimension. Blocks follow
+ * Z-order over the largest square sub-grids, which are stored one after
+ * another along the longer dimension.
+ *
+ * @brief Blocks and their contents stored in Z-order (Morton order), so that
+ *  elements close in both dimensions are close in memory.
+ * @warning Padding the grid may allocate up to four times the blocks of
+ *  \ref LayoutRowMajor.
+ */
+class LayoutMorton final
+{
+public:
+	LayoutMorton(std::size_t mBlocks, std::size_t nBlocks);
+
+	std::size_t nSlots() const;
+	std::size_t slot(std::size_t jBlock, std::size_t kBlock) const;
+	template <int logBlockSize> static
+	std::size_t offset(std::size_t j, std::size_t k);
+
+private:
+	std::size_t mPadded, nPadded;
+	int logSquare; ///< Log side of the square sub-grids
+};
+
+/**
+ * @brief Two-dimensional array stored in square blocks of side
+ *  2^logBlockSize.
+ * @tparam Layout Order of the blocks and of the elements within each block.
+ *  Either \ref LayoutRowMajor or \ref LayoutMorton.
+ */
+template <typename T, int logBlockSize, typename Layout = LayoutRowMajor>
 class BlockArray
 {
 public:
@@ -25,6 +82,8 @@ public:
 	 */
 	BlockArray(std::size_t m, std::size_t n);
 	~BlockArray();
+	BlockArray(BlockArray const&) = delete;
+	BlockArray& operator=(BlockArray const&) = delete;
 
 	std::size_t width() const;
 	std::size_t height() const;
@@ -32,6 +91,26 @@ public:
 	T operator()(std::size_t j, std::size_t k) const;
 	T& operator()(std::size_t j, std::size_t k);
 
+	/**
+	 * @brief Number of blocks along the first and second dimensions
+	 */
+	std::size_t blocksM() const;
+	std::size_t blocksN() const;
+	/**
+	 * @brief Contiguous storage of the blockSize * blockSize elements of block
+	 *  (jBlock, kBlock). Element (jOffset, kOffset) of the block is at
+	 *  Layout::offset<logBlockSize>(jOffset, kOffset).
+	 */
+	T const* blockData(std::size_t jBlock, std::size_t kBlock) const;
+	T* blockData(std::size_t jBlock, std::size_t kBlock);
+	/**
+	 * @brief Fetches the 2x2 neighbourhood of (j, k) for bilinear filtering,
+	 *  clamping at the edges.
+	 * @param[out] result Elements (j, k), (j, k + 1), (j + 1, k) and
+	 *  (j + 1, k + 1), in this order
+	 */
+	void quad(std::size_t j, std::size_t k, T result[4]) const;
+
 //private:
 	/**
 	 * @brief Evaluates i / blockSize using bitwise operations
@@ -45,70 +124,155 @@ public:
 	std::size_t arraySize() const;
 
 	std::size_t m, n;
-	std::size_t rowBlocks;
+	Layout const layout;
 	T* const data;
 };
 
 
 // Implementations
-template <typename T, int logBlockSize> inline
-BlockArray<T, logBlockSize>::BlockArray(std::size_t m, std::size_t n):
-	m(m), n(n), rowBlocks(roundUpModulo(m, blockSize) >> logBlockSize),
+
+inline LayoutRowMajor::LayoutRowMajor(std::size_t mBlocks, std::size_t nBlocks):
+	mBlocks(mBlocks), nBlocks(nBlocks)
+{
+}
+inline std::size_t LayoutRowMajor::nSlots() const
+{
+	return mBlocks * nBlocks;
+}
+inline std::size_t
+LayoutRowMajor::slot(std::size_t jBlock, std::size_t kBlock) const
+{
+	return jBlock * nBlocks + kBlock;
+}
+template <int logBlockSize> inline std::size_t
+LayoutRowMajor::offset(std::size_t j, std::size_t k)
+{
+	return (j << logBlockSize) + k;
+}
+
+inline LayoutMorton::LayoutMorton(std::size_t mBlocks, std::size_t nBlocks):
+	mPadded(roundUpPow2((uint64_t) std::max<std::size_t>(mBlocks, 1))),
+	nPadded(roundUpPow2((uint64_t) std::max<std::size_t>(nBlocks, 1))),
+	logSquare(log2Int((uint32_t) std::min(mPadded, nPadded)))
+{
+}
+inline std::size_t LayoutMorton::nSlots() const
+{
+	return mPadded * nPadded;
+}
+inline std::size_t
+LayoutMorton::slot(std::size_t jBlock, std::size_t kBlock) const
+{
+	std::size_t const mask = (std::size_t(1) << logSquare) - 1;
+	// Only the longer dimension has bits above the square
+	std::size_t const square = (jBlock | kBlock) >> logSquare;
+	return (square << (2 * logSquare)) |
+	       encodeMorton2((uint32_t) (kBlock & mask), (uint32_t) (jBlock & mask));
+}
+template <int logBlockSize> inline std::size_t
+LayoutMorton::offset(std::size_t j, std::size_t k)
+{
+	static_assert(logBlockSize <= 16, "Block too large for 32 bit Morton codes");
+	return encodeMorton2((uint32_t) k, (uint32_t) j);
+}
+
+template <typename T, int logBlockSize, typename Layout> inline
+BlockArray<T, logBlockSize, Layout>::BlockArray(std::size_t m, std::size_t n):
+	m(m), n(n),
+	layout(roundUpModulo(m, blockSize) >> logBlockSize,
+	       roundUpModulo(n, blockSize) >> logBlockSize),
 	data((T* const) alloc_aligned(arraySize() * sizeof(T), PHOTINO_MEMALIGN))
 {
 }
-template <typename T, int logBlockSize> inline
-BlockArray<T, logBlockSize>::~BlockArray()
+template <typename T, int logBlockSize, typename Layout> inline
+BlockArray<T, logBlockSize, Layout>::~BlockArray()
 {
 	free_aligned(data);
 }
 
-template <typename T, int logBlockSize> inline std::size_t
-BlockArray<T, logBlockSize>::width() const
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::width() const
 {
 	return m;
 }
-template <typename T, int logBlockSize> inline std::size_t
-BlockArray<T, logBlockSize>::height() const
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::height() const
 {
 	return n;
 }
-template <typename T, int logBlockSize> inline T
-BlockArray<T, logBlockSize>::operator()(std::size_t j, std::size_t k) const
+template <typename T, int logBlockSize, typename Layout> inline T
+BlockArray<T, logBlockSize, Layout>::operator()(std::size_t j, std::size_t k) const
+{
+	return blockData(blockIndex(j), blockIndex(k))
+	       [Layout::template offset<logBlockSize>(blockOffset(j), blockOffset(k))];
+}
+template <typename T, int logBlockSize, typename Layout> inline T&
+BlockArray<T, logBlockSize, Layout>::operator()(std::size_t j, std::size_t k)
+{
+	return blockData(blockIndex(j), blockIndex(k))
+	       [Layout::template offset<logBlockSize>(blockOffset(j), blockOffset(k))];
+}
+
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::blocksM() const
+{
+	return roundUpModulo(m, blockSize) >> logBlockSize;
+}
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::blocksN() const
+{
+	return roundUpModulo(n, blockSize) >> logBlockSize;
+}
+template <typename T, int logBlockSize, typename Layout> inline T const*
+BlockArray<T, logBlockSize, Layout>::blockData(std::size_t jBlock,
+                                               std::size_t kBlock) const
+{
+	return data + blockSize * blockSize * layout.slot(jBlock, kBlock);
+}
+template <typename T, int logBlockSize, typename Layout> inline T*
+BlockArray<T, logBlockSize, Layout>::blockData(std::size_t jBlock,
+                                               std::size_t kBlock)
 {
-	std::size_t jBlock = blockIndex(j);
-	std::size_t kBlock = blockIndex(k);
-	std::size_t jOffset = blockOffset(j);
-	std::size_t kOffset = blockOffset(k);
-	std::size_t bOffset = blockSize * blockSize * (jBlock * rowBlocks + kBlock);
-	return data[bOffset + jOffset * blockSize + kOffset];
+	return data + blockSize * blockSize * layout.slot(jBlock, kBlock);
 }
-template <typename T, int logBlockSize> inline T&
-BlockArray<T, logBlockSize>::operator()(std::size_t j, std::size_t k)
+template <typename T, int logBlockSize, typename Layout> inline void
+BlockArray<T, logBlockSize, Layout>::quad(std::size_t j, std::size_t k,
+                                          T result[4]) const
 {
-	std::size_t jBlock = blockIndex(j);
-	std::size_t kBlock = blockIndex(k);
-	std::size_t jOffset = blockOffset(j);
-	std::size_t kOffset = blockOffset(k);
-	std::size_t bOffset = blockSize * blockSize * (jBlock * rowBlocks + kBlock);
-	return data[bOffset + jOffset * blockSize + kOffset];
+	std::size_t const j1 = j + 1 < m ? j + 1 : j;
+	std::size_t const k1 = k + 1 < n ? k + 1 : k;
+	if (blockIndex(j) != blockIndex(j1) || blockIndex(k) != blockIndex(k1))
+	{
+		result[0] = (*this)(j, k);
+		result[1] = (*this)(j, k1);
+		result[2] = (*this)(j1, k);
+		result[3] = (*this)(j1, k1);
+		return;
+	}
+	// Common case: the neighbourhood lies within one block
+	T const* const block = blockData(blockIndex(j), blockIndex(k));
+	std::size_t const jOffset[2] = { blockOffset(j), blockOffset(j1) };
+	std::size_t const kOffset[2] = { blockOffset(k), blockOffset(k1) };
+	for (int i = 0; i < 4; ++i)
+		result[i] = block[Layout::template offset<logBlockSize>(jOffset[i >> 1],
+		                                                        kOffset[i & 1])];
 }
 
 
-template <typename T, int logBlockSize> inline std::size_t
-BlockArray<T, logBlockSize>::blockIndex(std::size_t i) const
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::blockIndex(std::size_t i) const
 {
 	return i >> logBlockSize;
 }
-template <typename T, int logBlockSize> inline std::size_t
-BlockArray<T, logBlockSize>::blockOffset(std::size_t i) const
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::blockOffset(std::size_t i) const
 {
 	return i & (blockSize - 1);
 }
-template <typename T, int logBlockSize> inline std::size_t
-BlockArray<T, logBlockSize>::arraySize() const
+template <typename T, int logBlockSize, typename Layout> inline std::size_t
+BlockArray<T, logBlockSize, Layout>::arraySize() const
 {
-	return roundUpModulo(m, blockSize) * roundUpModulo(n, blockSize);
+	return layout.nSlots() * blockSize * blockSize;
 }
 } // namespace photino
 
@@ -0,0 +1,187 @@
+#ifndef PHOTINO_CORE_BLOCKCACHE_HPP_
+#define PHOTINO_CORE_BLOCKCACHE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+extern "C"
+{
+#include "memory.h"
+}
+#include "photino.hpp"
+
+namespace photino
+{
+
+/**
+ * Free blocks are kept in a lock-free stack whose links are stored in the
+ * blocks themselves. The head packs a 16 bit ABA tag in the upper bits of the
+ * pointer, which are unused by user space addresses on x86-64 and AArch64.
+ *
+ * The tag prevents ABA but not the reclamation of a block whose link is read
+ * by a concurrent pop, after the block was popped by another thread and
+ * released. Threads popping are therefore counted, and a block is freed only
+ * when none is: any later pop starts from a head which no longer leads to the
+ * block. A block released beyond the capacity while a pop is in progress is
+ * retained instead, so the capacity may be exceeded under contention.
+ *
+ * @brief Thread-safe reservoir of memory blocks of one size, shared by
+ *  \ref MemoryPool instances.
+ */
+class BlockCache final
+{
+public:
+	/**
+	 * @brief Cache of blocks of the default MemoryPool block size, with no
+	 *  limit on retained memory.
+	 */
+	static BlockCache& global();
+
+	/**
+	 * @param[in] capacity Maximum number of bytes retained by the cache
+	 */
+	explicit BlockCache(std::size_t blockSize = 0x10000,
+	                    std::size_t capacity = SIZE_MAX);
+	~BlockCache();
+	BlockCache(BlockCache const&) = delete;
+	BlockCache& operator=(BlockCache const&) = delete;
+
+	std::size_t blockSize() const;
+	std::size_t capacity() const;
+	/**
+	 * @brief Blocks released beyond the capacity are freed. Blocks already
+	 *  retained are not trimmed.
+	 */
+	void setCapacity(std::size_t);
+	/**
+	 * @brief Number of bytes currently retained
+	 */
+	std::size_t retained() const;
+
+	/**
+	 * @return A block of \ref blockSize bytes aligned to PHOTINO_MEMALIGN.
+	 *  Reuses a retained block if possible.
+	 */
+	uint8_t* acquire();
+	/**
+	 * @brief Returns a block obtained from \ref acquire to the cache. The block
+	 *  is freed if the cache is full and no thread is acquiring.
+	 */
+	void release(uint8_t*);
+
+private:
+	struct FreeBlock
+	{
+		// Atomic since a concurrent pop may read it while the block is reused
+		std::atomic<FreeBlock*> next;
+	};
+
+	static constexpr int const tagShift = 48;
+	static constexpr uint64_t const pointerMask = (uint64_t(1) << tagShift) - 1;
+
+	static FreeBlock* pointerOf(uint64_t);
+	static uint64_t pack(FreeBlock*, uint64_t tagOld);
+
+	std::size_t const size;
+	std::atomic<std::size_t> nMax;
+	std::atomic<std::size_t> nRetained;
+	std::atomic<uint64_t> head;
+	std::atomic<unsigned int> nPopping; ///< Threads reading links in acquire
+};
+
+
+// Implementations
+
+inline BlockCache& BlockCache::global()
+{
+	static BlockCache cache;
+	return cache;
+}
+
+inline BlockCache::BlockCache(std::size_t blockSize, std::size_t capacity):
+	size(blockSize), nMax(capacity / blockSize), nRetained(0), head(0),
+	nPopping(0)
+{
+	static_assert(sizeof(void*) == sizeof(uint64_t),
+	              "Tagged pointers require 64 bit addresses");
+}
+inline BlockCache::~BlockCache()
+{
+	while (FreeBlock* block = pointerOf(head.load()))
+	{
+		head = pack(block->next.load(std::memory_order_relaxed), 0);
+		free_aligned(block);
+	}
+}
+
+inline std::size_t BlockCache::blockSize() const
+{
+	return size;
+}
+inline std::size_t BlockCache::capacity() const
+{
+	return nMax * size;
+}
+inline void BlockCache::setCapacity(std::size_t capacity)
+{
+	nMax = capacity / size;
+}
+inline std::size_t BlockCache::retained() const
+{
+	return nRetained * size;
+}
+
+inline uint8_t* BlockCache::acquire()
+{
+	// Sequentially consistent, so that release either sees this thread or
+	// has removed its block from the stack before the head is loaded below
+	nPopping.fetch_add(1);
+	uint64_t old = head.load();
+	while (FreeBlock* block = pointerOf(old))
+	{
+		// next may be stale if another thread pops the block first, in which
+		// case the tag has changed and the exchange fails
+		FreeBlock* const next = block->next.load(std::memory_order_relaxed);
+		if (head.compare_exchange_weak(old, pack(next, old)))
+		{
+			nPopping.fetch_sub(1, std::memory_order_release);
+			--nRetained;
+			return reinterpret_cast<uint8_t*>(block);
+		}
+	}
+	nPopping.fetch_sub(1, std::memory_order_release);
+	return (uint8_t*) alloc_aligned(size, PHOTINO_MEMALIGN);
+}
+inline void BlockCache::release(uint8_t* ptr)
+{
+	// A pop in progress may have loaded a head leading to this block before
+	// it was acquired, and still read its link
+	if (nRetained.fetch_add(1) >= nMax && nPopping.load() == 0)
+	{
+		--nRetained;
+		free_aligned(ptr);
+		return;
+	}
+	FreeBlock* const block = new (ptr) FreeBlock;
+	uint64_t old = head.load(std::memory_order_relaxed);
+	do
+		block->next.store(pointerOf(old), std::memory_order_relaxed);
+	while (!head.compare_exchange_weak(old, pack(block, old),
+	                                   std::memory_order_release,
+	                                   std::memory_order_relaxed));
+}
+
+inline BlockCache::FreeBlock* BlockCache::pointerOf(uint64_t packed)
+{
+	return reinterpret_cast<FreeBlock*>(packed & pointerMask);
+}
+inline uint64_t BlockCache::pack(FreeBlock* block, uint64_t tagOld)
+{
+	uint64_t const tag = (tagOld >> tagShift) + 1;
+	return (tag << tagShift) | reinterpret_cast<uint64_t>(block);
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_CORE_BLOCKCACHE_HPP_
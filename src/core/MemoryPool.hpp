@@ -1,14 +1,17 @@
 #ifndef PHOTINO_CORE_MEMORYPOOL_HPP_
 #define PHOTINO_CORE_MEMORYPOOL_HPP_
 
+#include <cassert>
 #include <queue>
 #include <cstdint>
+#include <vector>
 
 extern "C"
 {
 #include "memory.h"
 }
 #include "photino.hpp"
+#include "BlockCache.hpp"
 
 namespace photino
 {
@@ -16,8 +19,21 @@ namespace photino
 class MemoryPool
 {
 public:
-	MemoryPool(std::size_t blockSize = 0x10000);
+	/**
+	 * @brief Pool of the calling thread, which recycles its blocks through
+	 *  \ref BlockCache::global.
+	 */
+	static MemoryPool& local();
+
+	/**
+	 * @param[in] cache If not null, blocks are acquired from and returned to the
+	 *  cache instead of being kept by this pool. Its block size must be equal
+	 *  to blockSize.
+	 */
+	MemoryPool(std::size_t blockSize = 0x10000, BlockCache* cache = nullptr);
 	~MemoryPool();
+	MemoryPool(MemoryPool const&) = delete;
+	MemoryPool& operator=(MemoryPool const&) = delete;
 
 	/**
 	 * @warning This function is not responsible for in-place constructing the
@@ -41,32 +57,75 @@ public:
 	 */
 	template <typename T> T* alloc_ctor();
 
+	/**
+	 * @brief Frees all allocations. The blocks are kept for reuse, or returned
+	 *  to the cache if there is one.
+	 */
 	void freeAll();
 
+	/**
+	 * @brief Number of bytes allocated since the last \ref freeAll
+	 */
+	std::size_t usage() const;
+	/**
+	 * @brief Maximum of \ref usage over the lifetime of the pool
+	 */
+	std::size_t peakUsage() const;
+
 private:
+	uint8_t* newBlock(std::size_t size);
+
 	std::size_t blockSize;
 	std::size_t index;
+	BlockCache* const cache;
+	std::size_t bytesUsed;
+	std::size_t bytesPeak;
 
 	uint8_t* block;
 	std::vector<uint8_t*> blocksFull;
 	std::vector<uint8_t*> blocksEmpty;
-
+	/**
+	 * Blocks larger than blockSize, which cannot be returned to the cache
+	 */
+	std::vector<uint8_t*> blocksLarge;
 };
 
 
 // Implementations
 
-inline MemoryPool::MemoryPool(std::size_t blockSize):
-	blockSize(blockSize), index(0),
-	block((uint8_t*) alloc_aligned(blockSize, PHOTINO_MEMALIGN))
+inline MemoryPool& MemoryPool::local()
+{
+	thread_local MemoryPool pool(BlockCache::global().blockSize(),
+	                             &BlockCache::global());
+	return pool;
+}
+
+inline MemoryPool::MemoryPool(std::size_t blockSize, BlockCache* cache):
+	blockSize(blockSize), index(0), cache(cache), bytesUsed(0), bytesPeak(0)
 {
+	assert((!cache || cache->blockSize() == blockSize) &&
+	       "Block size differs from the cache");
+	// Not in the initialiser list, since it reads the block lists
+	block = newBlock(blockSize);
 }
 inline MemoryPool::~MemoryPool()
 {
-	for (uint8_t* block : blocksFull)
+	if (cache)
+	{
+		cache->release(block);
+		for (uint8_t* block : blocksFull)
+			cache->release(block);
+	}
+	else
+	{
 		free_aligned(block);
+		for (uint8_t* block : blocksFull)
+			free_aligned(block);
+	}
 	for (uint8_t* block : blocksEmpty)
 		free_aligned(block);
+	for (uint8_t* block : blocksLarge)
+		free_aligned(block);
 }
 
 template <typename T> inline T*
@@ -87,18 +146,18 @@ template <> inline uint8_t*
 MemoryPool::alloc(std::size_t size)
 {
 	size = ((size + 0xF) & (~0xF)); // Align to 0x10
+	bytesUsed += size;
+	if (bytesUsed > bytesPeak) bytesPeak = bytesUsed;
 	if (index + size > blockSize) // Block full. Needs new block
 	{
-		blocksFull.push_back(block);
-
-		if (blocksEmpty.size() && size <= blockSize)
+		if (cache && size > blockSize)
 		{
-			block = blocksEmpty.back();
-			blocksEmpty.pop_back();
+			// Keep filling the current block afterwards
+			blocksLarge.push_back((uint8_t*) alloc_aligned(size, PHOTINO_MEMALIGN));
+			return blocksLarge.back();
 		}
-		else
-			block = (uint8_t*) alloc_aligned(size > blockSize ? size : blockSize,
-			                                 PHOTINO_MEMALIGN);
+		blocksFull.push_back(block);
+		block = newBlock(size);
 		index = 0;
 	}
 	uint8_t* result = block + index;
@@ -120,9 +179,41 @@ MemoryPool::alloc_ctor()
 inline void MemoryPool::freeAll()
 {
 	index = 0;
-	blocksEmpty.insert(blocksEmpty.end(), blocksFull.begin(), blocksFull.end());
+	bytesUsed = 0;
+	if (cache)
+	{
+		for (uint8_t* block : blocksFull)
+			cache->release(block);
+		for (uint8_t* block : blocksLarge)
+			free_aligned(block);
+		blocksLarge.clear();
+	}
+	else
+		blocksEmpty.insert(blocksEmpty.end(), blocksFull.begin(), blocksFull.end());
 	blocksFull.clear();
 }
+inline std::size_t MemoryPool::usage() const
+{
+	return bytesUsed;
+}
+inline std::size_t MemoryPool::peakUsage() const
+{
+	return bytesPeak;
+}
+
+inline uint8_t* MemoryPool::newBlock(std::size_t size)
+{
+	if (cache)
+		return cache->acquire();
+	if (blocksEmpty.size() && size <= blockSize)
+	{
+		uint8_t* const result = blocksEmpty.back();
+		blocksEmpty.pop_back();
+		return result;
+	}
+	return (uint8_t*) alloc_aligned(size > blockSize ? size : blockSize,
+	                                PHOTINO_MEMALIGN);
+}
 
 } // namespace photino
 
@@ -0,0 +1,304 @@
+#ifndef PHOTINO_CORE_RANDOM_HPP_
+#define PHOTINO_CORE_RANDOM_HPP_
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "photino.hpp"
+
+namespace photino
+{
+
+/*
+ * Both engines satisfy UniformRandomBitGenerator and produce the same
+ * sequences on every platform and standard library.
+ */
+
+/**
+ * @brief Permuted congruential generator PCG-XSH-RR with 64 bits of state and
+ *  32 bit output (O'Neill 2014).
+ */
+class PCG32 final
+{
+public:
+	typedef uint32_t result_type;
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT32_MAX; }
+
+	/**
+	 * @param[in] stream Selects one of 2^63 independent sequences in O(1)
+	 */
+	explicit PCG32(uint64_t seed = 0x853C49E6748FEA9BULL,
+	               uint64_t stream = 0xDA3E39CB94B95BDBULL);
+
+	void seed(uint64_t seed, uint64_t stream);
+	result_type operator()();
+	/**
+	 * @brief Uniformly distributed number in [0, 1)
+	 */
+	real uniform();
+	/**
+	 * @brief Skips delta outputs (or rewinds if negative) in O(log delta).
+	 */
+	void advance(int64_t delta);
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+/**
+ * The output is a bijection of a 128 bit counter under a 64 bit key, so any
+ * element of the sequence is obtained in O(1) and streams never overlap. The
+ * counter is (block, sample, pixel), where each block yields four outputs.
+ *
+ * @brief Counter-based generator Philox4x32-10 (Salmon et al. 2011).
+ */
+class Philox4x32 final
+{
+public:
+	typedef uint32_t result_type;
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT32_MAX; }
+
+	explicit Philox4x32(uint64_t seed = 0);
+
+	/**
+	 * @brief Positions the generator at the start of the stream of a sample of
+	 *  a pixel.
+	 * @param[in] dimension Number of outputs of the stream to skip
+	 */
+	void setStream(uint64_t pixel, uint32_t sample, uint32_t dimension = 0);
+
+	result_type operator()();
+	/**
+	 * @brief Uniformly distributed number in [0, 1)
+	 */
+	real uniform();
+	/**
+	 * @brief Writes the next n outputs, equal to those of n calls to
+	 *  operator(). Uses AVX2 when available.
+	 */
+	void generate(uint32_t* const out, std::size_t n);
+
+	/**
+	 * @brief The ten rounds of Philox applied to one counter.
+	 */
+	static void bijection(uint32_t counter[4], uint32_t const key[2]);
+
+private:
+	/**
+	 * @brief Writes the outputs of nBlocks consecutive blocks starting at the
+	 *  current counter, and advances the counter.
+	 */
+	void generateBlocks(uint32_t* const out, std::size_t nBlocks);
+
+	uint32_t key[2];
+	uint32_t counter[4];
+	uint32_t buffer[4];
+	int index; ///< Next output in buffer. 4 if the buffer is exhausted.
+};
+
+typedef PCG32 Random;
+
+/**
+ * @brief Maps 32 random bits to [0, 1)
+ */
+real uniformFromBits(uint32_t);
+/**
+ * @brief Avalanching hash of 64 bits (SplitMix64 finaliser), to derive seeds
+ *  from pixel and sample indices.
+ */
+uint64_t mixBits(uint64_t);
+
+
+// Implementations
+
+inline real uniformFromBits(uint32_t bits)
+{
+	// Rounding may yield 1 in single precision
+	constexpr real const oneMinusEpsilon = 1 - std::numeric_limits<real>::epsilon() / 2;
+	real const x = bits * real(0x1p-32);
+	return x < oneMinusEpsilon ? x : oneMinusEpsilon;
+}
+
+inline uint64_t mixBits(uint64_t v)
+{
+	v ^= v >> 31;
+	v *= 0x7FB5D329728EA185ULL;
+	v ^= v >> 27;
+	v *= 0x81DADEF4BC2DD44DULL;
+	v ^= v >> 33;
+	return v;
+}
+
+inline PCG32::PCG32(uint64_t seed, uint64_t stream)
+{
+	this->seed(seed, stream);
+}
+inline void PCG32::seed(uint64_t seed, uint64_t stream)
+{
+	state = 0;
+	inc = (stream << 1) | 1;
+	(*this)();
+	state += seed;
+	(*this)();
+}
+inline PCG32::result_type PCG32::operator()()
+{
+	uint64_t const old = state;
+	state = old * 0x5851F42D4C957F2DULL + inc;
+	uint32_t const xorShifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+	uint32_t const rot = (uint32_t) (old >> 59);
+	return (xorShifted >> rot) | (xorShifted << ((~rot + 1) & 31));
+}
+inline real PCG32::uniform()
+{
+	return uniformFromBits((*this)());
+}
+inline void PCG32::advance(int64_t delta)
+{
+	// Composes the affine map x -> a x + c with itself by squaring
+	uint64_t a = 0x5851F42D4C957F2DULL, c = inc;
+	uint64_t aAcc = 1, cAcc = 0;
+	for (uint64_t d = (uint64_t) delta; d; d >>= 1)
+	{
+		if (d & 1)
+		{
+			aAcc *= a;
+			cAcc = cAcc * a + c;
+		}
+		c = (a + 1) * c;
+		a *= a;
+	}
+	state = aAcc * state + cAcc;
+}
+
+inline Philox4x32::Philox4x32(uint64_t seed):
+	key{ (uint32_t) seed, (uint32_t) (seed >> 32) },
+	counter{ 0, 0, 0, 0 }, index(4)
+{
+}
+inline void Philox4x32::setStream(uint64_t pixel, uint32_t sample,
+                                  uint32_t dimension)
+{
+	counter[0] = dimension / 4;
+	counter[1] = sample;
+	counter[2] = (uint32_t) pixel;
+	counter[3] = (uint32_t) (pixel >> 32);
+	index = 4;
+	if (dimension % 4)
+	{
+		generateBlocks(buffer, 1);
+		index = dimension % 4;
+	}
+}
+inline Philox4x32::result_type Philox4x32::operator()()
+{
+	if (index == 4)
+	{
+		generateBlocks(buffer, 1);
+		index = 0;
+	}
+	return buffer[index++];
+}
+inline real Philox4x32::uniform()
+{
+	return uniformFromBits((*this)());
+}
+inline void Philox4x32::generate(uint32_t* const out, std::size_t n)
+{
+	std::size_t i = 0;
+	for (; i < n && index < 4; ++i)
+		out[i] = buffer[index++];
+	std::size_t const nBlocks = (n - i) / 4;
+	generateBlocks(out + i, nBlocks);
+	for (i += nBlocks * 4; i < n; ++i)
+		out[i] = (*this)();
+}
+
+inline void Philox4x32::bijection(uint32_t counter[4], uint32_t const key[2])
+{
+	uint32_t k0 = key[0], k1 = key[1];
+	for (int round = 0; round < 10; ++round)
+	{
+		uint64_t const p0 = uint64_t(0xD2511F53) * counter[0];
+		uint64_t const p1 = uint64_t(0xCD9E8D57) * counter[2];
+		uint32_t const c1 = counter[1], c3 = counter[3];
+		counter[0] = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+		counter[1] = (uint32_t) p1;
+		counter[2] = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+		counter[3] = (uint32_t) p0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+}
+inline void Philox4x32::generateBlocks(uint32_t* const out, std::size_t nBlocks)
+{
+	std::size_t b = 0;
+#ifdef __AVX2__
+	// Eight counters at a time, one per lane, with the words in SoA
+	__m256i const m0 = _mm256_set1_epi32((int) 0xD2511F53);
+	__m256i const m1 = _mm256_set1_epi32((int) 0xCD9E8D57);
+	__m256i const lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	for (; b + 8 <= nBlocks; b += 8)
+	{
+		__m256i c0 = _mm256_add_epi32(_mm256_set1_epi32((int) counter[0]), lanes);
+		__m256i c1 = _mm256_set1_epi32((int) counter[1]);
+		__m256i c2 = _mm256_set1_epi32((int) counter[2]);
+		__m256i c3 = _mm256_set1_epi32((int) counter[3]);
+		uint32_t k0 = key[0], k1 = key[1];
+		for (int round = 0; round < 10; ++round)
+		{
+			// Products of the even lanes and of the odd lanes, 64 bits each
+			__m256i const p0Even = _mm256_mul_epu32(c0, m0);
+			__m256i const p0Odd = _mm256_mul_epu32(_mm256_srli_epi64(c0, 32), m0);
+			__m256i const p1Even = _mm256_mul_epu32(c2, m1);
+			__m256i const p1Odd = _mm256_mul_epu32(_mm256_srli_epi64(c2, 32), m1);
+			__m256i const lo0 = _mm256_blend_epi32(p0Even,
+			                                       _mm256_slli_epi64(p0Odd, 32), 0xAA);
+			__m256i const hi0 = _mm256_blend_epi32(_mm256_srli_epi64(p0Even, 32),
+			                                       p0Odd, 0xAA);
+			__m256i const lo1 = _mm256_blend_epi32(p1Even,
+			                                       _mm256_slli_epi64(p1Odd, 32), 0xAA);
+			__m256i const hi1 = _mm256_blend_epi32(_mm256_srli_epi64(p1Even, 32),
+			                                       p1Odd, 0xAA);
+			c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1),
+			                      _mm256_set1_epi32((int) k0));
+			c1 = lo1;
+			c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3),
+			                      _mm256_set1_epi32((int) k1));
+			c3 = lo0;
+			k0 += 0x9E3779B9;
+			k1 += 0xBB67AE85;
+		}
+		alignas(32) uint32_t words[4][8];
+		_mm256_store_si256((__m256i*) words[0], c0);
+		_mm256_store_si256((__m256i*) words[1], c1);
+		_mm256_store_si256((__m256i*) words[2], c2);
+		_mm256_store_si256((__m256i*) words[3], c3);
+		for (int lane = 0; lane < 8; ++lane)
+			for (int w = 0; w < 4; ++w)
+				out[4 * (b + lane) + w] = words[w][lane];
+		counter[0] += 8;
+	}
+#endif // __AVX2__
+	for (; b < nBlocks; ++b)
+	{
+		uint32_t block[4];
+		std::memcpy(block, counter, sizeof(block));
+		bijection(block, key);
+		std::memcpy(out + 4 * b, block, sizeof(block));
+		++counter[0];
+	}
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_CORE_RANDOM_HPP_
@@ -0,0 +1,86 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+
+namespace photino
+{
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool(nHardwareThreads() - 1);
+	return pool;
+}
+
+ThreadPool::ThreadPool(unsigned int nWorkers):
+	stopping(false)
+{
+	threads.reserve(nWorkers);
+	for (unsigned int i = 0; i < nWorkers; ++i)
+		threads.emplace_back([this]() { work(); });
+}
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+void ThreadPool::runJob(Job* const job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(job);
+	}
+	if (job->n - 1 >= threads.size())
+		wake.notify_all();
+	else
+		for (unsigned int i = 1; i < job->n; ++i)
+			wake.notify_one();
+
+	for (unsigned int i; (i = job->next++) < job->n;)
+		execute(job, i);
+
+	// The job lives on the stack of the caller, so it must not be left in the
+	// queue, and the calls claimed by workers must return
+	std::unique_lock<std::mutex> lock(mutex);
+	auto const it = std::find(jobs.begin(), jobs.end(), job);
+	if (it != jobs.end()) jobs.erase(it);
+	done.wait(lock, [job]() { return job->nDone.load() == job->n; });
+}
+
+void ThreadPool::execute(Job* const job, unsigned int i)
+{
+	job->call(job->context, i);
+	// The job may be destroyed as soon as nDone reaches n, so it is not
+	// accessed after the increment
+	unsigned int const n = job->n;
+	if (job->nDone.fetch_add(1) + 1 == n)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done.notify_all();
+	}
+}
+
+void ThreadPool::work()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+		if (jobs.empty()) return;
+		Job* const job = jobs.front();
+		unsigned int const i = job->next++;
+		if (i + 1 >= job->n) jobs.pop_front();
+		if (i >= job->n) continue;
+
+		lock.unlock();
+		execute(job, i);
+		lock.lock();
+	}
+}
+
+} // namespace photino
@@ -0,0 +1,147 @@
+#ifndef PHOTINO_CORE_PARALLEL_HPP_
+#define PHOTINO_CORE_PARALLEL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace photino
+{
+
+/**
+ * @brief Number of hardware threads, or 1 if it cannot be determined.
+ */
+unsigned int nHardwareThreads();
+
+/**
+ * Workers are started once and wait for jobs. A job is a set of n calls,
+ * which are claimed one at a time by the idle workers and by the calling
+ * thread. The calling thread runs the calls that no worker claims, so a job
+ * completes even if every worker is busy, and jobs may be started from within
+ * a call of another job without deadlock.
+ *
+ * @brief Persistent pool of worker threads
+ */
+class ThreadPool final
+{
+public:
+	/**
+	 * @brief Pool of nHardwareThreads() - 1 workers, started on first use,
+	 *  which together with the calling thread occupy every hardware thread.
+	 */
+	static ThreadPool& global();
+
+	explicit ThreadPool(unsigned int nWorkers);
+	~ThreadPool();
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	unsigned int nWorkers() const;
+
+	/**
+	 * @brief Calls f(i) for each i in [0, n), concurrently on the workers and
+	 *  the calling thread. Returns when all the calls have returned.
+	 */
+	template <typename F> void run(unsigned int n, F&& f);
+
+private:
+	struct Job
+	{
+		void (*call)(void* context, unsigned int i);
+		void* context;
+		unsigned int n;
+		std::atomic<unsigned int> next; ///< Next call to claim
+		std::atomic<unsigned int> nDone;
+	};
+
+	void runJob(Job* const);
+	/**
+	 * @brief Runs call i of a job and signals the job if it was the last.
+	 */
+	void execute(Job* const, unsigned int i);
+	void work();
+
+	std::mutex mutex;
+	std::condition_variable wake; ///< Signalled when a job is queued
+	std::condition_variable done; ///< Signalled when a job completes
+	std::deque<Job*> jobs; ///< Jobs with calls left to claim
+	bool stopping;
+	std::vector<std::thread> threads;
+};
+
+/**
+ * The chunks run on the threads of \ref ThreadPool::global, and at most
+ * nThreads of them concurrently. The index of a chunk is not the index of a
+ * thread, but no two calls with the same index overlap, so it may index
+ * scratch space.
+ *
+ * @brief Splits [begin, end) into nThreads contiguous chunks and calls
+ *  f(chunkBegin, chunkEnd, chunkIndex) for each of them. The calling thread
+ *  takes part. Returns when all chunks are processed.
+ */
+template <typename F> void
+parallelChunks(std::size_t begin, std::size_t end, unsigned int nThreads,
+               F&& f);
+
+
+// Implementations
+
+inline unsigned int nHardwareThreads()
+{
+	unsigned int const n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
+
+inline unsigned int ThreadPool::nWorkers() const
+{
+	return (unsigned int) threads.size();
+}
+template <typename F> inline void
+ThreadPool::run(unsigned int n, F&& f)
+{
+	typedef typename std::remove_reference<F>::type Function;
+	if (n <= 1 || threads.empty())
+	{
+		for (unsigned int i = 0; i < n; ++i)
+			f(i);
+		return;
+	}
+	Job job;
+	job.call = [](void* context, unsigned int i)
+	{
+		(*static_cast<Function*>(context))(i);
+	};
+	job.context = (void*) &f;
+	job.n = n;
+	job.next = 0;
+	job.nDone = 0;
+	runJob(&job);
+}
+
+template <typename F> inline void
+parallelChunks(std::size_t begin, std::size_t end, unsigned int nThreads,
+               F&& f)
+{
+	if (nThreads <= 1 || end - begin < 2)
+	{
+		f(begin, end, 0U);
+		return;
+	}
+	std::size_t const n = end - begin;
+	if (nThreads > n) nThreads = (unsigned int) n;
+
+	auto chunkBegin = [&](unsigned int i) { return begin + n * i / nThreads; };
+	ThreadPool::global().run(nThreads, [&](unsigned int i)
+	{
+		f(chunkBegin(i), chunkBegin(i + 1), i);
+	});
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_CORE_PARALLEL_HPP_
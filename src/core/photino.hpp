@@ -1,7 +1,6 @@
 #ifndef PHOTINO_CORE_PHOTINO_HPP_
 #define PHOTINO_CORE_PHOTINO_HPP_
 
-#include <random>
 #include <limits>
 
 namespace photino
@@ -9,11 +8,20 @@ namespace photino
 
 #define PHOTINO_MEMALIGN 64
 
+/*
+ * Configured by the CMake option PHOTINO_SINGLE_PRECISION
+ */
+#ifdef PHOTINO_SINGLE_PRECISION
+typedef float real;
+#else
 typedef double real;
+#endif
 #undef INFINITY
 constexpr real const INFINITY = std::numeric_limits<real>::max();
 
-typedef std::default_random_engine Random;
+/*
+ * Random is defined in Random.hpp
+ */
 
 } // namespace photino
 
@@ -0,0 +1,214 @@
+#ifndef PHOTINO_MATH_ANIMATEDTRANSFORM3_HPP_
+#define PHOTINO_MATH_ANIMATEDTRANSFORM3_HPP_
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "InterpTransform3.hpp"
+
+namespace photino
+{
+
+/**
+ * Consecutive keyframes are interpolated as by \ref InterpTransform3. Each
+ * keyframe is decomposed once and shared by the two segments adjacent to it.
+ * The segment of an instant is found in O(1) if the keyframes are uniformly
+ * spaced in time, and by binary search otherwise.
+ *
+ * @brief Piecewise interpolation of any number of 3D affine keyframes
+ */
+class AnimatedTransform3 final
+{
+public:
+	/**
+	 * @param[in] transforms Keyframes, which must outlive the object. Intern
+	 *  them with \ref TransformCache so that still segments are detected.
+	 * @param[in] times Increasing times of the keyframes
+	 * @param[in] n Number of keyframes, at least 1
+	 */
+	AnimatedTransform3(TransformAffine<3> const* const* transforms,
+	                   real const* times, std::size_t n);
+
+	std::size_t nKeyframes() const;
+	std::size_t nSegments() const;
+	real startTime() const;
+	real endTime() const;
+	/**
+	 * @return Index of the segment containing the instant, clamped to the
+	 *  animated range
+	 */
+	std::size_t segmentOf(real time) const;
+	InterpTransform3 const& segment(std::size_t) const;
+
+	TransformAffine<3> interpolate(real time) const;
+
+	Point<3> trPoint(real ti, Point<3> const&) const;
+	Vector<3> trVector(real ti, Vector<3> const&) const;
+	Normal<3> trNormal(real ti, Normal<3> const&) const;
+	Ray<3> trRay(real ti, Ray<3> const&) const;
+	/**
+	 * @brief Transforms the ray at its own time
+	 */
+	RenderRay<3> trRay(RenderRay<3> const&) const;
+	RayDifferential<3> trRayD(real ti, RayDifferential<3> const&) const;
+
+	/**
+	 * @brief Bounds of the motion over the whole animated range
+	 */
+	BoxAxisAligned<3> motionBounds(Point<3> const&) const;
+	BoxAxisAligned<3> motionBounds(BoxAxisAligned<3> const&) const;
+	/**
+	 * @brief Bounds of the motion of a box over each segment.
+	 * @param[out] bounds Array of \ref nSegments boxes
+	 */
+	void segmentBounds(BoxAxisAligned<3> const&,
+	                   BoxAxisAligned<3>* const bounds) const;
+
+private:
+	std::vector<real> times;
+	std::vector<InterpTransform3, Eigen::aligned_allocator<InterpTransform3>>
+		segments;
+	/**
+	 * Reciprocal of the time step if the keyframes are uniformly spaced, 0
+	 * otherwise.
+	 */
+	real invStep;
+};
+
+
+// Implementations
+
+inline AnimatedTransform3::AnimatedTransform3(
+  TransformAffine<3> const* const* transforms, real const* times,
+  std::size_t n):
+	times(times, times + n), invStep(0)
+{
+	assert(n > 0 && "No keyframes");
+
+	std::vector<Quaternion, Eigen::aligned_allocator<Quaternion>> rotations(n);
+	std::vector<Matrix<3>> scales(n);
+	decomposeLinear(transforms, n, rotations.data(), scales.data());
+
+	if (n == 1)
+	{
+		segments.emplace_back(transforms[0], times[0], transforms[0], times[0]);
+		return;
+	}
+	segments.reserve(n - 1);
+	for (std::size_t i = 0; i + 1 < n; ++i)
+	{
+		Quaternion const rotation[2] = { rotations[i], rotations[i + 1] };
+		Matrix<3> const scale[2] = { scales[i], scales[i + 1] };
+		segments.emplace_back(transforms[i], times[i],
+		                      transforms[i + 1], times[i + 1], rotation, scale);
+	}
+
+	real const step = (times[n - 1] - times[0]) / (n - 1);
+	bool uniform = step > 0;
+	for (std::size_t i = 1; i < n && uniform; ++i)
+		uniform = std::abs(times[i] - (times[0] + i * step)) <=
+		          4 * machineEpsilon * std::abs(times[n - 1]);
+	if (uniform) invStep = 1 / step;
+}
+
+inline std::size_t AnimatedTransform3::nKeyframes() const
+{
+	return times.size();
+}
+inline std::size_t AnimatedTransform3::nSegments() const
+{
+	return segments.size();
+}
+inline real AnimatedTransform3::startTime() const
+{
+	return times.front();
+}
+inline real AnimatedTransform3::endTime() const
+{
+	return times.back();
+}
+inline std::size_t AnimatedTransform3::segmentOf(real time) const
+{
+	if (!(time > times.front())) return 0;
+	if (time >= times.back()) return segments.size() - 1;
+	std::size_t i;
+	if (invStep > 0)
+	{
+		i = (std::size_t) ((time - times.front()) * invStep);
+		// Rounding may land one segment off
+		if (i >= segments.size()) i = segments.size() - 1;
+		if (time < times[i]) --i;
+		else if (time >= times[i + 1] && i + 1 < segments.size()) ++i;
+	}
+	else
+		i = std::upper_bound(times.begin(), times.end(), time) - times.begin() - 1;
+	return i;
+}
+inline InterpTransform3 const& AnimatedTransform3::segment(std::size_t i) const
+{
+	return segments[i];
+}
+
+inline TransformAffine<3> AnimatedTransform3::interpolate(real time) const
+{
+	return segments[segmentOf(time)].interpolate(time);
+}
+inline Point<3>
+AnimatedTransform3::trPoint(real ti, Point<3> const& p) const
+{
+	return segments[segmentOf(ti)].trPoint(ti, p);
+}
+inline Vector<3>
+AnimatedTransform3::trVector(real ti, Vector<3> const& v) const
+{
+	return segments[segmentOf(ti)].trVector(ti, v);
+}
+inline Normal<3>
+AnimatedTransform3::trNormal(real ti, Normal<3> const& n) const
+{
+	return segments[segmentOf(ti)].trNormal(ti, n);
+}
+inline Ray<3>
+AnimatedTransform3::trRay(real ti, Ray<3> const& r) const
+{
+	return segments[segmentOf(ti)].trRay(ti, r);
+}
+inline RenderRay<3>
+AnimatedTransform3::trRay(RenderRay<3> const& r) const
+{
+	return segments[segmentOf(r.time())].trRay(r);
+}
+inline RayDifferential<3>
+AnimatedTransform3::trRayD(real ti, RayDifferential<3> const& rd) const
+{
+	return segments[segmentOf(ti)].trRayD(ti, rd);
+}
+
+inline BoxAxisAligned<3>
+AnimatedTransform3::motionBounds(Point<3> const& p) const
+{
+	BoxAxisAligned<3> result;
+	for (InterpTransform3 const& s : segments)
+		result |= s.motionBounds(p);
+	return result;
+}
+inline BoxAxisAligned<3>
+AnimatedTransform3::motionBounds(BoxAxisAligned<3> const& b) const
+{
+	BoxAxisAligned<3> result;
+	for (InterpTransform3 const& s : segments)
+		result |= s.motionBounds(b);
+	return result;
+}
+inline void
+AnimatedTransform3::segmentBounds(BoxAxisAligned<3> const& b,
+                                  BoxAxisAligned<3>* const bounds) const
+{
+	for (std::size_t i = 0; i < segments.size(); ++i)
+		bounds[i] = segments[i].motionBounds(b);
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_MATH_ANIMATEDTRANSFORM3_HPP_
@@ -1,17 +1,215 @@
 #include "InterpTransform3.hpp"
 
+#include <algorithm>
+
 namespace photino
 {
 
+namespace
+{
+
+/**
+ * @brief Closed interval used to bound the derivative of the motion.
+ */
+struct Interval
+{
+	real low, high;
+
+	Interval(real v): low(v), high(v) {}
+	Interval(real v0, real v1):
+		low(std::min(v0, v1)), high(std::max(v0, v1)) {}
+};
+
+inline Interval operator+(Interval const& i0, Interval const& i1)
+{
+	return Interval(i0.low + i1.low, i0.high + i1.high);
+}
+inline Interval operator*(Interval const& i0, Interval const& i1)
+{
+	real const p[4] =
+	{
+		i0.low * i1.low, i0.high * i1.low,
+		i0.low * i1.high, i0.high * i1.high
+	};
+	return Interval(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+}
+/**
+ * @warning The interval must be contained in [0, 2 pi]
+ */
+inline Interval sin(Interval const& i)
+{
+	Interval result(std::sin(i.low), std::sin(i.high));
+	if (i.low < M_PI / 2 && i.high > M_PI / 2) result.high = 1;
+	if (i.low < 3 * M_PI / 2 && i.high > 3 * M_PI / 2) result.low = -1;
+	return result;
+}
+/**
+ * @warning The interval must be contained in [0, 2 pi]
+ */
+inline Interval cos(Interval const& i)
+{
+	Interval result(std::cos(i.low), std::cos(i.high));
+	if (i.low < M_PI && i.high > M_PI) result.low = -1;
+	return result;
+}
+
+/**
+ * @brief Symmetric bilinear form Q such that Q(q, q) is the rotation matrix of
+ *  the unit quaternion q.
+ */
+Matrix<3> quaternionBilinear(Quaternion const& q, Quaternion const& r)
+{
+	real const ww = q.w() * r.w(), xx = q.x() * r.x();
+	real const yy = q.y() * r.y(), zz = q.z() * r.z();
+	real const xy = q.x() * r.y() + q.y() * r.x();
+	real const xz = q.x() * r.z() + q.z() * r.x();
+	real const yz = q.y() * r.z() + q.z() * r.y();
+	real const wx = q.w() * r.x() + q.x() * r.w();
+	real const wy = q.w() * r.y() + q.y() * r.w();
+	real const wz = q.w() * r.z() + q.z() * r.w();
+
+	Matrix<3> result;
+	result << ww + xx - yy - zz, xy - wz, xz + wy,
+	          xy + wz, ww - xx + yy - zz, yz - wx,
+	          xz - wy, yz + wx, ww - xx - yy + zz;
+	return result;
+}
+
+constexpr int const maxZeros = 8;
+
+/**
+ * @brief Finds the zeros of c1 + (c2 + c3 t) cos(2 theta t) +
+ *  (c4 + c5 t) sin(2 theta t) in the given interval by interval bisection
+ *  followed by Newton's method.
+ */
+void intervalFindZeros(real const c[5], real theta, Interval const& tInterval,
+                       real* zeros, int* nZeros, int depth = 8)
+{
+	Interval const angle = Interval(2 * theta) * tInterval;
+	Interval const range = Interval(c[0]) +
+		(Interval(c[1]) + Interval(c[2]) * tInterval) * cos(angle) +
+		(Interval(c[3]) + Interval(c[4]) * tInterval) * sin(angle);
+	if (range.low > 0 || range.high < 0 || range.low == range.high) return;
+
+	if (depth > 0)
+	{
+		real const mid = (tInterval.low + tInterval.high) / 2;
+		intervalFindZeros(c, theta, Interval(tInterval.low, mid),
+		                  zeros, nZeros, depth - 1);
+		intervalFindZeros(c, theta, Interval(mid, tInterval.high),
+		                  zeros, nZeros, depth - 1);
+		return;
+	}
+
+	real t = (tInterval.low + tInterval.high) / 2;
+	for (int i = 0; i < 4; ++i)
+	{
+		real const cosT = std::cos(2 * theta * t);
+		real const sinT = std::sin(2 * theta * t);
+		real const f = c[0] + (c[1] + c[2] * t) * cosT + (c[3] + c[4] * t) * sinT;
+		real const df = (c[2] + 2 * theta * (c[3] + c[4] * t)) * cosT +
+		                (c[4] - 2 * theta * (c[1] + c[2] * t)) * sinT;
+		if (f == 0 || df == 0) break;
+		t -= f / df;
+	}
+	if (*nZeros < maxZeros &&
+	    t >= tInterval.low - 1e-3 && t < tInterval.high + 1e-3)
+		zeros[(*nZeros)++] = t;
+}
+
+} // namespace
+
+
+void InterpTransform3::initMotionDerivative()
+{
+	// Slerp follows the shortest path, see Eigen::QuaternionBase::slerp
+	Quaternion const& q0 = rotation[0];
+	Quaternion q1 = rotation[1];
+	real d = q0.dot(q1);
+	if (d < 0)
+	{
+		q1.coeffs() = -q1.coeffs();
+		d = -d;
+	}
+	theta = std::acos(std::min(d, (real) 1));
+
+	// slerp(t) = q0 cos(theta t) + qPerp sin(theta t)
+	Quaternion qPerp(q1.coeffs() - d * q0.coeffs());
+	real const normPerp = qPerp.norm();
+	if (normPerp > std::numeric_limits<real>::epsilon())
+		qPerp.coeffs() /= normPerp;
+	else
+		qPerp.coeffs().setZero();
+
+	// R(t) = a + b cos(2 theta t) + c sin(2 theta t)
+	Matrix<3> const r0 = quaternionBilinear(q0, q0);
+	Matrix<3> const rPerp = quaternionBilinear(qPerp, qPerp);
+	Matrix<3> const a = (r0 + rPerp) / 2;
+	Matrix<3> const b = (r0 - rPerp) / 2;
+	Matrix<3> const c = quaternionBilinear(q0, qPerp);
+
+	// S(t) = scale[0] + t dScale
+	Matrix<3> const dScale = scale[1] - scale[0];
+	real const omega = 2 * theta;
+
+	motionDerivativeT = translation[1] - translation[0];
+	motionDerivative[0] = a * dScale;
+	motionDerivative[1] = b * dScale + omega * c * scale[0];
+	motionDerivative[2] = omega * c * dScale;
+	motionDerivative[3] = c * dScale - omega * b * scale[0];
+	motionDerivative[4] = -omega * b * dScale;
+}
+
+BoxAxisAligned<3>
+InterpTransform3::motionBounds(Point<3> const& p,
+                               real time0, real time1) const
+{
+	if (still) return BoxAxisAligned<3>(transform[0]->trPoint(p));
+
+	// Normalised times. The keyframes themselves are returned exactly by
+	// interpolate01 at 0 and 1.
+	real const duration = time[1] - time[0];
+	real t0 = 0, t1 = 1;
+	if (duration > 0)
+	{
+		t0 = std::min(std::max((time0 - time[0]) / duration, (real) 0), (real) 1);
+		t1 = std::min(std::max((time1 - time[0]) / duration, (real) 0), (real) 1);
+		if (t0 > t1) std::swap(t0, t1);
+	}
+
+	BoxAxisAligned<3> result(interpolate01(t0).trPoint(p));
+	result |= interpolate01(t1).trPoint(p);
+	if (t0 == t1) return result;
 
+	Vector<3> coeffs[5];
+	for (int k = 0; k < 5; ++k)
+		coeffs[k] = motionDerivative[k] * p;
+	coeffs[0] += motionDerivativeT;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		real const c[5] =
+		{
+			coeffs[0][axis], coeffs[1][axis], coeffs[2][axis],
+			coeffs[3][axis], coeffs[4][axis]
+		};
+		real zeros[maxZeros];
+		int nZeros = 0;
+		intervalFindZeros(c, theta, Interval(t0, t1), zeros, &nZeros);
+		for (int i = 0; i < nZeros; ++i)
+		{
+			real const t = std::min(std::max(zeros[i], t0), t1);
+			result |= interpolate01(t).trPoint(p);
+		}
+	}
+	return result;
+}
 BoxAxisAligned<3>
-InterpTransform3::motionBounds(Point<3> const& p) const
+InterpTransform3::motionBoundsSampled(Point<3> const& p, int nSteps) const
 {
 	if (still) return BoxAxisAligned<3>(transform[0]->trPoint(p));
 
-	// TODO: Use another algorithm other than this brute forcing approach
 	BoxAxisAligned<3> result;
-	constexpr int const nSteps = 128;
 	for (int i = 0; i < nSteps; ++i)
 	{
 		real t = i / (real)(nSteps - 1);
@@ -8,13 +8,17 @@ namespace photino
 {
 
 /**
- * This function uses polar decomposition based on Jacobi SVD algorithm. Let
- * linear = M. Then
+ * This function computes the polar decomposition M = RS of linear = M, where
+ * R is orthogonal and S is symmetric positive semidefinite, by the scaled
+ * Newton iteration of Higham:
  *
- * M = UZV
+ * R_{k+1} = (g_k R_k + R_k^{-T} / g_k) / 2, R_0 = M
  *
- * The rotation matrix is R = UV*, and the scale matrix is S = VZV*. Hence
- * M = RS.
+ * with g_k = (|R_k^{-1}|_F / |R_k|_F)^{1/2}, and S = R^T M. An orthonormal
+ * matrix is returned as is, and a singular matrix, on which the iteration is
+ * undefined, is decomposed by \ref decomposeLinearSVD.
+ *
+ * The decomposition is evaluated in double precision regardless of real.
  *
  * @brief Decomposes a linear operation into a quaternion rotation and a matrix
  *	scale/shear component
@@ -25,14 +29,61 @@ namespace photino
 void decomposeLinear(Matrix<3> const& linear,
                      Quaternion* const rotation,
                      Matrix<3>* const scale);
+/**
+ * @brief Decomposes the linear part of a transform as above. Transforms
+ *  classified as rigid or uniformly scaled without reflection are decomposed
+ *  directly, without iterating.
+ */
+void decomposeLinear(TransformAffine<3> const&,
+                     Quaternion* const rotation,
+                     Matrix<3>* const scale);
+/**
+ * Consecutive equal pointers, as produced by \ref TransformCache for still
+ * keyframes, are decomposed once. Each rotation is put in the hemisphere of
+ * the previous one so that slerp between consecutive rotations takes the
+ * short path.
+ *
+ * @brief Decomposes a set of keyframes as above.
+ * @param[out] rotations Array of n rotations
+ * @param[out] scales Array of n scale/shear matrices
+ */
+void decomposeLinear(TransformAffine<3> const* const* transforms,
+                     std::size_t n,
+                     Quaternion* const rotations,
+                     Matrix<3>* const scales);
+/**
+ * Let linear = M. Then
+ *
+ * M = UZV*
+ *
+ * The rotation matrix is R = UV*, and the scale matrix is S = VZV*. Hence
+ * M = RS.
+ *
+ * @brief Reference implementation of \ref decomposeLinear based on Jacobi SVD
+ */
+void decomposeLinearSVD(Matrix<3> const& linear,
+                        Quaternion* const rotation,
+                        Matrix<3>* const scale);
 /**
  * @brief Used to interpolate two 3D affine transformations
  */
 class InterpTransform3 final
 {
 public:
+	/**
+	 * @warning The keyframes are compared by address to detect still
+	 *  transforms. Intern them with \ref TransformCache so that equal
+	 *  keyframes share an address.
+	 */
 	InterpTransform3(TransformAffine<3> const* tr0, real time0,
 	                 TransformAffine<3> const* tr1, real time1);
+	/**
+	 * @brief Uses decompositions of the keyframes computed beforehand by
+	 *  \ref decomposeLinear.
+	 */
+	InterpTransform3(TransformAffine<3> const* tr0, real time0,
+	                 TransformAffine<3> const* tr1, real time1,
+	                 Quaternion const rotation[2], Matrix<3> const scale[2]);
 
 	TransformAffine<3> interpolate01(real t) const;
 	TransformAffine<3> interpolate(real time) const;
@@ -41,11 +92,49 @@ public:
 	Vector<3> trVector(real ti, Vector<3> const&) const;
 	Normal<3> trNormal(real ti, Normal<3> const&) const;
 	Ray<3> trRay(real ti, Ray<3> const&) const;
+	/**
+	 * @brief Transforms the ray at its own time
+	 */
+	RenderRay<3> trRay(RenderRay<3> const&) const;
 	RayDifferential<3> trRayD(real ti, RayDifferential<3> const&) const;
+	/**
+	 * @brief Computes the exact bounds of the motion of a point by evaluating
+	 *  it at the endpoints and at the zeros of its derivative.
+	 */
 	BoxAxisAligned<3> motionBounds(Point<3> const&) const;
 	BoxAxisAligned<3> motionBounds(BoxAxisAligned<3> const&) const;
+	/**
+	 * @brief Bounds of the motion over the times [time0, time1], clamped to
+	 *  the times of the keyframes.
+	 */
+	BoxAxisAligned<3> motionBounds(Point<3> const&,
+	                               real time0, real time1) const;
+	BoxAxisAligned<3> motionBounds(BoxAxisAligned<3> const&,
+	                               real time0, real time1) const;
+	/**
+	 * @warning The result is not conservative.
+	 * @brief Reference implementation of \ref motionBounds which samples the
+	 *  motion at nSteps uniformly spaced instants.
+	 */
+	BoxAxisAligned<3> motionBoundsSampled(Point<3> const&,
+	                                      int nSteps = 128) const;
+	BoxAxisAligned<3> motionBoundsSampled(BoxAxisAligned<3> const&,
+	                                      int nSteps = 128) const;
 
 private:
+	/**
+	 * Let the rotation be slerped by the quaternion angle theta. Each
+	 * coordinate of the derivative of the motion of a point p is of the form
+	 *
+	 * c1 + (c2 + c3 t) cos(2 theta t) + (c4 + c5 t) sin(2 theta t)
+	 *
+	 * where ck = motionDerivative[k - 1] * p, with motionDerivativeT added to
+	 * c1.
+	 *
+	 * @brief Precomputes the coefficients of the derivative of the motion.
+	 */
+	void initMotionDerivative();
+
 	real const time[2];
 	TransformAffine<3> const* const transform[2];
 	bool const still;
@@ -53,6 +142,9 @@ private:
 	Quaternion rotation[2];
 	Matrix<3> scale[2];
 
+	real theta;
+	Vector<3> motionDerivativeT;
+	Matrix<3> motionDerivative[5];
 };
 
 
@@ -61,15 +153,114 @@ private:
 inline void decomposeLinear(Matrix<3> const& linear,
                             Quaternion* const rotation,
                             Matrix<3>* const scale)
+{
+	constexpr double const epsilon = std::numeric_limits<double>::epsilon();
+	Eigen::Matrix3d const m = linear.cast<double>();
+	double const normM = m.norm();
+
+	// Orthonormal matrices are their own rotation
+	if ((m.transpose() * m - Eigen::Matrix3d::Identity()).norm() <=
+	    16 * std::numeric_limits<real>::epsilon())
+	{
+		*rotation = Eigen::Quaterniond(m).cast<real>();
+		*scale = Matrix<3>::Identity();
+		return;
+	}
+	// Newton's iteration does not apply to (nearly) singular matrices
+	double const det = m.determinant();
+	if (!(std::abs(det) > 1e-12 * normM * normM * normM))
+	{
+		decomposeLinearSVD(linear, rotation, scale);
+		return;
+	}
+
+	Eigen::Matrix3d r = m;
+	for (int i = 0; i < 32; ++i)
+	{
+		// The cofactor matrix is det(R) R^{-T}
+		Eigen::Matrix3d cofactor;
+		cofactor.col(0) = r.col(1).cross(r.col(2));
+		cofactor.col(1) = r.col(2).cross(r.col(0));
+		cofactor.col(2) = r.col(0).cross(r.col(1));
+		Eigen::Matrix3d const invT = cofactor / r.col(0).dot(cofactor.col(0));
+
+		// The scaling speeds up the first iterations and is useless near
+		// convergence, where it would only add rounding errors
+		double const gamma = i < 4 ? std::sqrt(std::sqrt(invT.squaredNorm() /
+		                                                 r.squaredNorm()))
+		                           : 1;
+		Eigen::Matrix3d const next = 0.5 * (gamma * r + invT / gamma);
+		double const delta = (next - r).squaredNorm();
+		r = next;
+		// Convergence is quadratic, so the error of the new iterate is about
+		// the square of the last step
+		if (delta <= 1e-3 * epsilon) break;
+	}
+
+	Eigen::Matrix3d const s = r.transpose() * m;
+	*scale = (0.5 * (s + s.transpose())).cast<real>();
+	*rotation = Eigen::Quaterniond(r).cast<real>();
+}
+inline void decomposeLinear(TransformAffine<3> const& transform,
+                            Quaternion* const rotation,
+                            Matrix<3>* const scale)
+{
+	Matrix<3> const linear = transform.linear();
+	switch (transform.classification())
+	{
+	case TransformClass::Identity:
+	case TransformClass::Translation:
+		*rotation = Quaternion::Identity();
+		*scale = Matrix<3>::Identity();
+		return;
+	case TransformClass::Rigid:
+	case TransformClass::UniformScale:
+	{
+		// M = sQ. A reflection has no quaternion, hence needs the general case
+		real const det = linear.determinant();
+		if (det <= 0) break;
+		real const s = std::cbrt(det);
+		*rotation = Quaternion(Matrix<3>(linear / s)).normalized();
+		*scale = s * Matrix<3>::Identity();
+		return;
+	}
+	default:
+		break;
+	}
+	decomposeLinear(linear, rotation, scale);
+}
+
+inline void decomposeLinear(TransformAffine<3> const* const* transforms,
+                            std::size_t n,
+                            Quaternion* const rotations,
+                            Matrix<3>* const scales)
+{
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		if (i && transforms[i] == transforms[i - 1])
+		{
+			rotations[i] = rotations[i - 1];
+			scales[i] = scales[i - 1];
+			continue;
+		}
+		decomposeLinear(*transforms[i], &rotations[i], &scales[i]);
+		if (i && rotations[i].dot(rotations[i - 1]) < 0)
+			rotations[i].coeffs() = -rotations[i].coeffs();
+	}
+}
+inline void decomposeLinearSVD(Matrix<3> const& linear,
+                               Quaternion* const rotation,
+                               Matrix<3>* const scale)
 {
 	// Use Jacobi SVD (Efficient for small matrices)
-	auto svd = linear.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV);
-	Matrix<3> u = svd.matrixU();
-	Matrix<3> v = svd.matrixV();
+	Eigen::Matrix3d const m = linear.cast<double>();
+	auto svd = m.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV);
+	Eigen::Matrix3d u = svd.matrixU();
+	Eigen::Matrix3d v = svd.matrixV();
 
 	// Convert SVD to polar decomposition
-	*scale = v * svd.singularValues().asDiagonal() * v.adjoint();
-	*rotation = Quaternion(u * v.adjoint());
+	*scale = (v * svd.singularValues().asDiagonal() * v.adjoint()).cast<real>();
+	*rotation = Eigen::Quaterniond(u * v.adjoint()).cast<real>();
 }
 
 inline InterpTransform3::InterpTransform3(
@@ -80,8 +271,22 @@ inline InterpTransform3::InterpTransform3(
 {
 	translation[0] = transform[0]->translation();
 	translation[1] = transform[1]->translation();
-	decomposeLinear(transform[0]->linear(), &rotation[0], &scale[0]);
-	decomposeLinear(transform[1]->linear(), &rotation[1], &scale[1]);
+	decomposeLinear(*transform[0], &rotation[0], &scale[0]);
+	decomposeLinear(*transform[1], &rotation[1], &scale[1]);
+	if (!still) initMotionDerivative();
+}
+inline InterpTransform3::InterpTransform3(
+  TransformAffine<3> const* tr0, real time0,
+  TransformAffine<3> const* tr1, real time1,
+  Quaternion const rotation[2], Matrix<3> const scale[2]):
+	time{time0, time1}, transform{tr0, tr1},
+	still(tr0 == tr1),
+	rotation{rotation[0], rotation[1]},
+	scale{scale[0], scale[1]}
+{
+	translation[0] = transform[0]->translation();
+	translation[1] = transform[1]->translation();
+	if (!still) initMotionDerivative();
 }
 
 inline TransformAffine<3> InterpTransform3::interpolate01(real t) const
@@ -95,7 +300,11 @@ inline TransformAffine<3> InterpTransform3::interpolate01(real t) const
 	Quaternion rotate = slerp(t, rotation[0], rotation[1]);
 	Matrix<3> scaling = lerp<real, Matrix<3>>(t, scale[0], scale[1]);
 
-	return TransformAffine<3>(scaling).rotate(rotate).translate(translate);
+	// M = TRS, consistently with the decomposition of the keyframes
+	Matrix<4> result = Matrix<4>::Identity();
+	result.topLeftCorner<3, 3>() = rotate.toRotationMatrix() * scaling;
+	result.topRightCorner<3, 1>() = translate;
+	return TransformAffine<3>(result);
 }
 inline TransformAffine<3> InterpTransform3::interpolate(real ti) const
 {
@@ -109,7 +318,11 @@ inline TransformAffine<3> InterpTransform3::interpolate(real ti) const
 	Quaternion rotate = slerp(t, rotation[0], rotation[1]);
 	Matrix<3> scaling = lerp<real, Matrix<3>>(t, scale[0], scale[1]);
 
-	return TransformAffine<3>(scaling).rotate(rotate).translate(translate);
+	// M = TRS, consistently with the decomposition of the keyframes
+	Matrix<4> result = Matrix<4>::Identity();
+	result.topLeftCorner<3, 3>() = rotate.toRotationMatrix() * scaling;
+	result.topRightCorner<3, 1>() = translate;
+	return TransformAffine<3>(result);
 }
 
 inline Point<3>
@@ -152,6 +365,17 @@ InterpTransform3::trRay(real ti, Ray<3> const& r) const
 
 	return interpolate(ti).trRay(r);
 }
+inline RenderRay<3>
+InterpTransform3::trRay(RenderRay<3> const& r) const
+{
+	real const ti = r.time();
+	if (still || ti < time[0])
+		return transform[0]->trRay(r);
+	else if (ti > time[1])
+		return transform[1]->trRay(r);
+
+	return interpolate(ti).trRay(r);
+}
 inline RayDifferential<3>
 InterpTransform3::trRayD(real ti, RayDifferential<3> const& rd) const
 {
@@ -171,6 +395,31 @@ InterpTransform3::motionBounds(BoxAxisAligned<3> const& b) const
 		result |= motionBounds(cornerOf(b, i));
 	return result;
 }
+inline BoxAxisAligned<3>
+InterpTransform3::motionBounds(Point<3> const& p) const
+{
+	return motionBounds(p, time[0], time[1]);
+}
+inline BoxAxisAligned<3>
+InterpTransform3::motionBounds(BoxAxisAligned<3> const& b,
+                               real time0, real time1) const
+{
+	if (still) return transform[0]->trBoxAA(b);
+	BoxAxisAligned<3> result;
+	for (unsigned int i = 0; i < 8; ++i)
+		result |= motionBounds(cornerOf(b, i), time0, time1);
+	return result;
+}
+inline BoxAxisAligned<3>
+InterpTransform3::motionBoundsSampled(BoxAxisAligned<3> const& b,
+                                      int nSteps) const
+{
+	if (still) return transform[0]->trBoxAA(b);
+	BoxAxisAligned<3> result;
+	for (unsigned int i = 0; i < 8; ++i)
+		result |= motionBoundsSampled(cornerOf(b, i), nSteps);
+	return result;
+}
 
 } // namespace photino
 
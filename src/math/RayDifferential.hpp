@@ -2,6 +2,7 @@
 #define PHOTINO_MATH_RAYDIFFERENTIAL_HPP_
 
 #include "geometry.hpp"
+#include "RenderRay.hpp"
 
 namespace photino
 {
@@ -14,6 +15,7 @@ struct RayDifferential
 	RayDifferential(Ray<m> const&, Ray<m> const&);
 
 	RayDifferential<m>& scale(Ray<m> const& r, real s);
+	RayDifferential<m>& scale(RenderRay<m> const& r, real s);
 };
 
 template <std::size_t m> inline
@@ -31,6 +33,11 @@ RayDifferential<m>::scale(Ray<m> const& r, real s)
 	ry.direction() = r.direction() + (ry.direction() - r.direction()) * s;
 	return *this;
 }
+template <std::size_t m> inline RayDifferential<m>&
+RayDifferential<m>::scale(RenderRay<m> const& r, real s)
+{
+	return scale(r.line(), s);
+}
 
 } // namespace photino
 
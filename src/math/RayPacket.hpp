@@ -0,0 +1,269 @@
+#ifndef PHOTINO_MATH_RAYPACKET_HPP_
+#define PHOTINO_MATH_RAYPACKET_HPP_
+
+#include <cmath>
+
+#include "RenderRay.hpp"
+#include "integers.hpp"
+#include "simd.hpp"
+
+namespace photino
+{
+
+/**
+ * Rays are stored as structures of arrays, lane i of each array holding ray
+ * i, so that a packet is tested against a box or a primitive in SIMD lanes.
+ *
+ * \ref prepare bounds the origins and reciprocal directions of the packet.
+ * If all the directions lie in one octant, these intervals bound a frustum
+ * containing every ray, which culls boxes missed by the whole packet with one
+ * test (Reshetov et al. 2005).
+ *
+ * @brief Packet of rays for coherent ray tracing
+ * @tparam width Number of rays, typically 4, 8 or 16
+ */
+template <int width>
+struct alignas(64) RayPacket
+{
+	static_assert(width >= 1 && width <= 32, "Lanes are indexed by an int mask");
+	static constexpr int const allLanes = (int) ((1ull << width) - 1);
+
+	real o[3][width];
+	real d[3][width];
+	real invDir[3][width];
+	real tMax[width];
+	real time[width];
+
+	/**
+	 * Common octant of the directions, bit j being set if their component j
+	 * is negative, or -1 if the packet has no frustum
+	 */
+	int octant;
+	real oBounds[2][3]; ///< Lower and upper bounds of the origins
+	real invBounds[2][3]; ///< Lower and upper bounds of invDir
+
+	void set(int lane, RenderRay<3> const&);
+	RenderRay<3> ray(int lane) const;
+	/**
+	 * @brief Computes the frustum of the active lanes. Must be called after
+	 *  the lanes are set.
+	 * @return Whether the packet has a frustum
+	 */
+	bool prepare(int mask = allLanes);
+};
+
+typedef RayPacket<4> RayPacket4;
+typedef RayPacket<8> RayPacket8;
+typedef RayPacket<16> RayPacket16;
+
+/**
+ * @brief Slab test between a box and every lane of a packet
+ * @param[out] tNear Entry distances, valid for the lanes hit
+ * @return Mask of the lanes among mask that hit the box
+ */
+template <int width> int
+intersectSlabs(BoxAxisAligned<3> const&, RayPacket<width> const&, int mask,
+               Pack<real, width>* const tNear);
+/**
+ * The intervals of the frustum bound the entry and exit distances of every
+ * ray through each pair of slabs. The box is missed by all the rays if the
+ * largest lower bound on the entry distances exceeds the smallest upper bound
+ * on the exit distances.
+ *
+ * @brief Conservative test of a box against the frustum of a packet, by
+ *  interval arithmetic.
+ * @warning The packet must have a frustum.
+ * @return false if no ray of the packet hits the box
+ */
+template <int width> bool
+intersectFrustum(BoxAxisAligned<3> const&, RayPacket<width> const&);
+/**
+ * @brief Möller-Trumbore intersection between a triangle and the lanes of a
+ *  packet. The extent of each lane hit is shrunk to its intersection.
+ * @param[inout] u,v Barycentric coordinates of the intersections relative
+ *  to p1 and p2, updated in the lanes hit only
+ * @return Mask of the lanes among mask that hit the triangle
+ */
+template <int width> int
+intersectTriangle(RayPacket<width>* const, int mask, Point<3> const& p0,
+                  Point<3> const& p1, Point<3> const& p2,
+                  Pack<real, width>* const u, Pack<real, width>* const v);
+
+
+// Implementations
+
+template <int width> inline void
+RayPacket<width>::set(int lane, RenderRay<3> const& r)
+{
+	for (int j = 0; j < 3; ++j)
+	{
+		o[j][lane] = r.origin()[j];
+		d[j][lane] = r.direction()[j];
+		invDir[j][lane] = r.invDirection()[j];
+	}
+	tMax[lane] = r.tMax();
+	time[lane] = r.time();
+}
+template <int width> inline RenderRay<3>
+RayPacket<width>::ray(int lane) const
+{
+	return RenderRay<3>(Point<3>(o[0][lane], o[1][lane], o[2][lane]),
+	                    Vector<3>(d[0][lane], d[1][lane], d[2][lane]),
+	                    tMax[lane], time[lane]);
+}
+template <int width> inline bool
+RayPacket<width>::prepare(int mask)
+{
+	octant = -1;
+	if (!mask) return false;
+	int const first = countTrailingZeros((uint32_t) mask);
+	int signs = 0;
+	for (int j = 0; j < 3; ++j)
+		signs |= std::signbit(d[j][first]) << j;
+
+	for (int j = 0; j < 3; ++j)
+	{
+		oBounds[0][j] = invBounds[0][j] = INFINITY;
+		oBounds[1][j] = invBounds[1][j] = -INFINITY;
+	}
+	for (int i = 0; i < width; ++i)
+	{
+		if (!(mask & 1 << i)) continue;
+		for (int j = 0; j < 3; ++j)
+		{
+			// Axis-parallel directions would multiply infinities by 0
+			if (std::signbit(d[j][i]) != bool(signs & 1 << j) ||
+			    !std::isfinite(invDir[j][i]))
+				return false;
+			oBounds[0][j] = std::min(oBounds[0][j], o[j][i]);
+			oBounds[1][j] = std::max(oBounds[1][j], o[j][i]);
+			invBounds[0][j] = std::min(invBounds[0][j], invDir[j][i]);
+			invBounds[1][j] = std::max(invBounds[1][j], invDir[j][i]);
+		}
+	}
+	octant = signs;
+	return true;
+}
+
+template <int width> inline int
+intersectSlabs(BoxAxisAligned<3> const& b, RayPacket<width> const& packet,
+               int mask, Pack<real, width>* const tNear)
+{
+	typedef Pack<real, width> P;
+	constexpr real const robust = 1 + 4 * std::numeric_limits<real>::epsilon();
+	P t0 = P::set1(0);
+	P t1 = P::loadu(packet.tMax);
+	for (int j = 0; j < 3; ++j)
+	{
+		P const o = P::loadu(packet.o[j]);
+		P const invDir = P::loadu(packet.invDir[j]);
+		P const ta = (P::set1(b.min()[j]) - o) * invDir;
+		P const tb = (P::set1(b.max()[j]) - o) * invDir;
+		// NaNs, from origins on a plane parallel to the ray, are the first
+		// operands so that they are ignored as in the scalar test
+		t0 = max(min(ta, tb), t0);
+		t1 = min(max(ta, tb) * P::set1(robust), t1);
+	}
+	*tNear = t0;
+	return maskLessEqual(t0, t1) & mask;
+}
+
+template <int width> inline bool
+intersectFrustum(BoxAxisAligned<3> const& b, RayPacket<width> const& packet)
+{
+	real tEnter = 0, tExit = INFINITY;
+	for (int j = 0; j < 3; ++j)
+	{
+		// The distance (x - o) invDir is monotonic in o and in invDir, whose
+		// sign is that of the octant. Hence the bounds of the entry and exit
+		// distances are products of bounds of the intervals.
+		real const oLow = packet.oBounds[0][j], oHigh = packet.oBounds[1][j];
+		real const invLow = packet.invBounds[0][j], invHigh = packet.invBounds[1][j];
+		real nearLow, farHigh;
+		if (packet.octant >> j & 1)
+		{
+			real const x = b.max()[j] - oLow, y = b.min()[j] - oHigh;
+			nearLow = x * (x >= 0 ? invLow : invHigh);
+			farHigh = y * (y <= 0 ? invLow : invHigh);
+		}
+		else
+		{
+			real const x = b.min()[j] - oHigh, y = b.max()[j] - oLow;
+			nearLow = x * (x >= 0 ? invLow : invHigh);
+			farHigh = y * (y >= 0 ? invHigh : invLow);
+		}
+		if (nearLow > tEnter) tEnter = nearLow;
+		if (farHigh < tExit) tExit = farHigh;
+	}
+	constexpr real const robust = 1 + 4 * std::numeric_limits<real>::epsilon();
+	return tEnter <= tExit * robust;
+}
+
+template <int width> inline int
+intersectTriangle(RayPacket<width>* const packet, int mask,
+                  Point<3> const& p0, Point<3> const& p1, Point<3> const& p2,
+                  Pack<real, width>* const u, Pack<real, width>* const v)
+{
+	typedef Pack<real, width> P;
+	Vector<3> const e1 = p1 - p0, e2 = p2 - p0;
+	P d[3], s[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		d[j] = P::loadu(packet->d[j]);
+		s[j] = P::loadu(packet->o[j]) - P::set1(p0[j]);
+	}
+	P e1p[3], e2p[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		e1p[j] = P::set1(e1[j]);
+		e2p[j] = P::set1(e2[j]);
+	}
+
+	// p = d x e2, q = s x e1
+	P const px = d[1] * e2p[2] - d[2] * e2p[1];
+	P const py = d[2] * e2p[0] - d[0] * e2p[2];
+	P const pz = d[0] * e2p[1] - d[1] * e2p[0];
+	P const det = px * e1p[0] + py * e1p[1] + pz * e1p[2];
+	P const invDet = P::set1(1) / det;
+
+	P const uu = (px * s[0] + py * s[1] + pz * s[2]) * invDet;
+	P const qx = s[1] * e1p[2] - s[2] * e1p[1];
+	P const qy = s[2] * e1p[0] - s[0] * e1p[2];
+	P const qz = s[0] * e1p[1] - s[1] * e1p[0];
+	P const vv = (qx * d[0] + qy * d[1] + qz * d[2]) * invDet;
+	P const t = (qx * e2p[0] + qy * e2p[1] + qz * e2p[2]) * invDet;
+
+	// A null determinant gives infinite or NaN coordinates, which fail
+	P const zero = P::set1(0);
+	P const tMax = P::loadu(packet->tMax);
+	int hit = mask & maskLessEqual(zero, uu) & maskLessEqual(zero, vv) &
+	          maskLessEqual(uu + vv, P::set1(1)) &
+	          maskLess(zero, t) & maskLess(t, tMax);
+	if (!hit) return 0;
+
+	// Only the lanes hit are updated
+	alignas(64) real lanes[4][width];
+	t.store(lanes[0]);
+	uu.store(lanes[1]);
+	vv.store(lanes[2]);
+	u->store(lanes[3]);
+	for (int m = hit; m; m &= m - 1)
+	{
+		int const i = countTrailingZeros((uint32_t) m);
+		packet->tMax[i] = lanes[0][i];
+		lanes[3][i] = lanes[1][i];
+	}
+	*u = P::loadu(lanes[3]);
+	v->store(lanes[3]);
+	for (int m = hit; m; m &= m - 1)
+	{
+		int const i = countTrailingZeros((uint32_t) m);
+		lanes[3][i] = lanes[2][i];
+	}
+	*v = P::loadu(lanes[3]);
+	return hit;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_MATH_RAYPACKET_HPP_
@@ -0,0 +1,200 @@
+#ifndef PHOTINO_MATH_RENDERRAY_HPP_
+#define PHOTINO_MATH_RENDERRAY_HPP_
+
+#include <cstdint>
+
+#include "geometry.hpp"
+#include "numbers.hpp"
+
+namespace photino
+{
+
+/**
+ * The reciprocal of the direction and the signs of its components are kept
+ * consistent with the direction, so they are only changed through
+ * \ref setDirection. Scalars are interleaved with the vectors to avoid
+ * padding.
+ *
+ * @brief Ray segment o + t d, t in [0, tMax], at an instant in time.
+ */
+template <std::size_t m>
+class RenderRay final
+{
+public:
+	RenderRay() noexcept {}
+	RenderRay(Point<m> const& origin, Vector<m> const& direction,
+	          real tMax = INFINITY, real time = 0);
+	explicit RenderRay(Ray<m> const&, real tMax = INFINITY, real time = 0);
+
+	Point<m> const& origin() const;
+	Point<m>& origin();
+	Vector<m> const& direction() const;
+	void setDirection(Vector<m> const&);
+	/**
+	 * @brief Componentwise reciprocal of the direction
+	 */
+	Vector<m> const& invDirection() const;
+	/**
+	 * @return 1 if the i-th component of the direction is negative, 0
+	 *  otherwise
+	 */
+	int dirIsNeg(int i) const;
+
+	real tMax() const;
+	real& tMax();
+	real time() const;
+	real& time();
+
+	Point<m> operator()(real t) const;
+	/**
+	 * @brief Unbounded line supporting the ray
+	 */
+	Ray<m> line() const;
+
+private:
+	Point<m> o;
+	real tEnd;
+	Vector<m> d;
+	real t;
+	Vector<m> dInv;
+	uint8_t neg[m];
+};
+
+/**
+ * @brief Slab test between a box and a ray segment
+ */
+template <int m> bool
+intersectSlabs(BoxAxisAligned<m> const&, RenderRay<(std::size_t) m> const&);
+/**
+ * The origin is pushed along the normal, past the error bounds of p, and
+ * then rounded away from the surface, so that a ray spawned towards w does
+ * not re-intersect the surface it leaves.
+ *
+ * @brief Robust origin for a ray leaving a surface point.
+ * @param[in] p Surface point
+ * @param[in] pError Absolute error bounds of p
+ * @param[in] n Surface normal
+ * @param[in] w Direction of the ray
+ */
+Point<3> offsetRayOrigin(Point<3> const& p, Vector<3> const& pError,
+                         Normal<3> const& n, Vector<3> const& w);
+
+
+// Implementations
+
+template <std::size_t m> inline
+RenderRay<m>::RenderRay(Point<m> const& origin, Vector<m> const& direction,
+                        real tMax, real time):
+	o(origin), tEnd(tMax), t(time)
+{
+	setDirection(direction);
+}
+template <std::size_t m> inline
+RenderRay<m>::RenderRay(Ray<m> const& r, real tMax, real time):
+	o(r.origin()), tEnd(tMax), t(time)
+{
+	setDirection(r.direction());
+}
+
+template <std::size_t m> inline Point<m> const&
+RenderRay<m>::origin() const
+{
+	return o;
+}
+template <std::size_t m> inline Point<m>&
+RenderRay<m>::origin()
+{
+	return o;
+}
+template <std::size_t m> inline Vector<m> const&
+RenderRay<m>::direction() const
+{
+	return d;
+}
+template <std::size_t m> inline void
+RenderRay<m>::setDirection(Vector<m> const& direction)
+{
+	d = direction;
+	dInv = d.cwiseInverse();
+	for (std::size_t i = 0; i < m; ++i)
+		neg[i] = dInv[i] < 0;
+}
+template <std::size_t m> inline Vector<m> const&
+RenderRay<m>::invDirection() const
+{
+	return dInv;
+}
+template <std::size_t m> inline int
+RenderRay<m>::dirIsNeg(int i) const
+{
+	return neg[i];
+}
+template <std::size_t m> inline real
+RenderRay<m>::tMax() const
+{
+	return tEnd;
+}
+template <std::size_t m> inline real&
+RenderRay<m>::tMax()
+{
+	return tEnd;
+}
+template <std::size_t m> inline real
+RenderRay<m>::time() const
+{
+	return t;
+}
+template <std::size_t m> inline real&
+RenderRay<m>::time()
+{
+	return t;
+}
+template <std::size_t m> inline Point<m>
+RenderRay<m>::operator()(real s) const
+{
+	return o + s * d;
+}
+template <std::size_t m> inline Ray<m>
+RenderRay<m>::line() const
+{
+	return Ray<m>(o, d);
+}
+
+template <int m> inline bool
+intersectSlabs(BoxAxisAligned<m> const& b, RenderRay<(std::size_t) m> const& r)
+{
+	Point<m> const* const bounds[2] = { &b.min(), &b.max() };
+	// Conservative far distance, robust against rounding
+	constexpr real const robust = 1 + 4 * std::numeric_limits<real>::epsilon();
+	real t0 = 0;
+	real t1 = r.tMax();
+	for (int i = 0; i < m; ++i)
+	{
+		int const n = r.dirIsNeg(i);
+		real const tNear = ((*bounds[n])[i] - r.origin()[i]) * r.invDirection()[i];
+		real const tFar = ((*bounds[1 - n])[i] - r.origin()[i]) *
+		                  r.invDirection()[i] * robust;
+		if (tNear > t0) t0 = tNear;
+		if (tFar < t1) t1 = tFar;
+		if (t0 > t1) return false;
+	}
+	return true;
+}
+inline Point<3> offsetRayOrigin(Point<3> const& p, Vector<3> const& pError,
+                                Normal<3> const& n, Vector<3> const& w)
+{
+	real const d = dot(Normal<3>(n.cwiseAbs()), pError);
+	Vector<3> offset = d * n;
+	if (dot(w, n) < 0) offset = -offset;
+	Point<3> result = p + offset;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (offset[i] > 0) result[i] = nextUp(result[i]);
+		else if (offset[i] < 0) result[i] = nextDown(result[i]);
+	}
+	return result;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_MATH_RENDERRAY_HPP_
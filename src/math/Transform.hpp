@@ -1,25 +1,50 @@
 #ifndef PHOTINO_MATH_TRANSFORM_HPP_
 #define PHOTINO_MATH_TRANSFORM_HPP_
 
+#include <algorithm>
+
 #include "geometry.hpp"
+#include "integers.hpp"
+#include "numbers.hpp"
 #include "RayDifferential.hpp"
+#include "RenderRay.hpp"
+#include "simd.hpp"
 
 namespace photino
 {
 
+/**
+ * Classes are ordered by generality, and the composition of two transforms
+ * belongs to the more general class of the two.
+ *
+ * @brief Most specific kind of a transform, used to dispatch to cheaper
+ *  kernels.
+ */
+enum class TransformClass : uint8_t
+{
+	Identity,
+	Translation,
+	Rigid, ///< Orthogonal linear part and a translation
+	UniformScale, ///< Orthogonal linear part scaled uniformly and a translation
+	Affine,
+	Projective
+};
+
 template <int dim, int type>
 class Transform final
 {
 public:
 	static Transform<dim, type> identity();
 
-	Transform() noexcept {}
+	Transform() noexcept;
 	/**
 	 * @warning Result undefined if the given matrix is singular.
+	 * @brief The inverse is evaluated in double precision.
 	 */
 	Transform(Matrix<dim> const&);
 	/**
 	 * @warning Result undefined if the given matrix is singular.
+	 * @brief The inverse is evaluated in double precision.
 	 */
 	Transform(Matrix<dim + 1> const&);
 	/**
@@ -36,6 +61,11 @@ public:
 	Vector<dim> translation() const;
 
 	bool swapsChirality() const;
+	TransformClass classification() const;
+	/**
+	 * @brief Homogeneous matrix of the transform
+	 */
+	Matrix<dim + 1> homogeneous() const;
 
 	Transform<dim, type>& translate(Vector<dim> const&);
 	Transform<dim, type>& scale(Vector<dim> const&);
@@ -44,21 +74,123 @@ public:
 	Transform<dim, type>& operator*=(Transform<dim, type> const&);
 
 	Point<dim> trPoint(Point<dim> const&) const;
+	/**
+	 * @warning Only available for affine transforms
+	 * @param[out] pError Conservative bound on the absolute rounding error of
+	 *  each component of the result
+	 */
+	Point<dim> trPoint(Point<dim> const&, Vector<dim>* const pError) const;
 	Vector<dim> trVector(Vector<dim> const&) const;
 	Normal<dim> trNormal(Normal<dim> const&) const;
 	Ray<dim> trRay(Ray<dim> const&) const;
+	/**
+	 * @brief Transforms the origin and direction. The extent and time are
+	 *  unchanged since the direction is not normalised.
+	 */
+	RenderRay<dim> trRay(RenderRay<dim> const&) const;
 	RayDifferential<dim> trRayD(RayDifferential<dim> const&) const;
+	/**
+	 * Affine transforms use Arvo's method, which bounds each coordinate of the
+	 * image by minimising and maximising every term of the matrix product
+	 * separately. Projective transforms bound the images of all the corners,
+	 * which is exact unless the box crosses the plane mapped to infinity, in
+	 * which case the result is the whole space.
+	 *
+	 * @brief Bounds the image of a box.
+	 */
 	BoxAxisAligned<dim> trBoxAA(BoxAxisAligned<dim> const&) const;
+	/**
+	 * @brief Batch version of \ref trBoxAA on an array of boxes. The output
+	 *  may alias the input.
+	 */
+	void trBoxesAA(BoxAxisAligned<dim> const* in, BoxAxisAligned<dim>* out,
+	               std::size_t n) const;
+
+	/*
+	 * Batch versions of the above on n elements stored as structures of
+	 * arrays: component i of element k is at in[i][k]. The outputs may alias
+	 * the inputs. The matrices are prepared once per call, and the elements
+	 * are processed in SIMD lanes.
+	 */
+	void trPoints(real const* const in[dim], real* const out[dim],
+	              std::size_t n) const;
+	void trVectors(real const* const in[dim], real* const out[dim],
+	               std::size_t n) const;
+	void trNormals(real const* const in[dim], real* const out[dim],
+	               std::size_t n) const;
+	/**
+	 * @brief Transforms origins o and directions d of rays. As with
+	 *  \ref trRay, extents and times are unchanged.
+	 */
+	void trRays(real const* const o[dim], real const* const d[dim],
+	            real* const oOut[dim], real* const dOut[dim],
+	            std::size_t n) const;
+	/**
+	 * @warning Only available for affine transforms
+	 * @brief Transforms boxes given by their lower and upper corners, with
+	 *  Arvo's method. Empty boxes are copied unchanged.
+	 */
+	void trBoxesAA(real const* const lower[dim], real const* const upper[dim],
+	               real* const lowerOut[dim], real* const upperOut[dim],
+	               std::size_t n) const;
 
 private:
+	/**
+	 * @brief Applies h to the elements [begin, end) of SoA arrays, width at a
+	 *  time.
+	 * @tparam translate Whether the last column of h is added
+	 * @tparam divide Whether the result is divided by the homogeneous
+	 *  coordinate
+	 * @return End of the elements processed, a multiple of width from begin
+	 */
+	template <bool translate, bool divide, int width> static std::size_t
+	trSoA(Matrix<dim + 1> const& h, real const* const in[dim],
+	      real* const out[dim], std::size_t begin, std::size_t end);
+	/**
+	 * @brief See \ref trSoA
+	 */
+	template <int width> static std::size_t
+	trBoxesSoA(Matrix<dim + 1> const& h, real const* const lower[dim],
+	           real const* const upper[dim], real* const lowerOut[dim],
+	           real* const upperOut[dim], std::size_t begin, std::size_t end);
+
+	/**
+	 * @brief Arvo's bounds of the image of a non-empty box under the affine
+	 *  map x -> lx + t.
+	 */
+	static BoxAxisAligned<dim>
+	trBoxArvo(Matrix<dim> const& l, Vector<dim> const& t,
+	          BoxAxisAligned<dim> const&);
+	/**
+	 * @brief Bounds of the images of the corners of a non-empty box under
+	 *  the homogeneous matrix h.
+	 */
+	static BoxAxisAligned<dim>
+	trBoxCorners(Matrix<dim + 1> const& h, BoxAxisAligned<dim> const&);
+
 	/**
 	 * The transforms must be inverses of each other.
 	 */
 	Transform(Eigen::Transform<real, dim, type> const&,
-	          Eigen::Transform<real, dim, type> const&);
+	          Eigen::Transform<real, dim, type> const&, TransformClass);
+
+	/**
+	 * Orthogonality is tested up to a few ulps, so that rotations built from
+	 * angles are recognised.
+	 *
+	 * @brief Determines the class of a matrix.
+	 */
+	static TransformClass classify(Eigen::Transform<real, dim, type> const&);
+	/**
+	 * @brief Inverts a transform of the given class. The general case is
+	 *  evaluated in double precision.
+	 */
+	static Eigen::Transform<real, dim, type>
+	inverseOf(Eigen::Transform<real, dim, type> const&, TransformClass);
 
 	Eigen::Transform<real, dim, type> mat;
 	Eigen::Transform<real, dim, type> invMat;
+	TransformClass cls;
 
 	template <int n, int ty>
 	friend Transform<n, ty> inverse(Transform<n, ty> const&) noexcept;
@@ -66,10 +198,25 @@ private:
 	operator==(Transform<n, ty> const&, Transform<n, ty> const&);
 	template <int n, int ty> friend bool
 	operator!=(Transform<n, ty> const&, Transform<n, ty> const&);
-	template <int n, int ty0, int ty1> friend Transform<dim, ty0>
-	operator*(Transform<dim, ty0> const&, Transform<dim, ty1> const&);
+	template <int n> friend Transform<n, Eigen::AffineCompact>
+	operator*(Transform<n, Eigen::AffineCompact> const&,
+	          Transform<n, Eigen::AffineCompact> const&);
+	template <int n> friend Transform<n, Eigen::Projective>
+	operator*(Transform<n, Eigen::Projective> const&,
+	          Transform<n, Eigen::AffineCompact> const&);
+	template <int n> friend Transform<n, Eigen::Projective>
+	operator*(Transform<n, Eigen::AffineCompact> const&,
+	          Transform<n, Eigen::Projective> const&);
+	template <int n> friend Transform<n, Eigen::Projective>
+	operator*(Transform<n, Eigen::Projective> const&,
+	          Transform<n, Eigen::Projective> const&);
 };
 
+/**
+ * @brief Class of the composition of transforms of classes c0 and c1
+ */
+TransformClass compose(TransformClass c0, TransformClass c1);
+
 
 template <int dim, int type> bool
 operator==(Transform<dim, type> const&, Transform<dim, type> const&);
@@ -100,34 +247,48 @@ using TransformProjective = Transform<dim, Eigen::Projective>;
 
 // Implementations
 
+inline TransformClass compose(TransformClass c0, TransformClass c1)
+{
+	return c0 > c1 ? c0 : c1;
+}
+
 template <int dim, int type> inline Transform<dim, type>
 Transform<dim, type>::identity()
 {
 	Transform<dim, type> result;
 	result.invMat = result.mat = Eigen::Transform<real, dim, type>::Identity();
+	result.cls = TransformClass::Identity;
 	return result;
 }
 
+template <int dim, int type> inline
+Transform<dim, type>::Transform() noexcept:
+	cls(type == Eigen::Projective ? TransformClass::Projective
+	                              : TransformClass::Affine)
+{
+}
 template <int dim, int type> inline
 Transform<dim, type>::Transform(Matrix<dim> const& m):
-	mat(m), invMat(m.inverse().eval())
+	mat(m), cls(classify(mat))
 {
+	invMat = inverseOf(mat, cls);
 }
 template <int dim, int type> inline
 Transform<dim, type>::Transform(Matrix<dim + 1> const& m):
-	mat(m), invMat(m.inverse().eval())
+	mat(m), cls(classify(mat))
 {
+	invMat = inverseOf(mat, cls);
 }
 template <int dim, int type> inline
 Transform<dim, type>::Transform(Matrix<dim> const& m,
                               Matrix<dim> const& invM) noexcept:
-	mat(m), invMat(invM)
+	mat(m), invMat(invM), cls(classify(mat))
 {
 }
 template <int dim, int type> inline
 Transform<dim, type>::Transform(Matrix<dim + 1> const& m,
                               Matrix<dim + 1> const& invM) noexcept:
-	mat(m), invMat(invM)
+	mat(m), invMat(invM), cls(classify(mat))
 {
 }
 template <int dim, int type> inline Matrix<dim>
@@ -150,12 +311,19 @@ Transform<dim, type>::swapsChirality() const
 {
 	return mat.linear().determinant() < 0;
 }
+template <int dim, int type> inline TransformClass
+Transform<dim, type>::classification() const
+{
+	return cls;
+}
 
 template <int dim, int type> inline Transform<dim, type>&
 Transform<dim, type>::translate(Vector<dim> const& v)
 {
 	mat.translate(v);
 	invMat.translate(-v);
+	if (v != Vector<dim>::Zero())
+		cls = compose(cls, TransformClass::Translation);
 	return *this;
 }
 template <int dim, int type> inline Transform<dim, type>&
@@ -163,6 +331,12 @@ Transform<dim, type>::scale(Vector<dim> const& v)
 {
 	mat.scale(v);
 	invMat.scale(v.cwiseInverse());
+	if (v != Vector<dim>::Ones())
+	{
+		Vector<dim> const a = v.cwiseAbs();
+		cls = compose(cls, a == Vector<dim>::Constant(a[0]) ?
+		                   TransformClass::UniformScale : TransformClass::Affine);
+	}
 	return *this;
 }
 template <int dim, int type>
@@ -172,6 +346,7 @@ Transform<dim, type>::rotate(Rotation const& rotation)
 	Matrix<dim> rotationMatrix = rotation.toRotationMatrix();
 	mat = mat * Eigen::Transform<real, dim, Eigen::Affine>(rotationMatrix);
 	invMat = Eigen::Transform<real, dim, Eigen::Affine>(rotationMatrix.transpose()) * invMat;
+	cls = compose(cls, TransformClass::Rigid);
 	return *this;
 }
 template <int dim, int type> inline Transform<dim, type>&
@@ -179,29 +354,73 @@ Transform<dim, type>::operator*=(Transform<dim, type> const& t)
 {
 	mat = mat * t.mat;
 	invMat = t.invMat * invMat;
+	cls = compose(cls, t.cls);
 	return *this;
 }
 
 template <int dim, int type> Point<dim>
 Transform<dim, type>::trPoint(Point<dim> const& p) const
 {
+	switch (cls)
+	{
+	case TransformClass::Identity: return p;
+	case TransformClass::Translation: return p + mat.translation();
+	case TransformClass::Projective:
+		return (homogeneous() * p.homogeneous()).hnormalized();
+	default: return mat.linear() * p + mat.translation();
+	}
+}
+template <int dim, int type> inline Point<dim>
+Transform<dim, type>::trPoint(Point<dim> const& p, Vector<dim>* const pError) const
+{
+	static_assert(type != Eigen::Projective, "Only affine transforms are supported");
+	switch (cls)
+	{
+	case TransformClass::Identity:
+		*pError = Vector<dim>::Zero();
+		return p;
+	case TransformClass::Translation:
+		*pError = gamma(1) * (p + mat.translation()).cwiseAbs();
+		return p + mat.translation();
+	default:
+		break;
+	}
+	// Each component is a sum of dim products and a translation
+	*pError = gamma(dim + 1) * ((mat.linear().cwiseAbs() * p.cwiseAbs()) +
+	                            mat.translation().cwiseAbs());
 	return mat * p;
 }
 template <int dim, int type> inline Vector<dim>
 Transform<dim, type>::trVector(Vector<dim> const& v) const
 {
+	if (cls <= TransformClass::Translation) return v;
 	return mat.linear() * v;
 }
 template <int dim, int type> inline Normal<dim>
 Transform<dim, type>::trNormal(Normal<dim> const& n) const
 {
-	return invMat.linear().transpose() * n;
+	switch (cls)
+	{
+	case TransformClass::Identity:
+	case TransformClass::Translation:
+		return n;
+	case TransformClass::Rigid: // The inverse transpose is the matrix itself
+		return mat.linear() * n;
+	default:
+		return invMat.linear().transpose() * n;
+	}
 }
 template <int dim, int type> inline Ray<dim>
 Transform<dim, type>::trRay(Ray<dim> const& r) const
 {
 	return Ray<dim>(trPoint(r.origin()), trVector(r.direction()));
 }
+template <int dim, int type> inline RenderRay<dim>
+Transform<dim, type>::trRay(RenderRay<dim> const& r) const
+{
+	return RenderRay<dim>(trPoint(r.origin()), trVector(r.direction()),
+	                      r.tMax(), r.time());
+}
 template <int dim, int type> inline RayDifferential<dim>
 Transform<dim, type>::trRayD(RayDifferential<dim> const& rd) const
 {
@@ -210,68 +429,336 @@ Transform<dim, type>::trRayD(RayDifferential<dim> const& rd) const
 template <int dim, int type> inline BoxAxisAligned<dim>
 Transform<dim, type>::trBoxAA(BoxAxisAligned<dim> const& b) const
 {
-	assert(dim == 3 && "Not implemented for dimensions other than 3");
-	BoxAxisAligned<dim> result(trPoint(b.corner(BoxAxisAligned<dim>::BottomLeftFloor)));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::BottomLeftCeil));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::BottomRightFloor));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::BottomRightCeil));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::TopLeftFloor));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::TopLeftCeil));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::TopRightFloor));
-	result |= trPoint(b.corner(BoxAxisAligned<dim>::TopRightCeil));
+	if (cls == TransformClass::Identity || b.isEmpty())
+		return b;
+	if (cls == TransformClass::Translation)
+		return BoxAxisAligned<dim>(b.min() + mat.translation(),
+		                           b.max() + mat.translation());
+	if (cls == TransformClass::Projective)
+		return trBoxCorners(homogeneous(), b);
+	return trBoxArvo(mat.linear(), mat.translation(), b);
+}
+template <int dim, int type> inline void
+Transform<dim, type>::trBoxesAA(BoxAxisAligned<dim> const* in,
+                                BoxAxisAligned<dim>* out, std::size_t n) const
+{
+	if (cls == TransformClass::Identity)
+	{
+		if (in != out) std::copy(in, in + n, out);
+		return;
+	}
+	if (cls == TransformClass::Projective)
+	{
+		Matrix<dim + 1> const h = homogeneous();
+		for (std::size_t k = 0; k < n; ++k)
+			if (!in[k].isEmpty()) out[k] = trBoxCorners(h, in[k]);
+			else if (in != out) out[k] = in[k];
+		return;
+	}
+	Matrix<dim> const l = mat.linear();
+	Vector<dim> const t = mat.translation();
+	for (std::size_t k = 0; k < n; ++k)
+		if (!in[k].isEmpty()) out[k] = trBoxArvo(l, t, in[k]);
+		else if (in != out) out[k] = in[k];
+}
+
+template <int dim, int type> inline BoxAxisAligned<dim>
+Transform<dim, type>::trBoxArvo(Matrix<dim> const& l, Vector<dim> const& t,
+                                BoxAxisAligned<dim> const& b)
+{
+	Point<dim> lower = t, upper = t;
+	for (int i = 0; i < dim; ++i)
+		for (int j = 0; j < dim; ++j)
+		{
+			real const x0 = l(i, j) * b.min()[j];
+			real const x1 = l(i, j) * b.max()[j];
+			lower[i] += std::min(x0, x1);
+			upper[i] += std::max(x0, x1);
+		}
+	return BoxAxisAligned<dim>(lower, upper);
+}
+template <int dim, int type> inline BoxAxisAligned<dim>
+Transform<dim, type>::trBoxCorners(Matrix<dim + 1> const& h,
+                                   BoxAxisAligned<dim> const& b)
+{
+	BoxAxisAligned<dim> result;
+	int signs = 0;
+	for (unsigned int corner = 0; corner < (1u << dim); ++corner)
+	{
+		Eigen::Matrix<real, dim + 1, 1> x;
+		for (int j = 0; j < dim; ++j)
+			x[j] = corner & (1u << j) ? b.max()[j] : b.min()[j];
+		x[dim] = 1;
+		Eigen::Matrix<real, dim + 1, 1> const y = h * x;
+		signs |= y[dim] > 0 ? 1 : y[dim] < 0 ? 2 : 3;
+		result |= Point<dim>(y.template head<dim>() / y[dim]);
+	}
+	// Unless the homogeneous coordinates of all the corners have the same
+	// sign, the box meets the plane mapped to infinity
+	if (signs == 3)
+		return BoxAxisAligned<dim>(Point<dim>::Constant(-INFINITY),
+		                           Point<dim>::Constant(INFINITY));
 	return result;
 }
 
+template <int dim, int type> inline void
+Transform<dim, type>::trPoints(real const* const in[dim], real* const out[dim],
+                               std::size_t n) const
+{
+	constexpr bool const divide = type == Eigen::Projective;
+	Matrix<dim + 1> const h = homogeneous();
+	std::size_t const k = trSoA<true, divide, nativeWidth<real>()>(h, in, out, 0, n);
+	trSoA<true, divide, 1>(h, in, out, k, n);
+}
+template <int dim, int type> inline void
+Transform<dim, type>::trVectors(real const* const in[dim], real* const out[dim],
+                                std::size_t n) const
+{
+	Matrix<dim + 1> const h = homogeneous();
+	std::size_t const k = trSoA<false, false, nativeWidth<real>()>(h, in, out, 0, n);
+	trSoA<false, false, 1>(h, in, out, k, n);
+}
+template <int dim, int type> inline void
+Transform<dim, type>::trNormals(real const* const in[dim], real* const out[dim],
+                                std::size_t n) const
+{
+	Matrix<dim + 1> h = Matrix<dim + 1>::Identity();
+	if (cls <= TransformClass::Rigid)
+		h.template topLeftCorner<dim, dim>() = mat.linear();
+	else
+		h.template topLeftCorner<dim, dim>() = invMat.linear().transpose();
+	std::size_t const k = trSoA<false, false, nativeWidth<real>()>(h, in, out, 0, n);
+	trSoA<false, false, 1>(h, in, out, k, n);
+}
+template <int dim, int type> inline void
+Transform<dim, type>::trRays(real const* const o[dim], real const* const d[dim],
+                             real* const oOut[dim], real* const dOut[dim],
+                             std::size_t n) const
+{
+	trPoints(o, oOut, n);
+	trVectors(d, dOut, n);
+}
+template <int dim, int type> inline void
+Transform<dim, type>::trBoxesAA(real const* const lower[dim],
+                                real const* const upper[dim],
+                                real* const lowerOut[dim],
+                                real* const upperOut[dim], std::size_t n) const
+{
+	static_assert(type != Eigen::Projective, "Only affine transforms are supported");
+	Matrix<dim + 1> const h = homogeneous();
+	std::size_t const k = trBoxesSoA<nativeWidth<real>()>(h, lower, upper,
+	                                                      lowerOut, upperOut, 0, n);
+	trBoxesSoA<1>(h, lower, upper, lowerOut, upperOut, k, n);
+}
+
+template <int dim, int type> inline Matrix<dim + 1>
+Transform<dim, type>::homogeneous() const
+{
+	return Eigen::Transform<real, dim, Eigen::Projective>(mat).matrix();
+}
+template <int dim, int type>
+template <bool translate, bool divide, int width> inline std::size_t
+Transform<dim, type>::trSoA(Matrix<dim + 1> const& h, real const* const in[dim],
+                            real* const out[dim], std::size_t begin,
+                            std::size_t end)
+{
+	typedef Pack<real, width> P;
+	P c[dim + 1][dim + 1];
+	for (int i = 0; i <= dim; ++i)
+		for (int j = 0; j <= dim; ++j)
+			c[i][j] = P::set1(h(i, j));
+
+	std::size_t k = begin;
+	for (; k + width <= end; k += width)
+	{
+		// Load all components first, since out may alias in
+		P x[dim];
+		for (int j = 0; j < dim; ++j)
+			x[j] = P::loadu(in[j] + k);
+		P w = c[dim][dim];
+		if (divide)
+			for (int j = 0; j < dim; ++j)
+				w = fmadd(c[dim][j], x[j], w);
+		for (int i = 0; i < dim; ++i)
+		{
+			P y = translate ? c[i][dim] : P::set1(0);
+			for (int j = 0; j < dim; ++j)
+				y = fmadd(c[i][j], x[j], y);
+			if (divide) y = y / w;
+			y.store(out[i] + k);
+		}
+	}
+	return k;
+}
+template <int dim, int type>
+template <int width> inline std::size_t
+Transform<dim, type>::trBoxesSoA(Matrix<dim + 1> const& h,
+                                 real const* const lower[dim],
+                                 real const* const upper[dim],
+                                 real* const lowerOut[dim],
+                                 real* const upperOut[dim],
+                                 std::size_t begin, std::size_t end)
+{
+	typedef Pack<real, width> P;
+	P c[dim][dim + 1];
+	for (int i = 0; i < dim; ++i)
+		for (int j = 0; j <= dim; ++j)
+			c[i][j] = P::set1(h(i, j));
+
+	int const allLanes = (1 << width) - 1;
+	std::size_t k = begin;
+	for (; k + width <= end; k += width)
+	{
+		P x0[dim], x1[dim];
+		int nonEmpty = allLanes;
+		for (int j = 0; j < dim; ++j)
+		{
+			x0[j] = P::loadu(lower[j] + k);
+			x1[j] = P::loadu(upper[j] + k);
+			nonEmpty &= maskLessEqual(x0[j], x1[j]);
+		}
+		// Each term of the product is minimised and maximised separately
+		for (int i = 0; i < dim; ++i)
+		{
+			P y0 = c[i][dim], y1 = c[i][dim];
+			for (int j = 0; j < dim; ++j)
+			{
+				P const a = c[i][j] * x0[j];
+				P const b = c[i][j] * x1[j];
+				y0 = y0 + min(a, b);
+				y1 = y1 + max(a, b);
+			}
+			y0.store(lowerOut[i] + k);
+			y1.store(upperOut[i] + k);
+		}
+		// Infinite bounds times zero entries give NaNs in empty lanes
+		for (int m = ~nonEmpty & allLanes; m; m &= m - 1)
+		{
+			int const lane = countTrailingZeros((uint32_t) m);
+			for (int j = 0; j < dim; ++j)
+			{
+				lowerOut[j][k + lane] = x0[j][lane];
+				upperOut[j][k + lane] = x1[j][lane];
+			}
+		}
+	}
+	return k;
+}
+
 template <int dim, int type> inline
 Transform<dim, type>::Transform(Eigen::Transform<real, dim, type> const& mat,
-                              Eigen::Transform<real, dim, type> const& invMat):
-	mat(mat), invMat(invMat)
+                              Eigen::Transform<real, dim, type> const& invMat,
+                              TransformClass cls):
+	mat(mat), invMat(invMat), cls(cls)
+{
+}
+
+template <int dim, int type> inline TransformClass
+Transform<dim, type>::classify(Eigen::Transform<real, dim, type> const& m)
+{
+	if (type == Eigen::Projective)
+	{
+		Eigen::Matrix<real, 1, dim + 1> lastRow = Eigen::Matrix<real, 1, dim + 1>::Zero();
+		lastRow[dim] = 1;
+		if (m.matrix().row(dim) != lastRow)
+			return TransformClass::Projective;
+	}
+	Matrix<dim> const linear = m.linear();
+	if (linear == Matrix<dim>::Identity())
+		return m.translation() == Vector<dim>::Zero() ?
+		       TransformClass::Identity : TransformClass::Translation;
+
+	real const tolerance = 4 * dim * std::numeric_limits<real>::epsilon();
+	Matrix<dim> const gram = linear.transpose() * linear;
+	real const scale2 = gram.trace() / dim;
+	real const deviation =
+		(gram - scale2 * Matrix<dim>::Identity()).cwiseAbs().maxCoeff();
+	if (deviation > tolerance * scale2)
+		return TransformClass::Affine;
+	return std::abs(scale2 - 1) <= tolerance ?
+	       TransformClass::Rigid : TransformClass::UniformScale;
+}
+template <int dim, int type> inline Eigen::Transform<real, dim, type>
+Transform<dim, type>::inverseOf(Eigen::Transform<real, dim, type> const& m,
+                                TransformClass c)
 {
+	Eigen::Transform<real, dim, type> result =
+		Eigen::Transform<real, dim, type>::Identity();
+	switch (c)
+	{
+	case TransformClass::Identity:
+		return result;
+	case TransformClass::Translation:
+		result.translation() = -m.translation();
+		return result;
+	case TransformClass::Rigid:
+	case TransformClass::UniformScale:
+	{
+		// (s Q)^-1 = Q^T / s
+		real const scale2 = c == TransformClass::Rigid ? 1 :
+		                    m.linear().col(0).squaredNorm();
+		Matrix<dim> const inv = m.linear().transpose() / scale2;
+		result.linear() = inv;
+		result.translation() = -(inv * m.translation());
+		return result;
+	}
+	default:
+	{
+		Matrix<dim + 1> const h =
+			Eigen::Transform<real, dim, Eigen::Projective>(m).matrix();
+		result = Eigen::Transform<real, dim, type>(Matrix<dim + 1>(
+			h.template cast<double>().inverse().template cast<real>()));
+		return result;
+	}
+	}
 }
 
 template <int dim, int type> inline bool
 operator==(Transform<dim, type> const& t0, Transform<dim, type> const& t1)
 {
-	return t0.mat == t1.mat;
+	return t0.mat.matrix() == t1.mat.matrix();
 }
 template <int dim, int type> bool
 operator!=(Transform<dim, type> const& t0, Transform<dim, type> const& t1)
 {
-	return t0.mat != t1.mat;
+	return t0.mat.matrix() != t1.mat.matrix();
 }
 template <int dim> Transform<dim, Eigen::AffineCompact>
 operator*(Transform<dim, Eigen::AffineCompact> const& t0,
           Transform<dim, Eigen::AffineCompact> const& t1)
 {
 	return Transform<dim, Eigen::AffineCompact>(t0.mat * t1.mat,
-	       t1.invMat * t0.invMat);
+	       t1.invMat * t0.invMat, compose(t0.cls, t1.cls));
 }
 template <int dim> Transform<dim, Eigen::Projective>
 operator*(Transform<dim, Eigen::Projective> const& t0,
           Transform<dim, Eigen::AffineCompact> const& t1)
 {
 	return Transform<dim, Eigen::Projective>(t0.mat * t1.mat,
-	                                       t1.invMat * t0.invMat);
+	                                       t1.invMat * t0.invMat,
+	                                       compose(t0.cls, t1.cls));
 }
 template <int dim> Transform<dim, Eigen::Projective>
 operator*(Transform<dim, Eigen::AffineCompact> const& t0,
           Transform<dim, Eigen::Projective> const& t1)
 {
 	return Transform<dim, Eigen::Projective>(t0.mat * t1.mat,
-	                                       t1.invMat * t0.invMat);
+	                                       t1.invMat * t0.invMat,
+	                                       compose(t0.cls, t1.cls));
 }
 template <int dim> Transform<dim, Eigen::Projective>
 operator*(Transform<dim, Eigen::Projective> const& t0,
           Transform<dim, Eigen::Projective> const& t1)
 {
 	return Transform<dim, Eigen::Projective>(t0.mat * t1.mat,
-	                                       t1.invMat * t0.invMat);
+	                                       t1.invMat * t0.invMat,
+	                                       compose(t0.cls, t1.cls));
 }
 
 template <int dim, int type> inline Transform<dim, type>
 inverse(Transform<dim, type> const& t) noexcept
 {
-	return Transform<dim, type>(t.invMat, t.mat);
+	return Transform<dim, type>(t.invMat, t.mat, t.cls);
 }
 
 } // namespace photino
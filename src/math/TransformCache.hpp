@@ -0,0 +1,145 @@
+#ifndef PHOTINO_MATH_TRANSFORMCACHE_HPP_
+#define PHOTINO_MATH_TRANSFORMCACHE_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "Transform.hpp"
+#include "integers.hpp"
+#include "../core/MemoryPool.hpp"
+#include "../core/Random.hpp"
+
+namespace photino
+{
+
+/**
+ * Transforms are copied into a memory pool and indexed by a hash table with
+ * open addressing and linear probing. Canonical pointers remain valid until
+ * \ref clear or the destruction of the cache.
+ *
+ * @brief Interns transforms, so that equal transforms share one copy and one
+ *  address.
+ * @warning Not thread-safe.
+ */
+template <int dim, int type>
+class TransformCache final
+{
+public:
+	/**
+	 * @param[in] capacity Number of transforms held before the table grows
+	 */
+	explicit TransformCache(std::size_t capacity = 256);
+	TransformCache(TransformCache const&) = delete;
+	TransformCache& operator=(TransformCache const&) = delete;
+
+	/**
+	 * @return Canonical copy of the transform. Transforms equal under
+	 *  operator== receive the same pointer.
+	 */
+	Transform<dim, type> const* lookup(Transform<dim, type> const&);
+	/**
+	 * @brief Number of distinct transforms held
+	 */
+	std::size_t size() const;
+	/**
+	 * @warning Invalidates all the canonical pointers.
+	 */
+	void clear();
+
+private:
+	/**
+	 * @brief Hash of the coefficients, with -0 and 0 identified
+	 */
+	static uint64_t hash(Transform<dim, type> const&);
+	/**
+	 * @brief Doubles the table and reinserts the transforms
+	 */
+	void grow();
+
+	MemoryPool pool;
+	std::vector<Transform<dim, type> const*> table; ///< Size is a power of 2
+	std::vector<uint64_t> hashes;
+	std::size_t nEntries;
+};
+
+
+// Implementations
+
+template <int dim, int type> inline
+TransformCache<dim, type>::TransformCache(std::size_t capacity):
+	table(roundUpPow2((uint64_t) (2 * capacity > 2 ? 2 * capacity : 2)), nullptr),
+	hashes(table.size()), nEntries(0)
+{
+}
+
+template <int dim, int type> inline Transform<dim, type> const*
+TransformCache<dim, type>::lookup(Transform<dim, type> const& t)
+{
+	// Keep the load factor at most 1/2
+	if (2 * (nEntries + 1) > table.size()) grow();
+
+	uint64_t const h = hash(t);
+	std::size_t const mask = table.size() - 1;
+	std::size_t i = h & mask;
+	for (; table[i]; i = (i + 1) & mask)
+		if (hashes[i] == h && *table[i] == t)
+			return table[i];
+
+	Transform<dim, type>* const copy = new (pool.alloc<Transform<dim, type>>())
+	                                   Transform<dim, type>(t);
+	table[i] = copy;
+	hashes[i] = h;
+	++nEntries;
+	return copy;
+}
+template <int dim, int type> inline std::size_t
+TransformCache<dim, type>::size() const
+{
+	return nEntries;
+}
+template <int dim, int type> inline void
+TransformCache<dim, type>::clear()
+{
+	std::fill(table.begin(), table.end(), nullptr);
+	nEntries = 0;
+	pool.freeAll();
+}
+
+template <int dim, int type> inline uint64_t
+TransformCache<dim, type>::hash(Transform<dim, type> const& t)
+{
+	Matrix<dim + 1> const h = t.homogeneous();
+	uint64_t result = 0;
+	for (int i = 0; i < h.size(); ++i)
+	{
+		// Adding 0 turns -0 into 0, which compares equal
+		double const x = double(h.data()[i]) + 0.0;
+		uint64_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		result = mixBits(result ^ bits);
+	}
+	return result;
+}
+template <int dim, int type> inline void
+TransformCache<dim, type>::grow()
+{
+	std::vector<Transform<dim, type> const*> newTable(2 * table.size(), nullptr);
+	std::vector<uint64_t> newHashes(newTable.size());
+	std::size_t const mask = newTable.size() - 1;
+	for (std::size_t j = 0; j < table.size(); ++j)
+	{
+		if (!table[j]) continue;
+		std::size_t i = hashes[j] & mask;
+		while (newTable[i]) i = (i + 1) & mask;
+		newTable[i] = table[j];
+		newHashes[i] = hashes[j];
+	}
+	table.swap(newTable);
+	hashes.swap(newHashes);
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_MATH_TRANSFORMCACHE_HPP_
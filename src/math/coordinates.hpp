@@ -1,6 +1,8 @@
 #ifndef PHOTINO_MATH_COORDINATES_HPP_
 #define PHOTINO_MATH_COORDINATES_HPP_
 
+#include <cmath>
+
 #include "geometry.hpp"
 
 namespace photino
@@ -27,16 +29,16 @@ Matrix<4> lookAt(Point<3> const& camera, Point<3> const& focus,
 inline void getPerpendicular(Vector<3> const& vIn,
                              Vector<3>* const v0, Vector<3>* const v1)
 {
-	if (abs(vIn[0]) > abs(vIn[1]))
+	if (std::abs(vIn[0]) > std::abs(vIn[1]))
 	{
-		real fac = 1.0 / sqrt(vIn[0] * vIn[0] + vIn[2] * vIn[2]);
+		real fac = 1 / std::sqrt(vIn[0] * vIn[0] + vIn[2] * vIn[2]);
 		(*v0)[0] = -vIn[2] * fac;
 		(*v0)[1] = 0;
 		(*v0)[2] = vIn[0] * fac;
 	}
 	else
 	{
-		real fac = 1.0 / sqrt(vIn[1] * vIn[1] + vIn[2] * vIn[2]);
+		real fac = 1 / std::sqrt(vIn[1] * vIn[1] + vIn[2] * vIn[2]);
 		(*v0)[0] = 0;
 		(*v0)[1] = vIn[2] * fac;
 		(*v0)[2] = -vIn[1] * fac;
@@ -71,6 +71,10 @@ maxExtent(BoxAxisAligned<m> const&);
  */
 template <int m> real
 maxExtent(BoxAxisAligned<m> const&, int* dim);
+/**
+ * @return 0 if the box is empty
+ */
+real surfaceArea(BoxAxisAligned<3> const&);
 
 
 // Implementations
@@ -218,6 +222,12 @@ maxExtent(BoxAxisAligned<m> const& b, int* index)
 {
 	return b.sizes().maxCoeff(index);
 }
+inline real surfaceArea(BoxAxisAligned<3> const& b)
+{
+	if (b.isEmpty()) return 0;
+	Vector<3> d = b.sizes();
+	return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
 
 } // namespace photino
 
@@ -2,6 +2,12 @@
 #define PHOTINO_MATH_INTEGERS_HPP_
 
 #include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 namespace photino
 {
@@ -13,6 +19,44 @@ template <typename T> T roundUpModulo(T x, T mod);
 
 uint32_t roundUpPow2(uint32_t);
 uint64_t roundUpPow2(uint64_t);
+/**
+ * @warning Result undefined if i == 0
+ * @brief Index of the least significant set bit
+ */
+int countTrailingZeros(uint32_t i);
+/**
+ * @brief Number of set bits
+ */
+int countSetBits(uint32_t i);
+/**
+ * @brief Index of the most significant set bit, i.e. floor(log2(i))
+ * @warning Result undefined if i == 0
+ */
+int log2Int(uint32_t i);
+/**
+ * @brief Reverses the order of the bits of i
+ */
+uint32_t reverseBits(uint32_t i);
+
+/**
+ * @brief Interleaves the lower 16 bits of x and y into a Z-order (Morton)
+ *  code. Bits of x occupy the even positions.
+ */
+uint32_t encodeMorton2(uint32_t x, uint32_t y);
+/**
+ * @brief Inverse of \ref encodeMorton2
+ */
+void decodeMorton2(uint32_t code, uint32_t* const x, uint32_t* const y);
+/**
+ * @brief Interleaves the lower 10 bits of x, y and z into a 30 bits Morton
+ *  code. Bits of x occupy the positions multiple of 3.
+ */
+uint32_t encodeMorton3(uint32_t x, uint32_t y, uint32_t z);
+/**
+ * @brief Inverse of \ref encodeMorton3
+ */
+void decodeMorton3(uint32_t code, uint32_t* const x, uint32_t* const y,
+                   uint32_t* const z);
 
 
 // Implementations
@@ -46,6 +90,116 @@ inline uint64_t roundUpPow2(uint64_t i)
 	++i;
 	return i;
 
+}
+inline int countTrailingZeros(uint32_t i)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, i);
+	return (int) index;
+#else
+	return __builtin_ctz(i);
+#endif
+}
+inline int countSetBits(uint32_t i)
+{
+#ifdef _MSC_VER
+	return (int) __popcnt(i);
+#else
+	return __builtin_popcount(i);
+#endif
+}
+inline int log2Int(uint32_t i)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, i);
+	return (int) index;
+#else
+	return 31 - __builtin_clz(i);
+#endif
+}
+
+inline uint32_t reverseBits(uint32_t i)
+{
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x00FF00FF) << 8) | ((i & 0xFF00FF00) >> 8);
+	i = ((i & 0x0F0F0F0F) << 4) | ((i & 0xF0F0F0F0) >> 4);
+	i = ((i & 0x33333333) << 2) | ((i & 0xCCCCCCCC) >> 2);
+	i = ((i & 0x55555555) << 1) | ((i & 0xAAAAAAAA) >> 1);
+	return i;
+}
+
+inline uint32_t encodeMorton2(uint32_t x, uint32_t y)
+{
+#ifdef __BMI2__
+	return _pdep_u32(x, 0x55555555) | _pdep_u32(y, 0xAAAAAAAA);
+#else
+	uint64_t v = x | (uint64_t(y) << 32);
+	v &= 0x0000FFFF0000FFFF;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0F;
+	v = (v | (v << 2)) & 0x3333333333333333;
+	v = (v | (v << 1)) & 0x5555555555555555;
+	return (uint32_t) (v | (v >> 31));
+#endif
+}
+inline void decodeMorton2(uint32_t code, uint32_t* const x, uint32_t* const y)
+{
+#ifdef __BMI2__
+	*x = _pext_u32(code, 0x55555555);
+	*y = _pext_u32(code, 0xAAAAAAAA);
+#else
+	uint64_t v = code | (uint64_t(code >> 1) << 32);
+	v &= 0x5555555555555555;
+	v = (v | (v >> 1)) & 0x3333333333333333;
+	v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0F;
+	v = (v | (v >> 4)) & 0x00FF00FF00FF00FF;
+	v = (v | (v >> 8)) & 0x0000FFFF0000FFFF;
+	*x = (uint32_t) v;
+	*y = (uint32_t) (v >> 32);
+#endif
+}
+
+inline uint32_t encodeMorton3(uint32_t x, uint32_t y, uint32_t z)
+{
+#ifdef __BMI2__
+	return _pdep_u32(x, 0x09249249) | _pdep_u32(y, 0x12492492) |
+	       _pdep_u32(z, 0x24924924);
+#else
+	auto spread = [](uint32_t v)
+	{
+		v &= 0x000003FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+#endif
+}
+inline void decodeMorton3(uint32_t code, uint32_t* const x, uint32_t* const y,
+                          uint32_t* const z)
+{
+#ifdef __BMI2__
+	*x = _pext_u32(code, 0x09249249);
+	*y = _pext_u32(code, 0x12492492);
+	*z = _pext_u32(code, 0x24924924);
+#else
+	auto compact = [](uint32_t v)
+	{
+		v &= 0x09249249;
+		v = (v | (v >> 2)) & 0x030C30C3;
+		v = (v | (v >> 4)) & 0x0300F00F;
+		v = (v | (v >> 8)) & 0x030000FF;
+		v = (v | (v >> 16)) & 0x000003FF;
+		return v;
+	};
+	*x = compact(code);
+	*y = compact(code >> 1);
+	*z = compact(code >> 2);
+#endif
 }
 } // namespace photino
 
@@ -2,6 +2,9 @@
 #define PHOTINO_MATH_NUMBERS_HPP_
 
 #include <cmath>
+#include <limits>
+
+#include "../core/photino.hpp"
 
 #ifndef M_PI
 #define M_PI 3.141592653589793238462643383279502884197169399375105820974
@@ -13,6 +16,32 @@ namespace photino
 template <typename S, typename T> T
 lerp(S const& time, T const& t0, T const& t1);
 
+/**
+ * @brief Maximum relative rounding error of one arithmetic operation on real
+ */
+constexpr real const machineEpsilon = std::numeric_limits<real>::epsilon() / 2;
+/**
+ * @brief Bound on the relative error of n successive arithmetic operations on
+ *  real, (1 + e)^n - 1 <= gamma(n)
+ */
+constexpr real gamma(int n);
+/**
+ * @brief Smallest representable value greater than x
+ */
+real nextUp(real x);
+/**
+ * @brief Largest representable value smaller than x
+ */
+real nextDown(real x);
+/**
+ * Kahan's algorithm recovers the rounding error of c d with a fused
+ * multiply-add. The result is within 1.5 ulp of the exact value, so in
+ * particular its sign is exact.
+ *
+ * @brief a b - c d
+ */
+real differenceOfProducts(real a, real b, real c, real d);
+
 
 // Implementations
 
@@ -22,6 +51,25 @@ lerp(S const& time, T const& t0, T const& t1)
 	return (1 - time) * t0 + time * t1;
 }
 
+constexpr inline real gamma(int n)
+{
+	return (n * machineEpsilon) / (1 - n * machineEpsilon);
+}
+inline real nextUp(real x)
+{
+	return std::nextafter(x, std::numeric_limits<real>::infinity());
+}
+inline real nextDown(real x)
+{
+	return std::nextafter(x, -std::numeric_limits<real>::infinity());
+}
+inline real differenceOfProducts(real a, real b, real c, real d)
+{
+	real const cd = c * d;
+	real const error = std::fma(-c, d, cd);
+	return std::fma(a, b, -cd) + error;
+}
+
 } // namespace photino
 
 #endif // !PHOTINO_MATH_NUMBERS_HPP_
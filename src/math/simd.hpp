@@ -0,0 +1,346 @@
+#ifndef PHOTINO_MATH_SIMD_HPP_
+#define PHOTINO_MATH_SIMD_HPP_
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Thin wrapper over SIMD registers. The generic Pack is a plain array on which
+ * every operation loops, and specialisations use SSE/AVX when available.
+ */
+
+namespace photino
+{
+
+template <typename T, int width>
+struct Pack
+{
+	T v[width];
+
+	static Pack<T, width> set1(T);
+	/**
+	 * @warning The address must be aligned to sizeof(Pack<T, width>)
+	 */
+	static Pack<T, width> load(T const*);
+	static Pack<T, width> loadu(T const*);
+	void store(T*) const;
+
+	T operator[](int i) const { return v[i]; }
+};
+
+template <typename T, int width> Pack<T, width>
+operator+(Pack<T, width> const&, Pack<T, width> const&);
+template <typename T, int width> Pack<T, width>
+operator-(Pack<T, width> const&, Pack<T, width> const&);
+template <typename T, int width> Pack<T, width>
+operator*(Pack<T, width> const&, Pack<T, width> const&);
+template <typename T, int width> Pack<T, width>
+operator/(Pack<T, width> const&, Pack<T, width> const&);
+template <typename T, int width> Pack<T, width>
+min(Pack<T, width> const&, Pack<T, width> const&);
+template <typename T, int width> Pack<T, width>
+max(Pack<T, width> const&, Pack<T, width> const&);
+template <typename T, int width> Pack<T, width>
+sqrt(Pack<T, width> const&);
+/**
+ * @brief a * b + c, fused if supported
+ */
+template <typename T, int width> Pack<T, width>
+fmadd(Pack<T, width> const& a, Pack<T, width> const& b,
+      Pack<T, width> const& c);
+/**
+ * @brief a * b - c * d, with the rounding error of c * d compensated. See
+ *  \ref differenceOfProducts. Without hardware fused multiply-add, each lane
+ *  is evaluated with std::fma in software.
+ */
+template <typename T, int width> Pack<T, width>
+differenceOfProducts(Pack<T, width> const& a, Pack<T, width> const& b,
+                     Pack<T, width> const& c, Pack<T, width> const& d);
+/**
+ * @return Bit i is set if a[i] <= b[i]
+ */
+template <typename T, int width> int
+maskLessEqual(Pack<T, width> const& a, Pack<T, width> const& b);
+/**
+ * @return Bit i is set if a[i] < b[i]
+ */
+template <typename T, int width> int
+maskLess(Pack<T, width> const& a, Pack<T, width> const& b);
+
+/**
+ * @brief Number of lanes of the widest register of T enabled on the target,
+ *  or 1 without SIMD support
+ */
+template <typename T> constexpr int nativeWidth();
+
+
+// Implementations
+
+template <typename T, int width> inline Pack<T, width>
+Pack<T, width>::set1(T x)
+{
+	Pack<T, width> result;
+	std::fill(result.v, result.v + width, x);
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+Pack<T, width>::load(T const* p)
+{
+	return loadu(p);
+}
+template <typename T, int width> inline Pack<T, width>
+Pack<T, width>::loadu(T const* p)
+{
+	Pack<T, width> result;
+	std::copy(p, p + width, result.v);
+	return result;
+}
+template <typename T, int width> inline void
+Pack<T, width>::store(T* p) const
+{
+	std::copy(v, v + width, p);
+}
+
+template <typename T, int width> inline Pack<T, width>
+operator+(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = a.v[i] + b.v[i];
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+operator-(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = a.v[i] - b.v[i];
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+operator*(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = a.v[i] * b.v[i];
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+operator/(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = a.v[i] / b.v[i];
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+min(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+max(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+fmadd(Pack<T, width> const& a, Pack<T, width> const& b,
+      Pack<T, width> const& c)
+{
+#ifdef __FMA__
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = std::fma(a.v[i], b.v[i], c.v[i]);
+	return result;
+#else
+	return a * b + c;
+#endif
+}
+template <typename T, int width> inline Pack<T, width>
+sqrt(Pack<T, width> const& a)
+{
+	Pack<T, width> result;
+	for (int i = 0; i < width; ++i) result.v[i] = std::sqrt(a.v[i]);
+	return result;
+}
+template <typename T, int width> inline Pack<T, width>
+differenceOfProducts(Pack<T, width> const& a, Pack<T, width> const& b,
+                     Pack<T, width> const& c, Pack<T, width> const& d)
+{
+#ifdef __FMA__
+	Pack<T, width> const zero = Pack<T, width>::set1(0);
+	Pack<T, width> const cd = c * d;
+	Pack<T, width> const error = fmadd(zero - c, d, cd);
+	return fmadd(a, b, zero - cd) + error;
+#else
+	// An unfused fmadd would compute an error of exactly 0
+	T x[4][width];
+	a.store(x[0]);
+	b.store(x[1]);
+	c.store(x[2]);
+	d.store(x[3]);
+	for (int i = 0; i < width; ++i)
+	{
+		T const cd = x[2][i] * x[3][i];
+		T const error = std::fma(-x[2][i], x[3][i], cd);
+		x[0][i] = std::fma(x[0][i], x[1][i], -cd) + error;
+	}
+	return Pack<T, width>::loadu(x[0]);
+#endif
+}
+template <typename T, int width> inline int
+maskLessEqual(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	int result = 0;
+	for (int i = 0; i < width; ++i) result |= (a.v[i] <= b.v[i]) << i;
+	return result;
+}
+template <typename T, int width> inline int
+maskLess(Pack<T, width> const& a, Pack<T, width> const& b)
+{
+	int result = 0;
+	for (int i = 0; i < width; ++i) result |= (a.v[i] < b.v[i]) << i;
+	return result;
+}
+
+/*
+ * Specialisations. pre is the prefix of the intrinsics (_mm or _mm256) and sfx
+ * their suffix (ps or pd).
+ */
+#define PHOTINO_SIMD_PACK(T, width, Reg, pre, sfx) \
+	template <> \
+	struct Pack<T, width> \
+	{ \
+		Reg v; \
+		static Pack<T, width> set1(T x) { return { pre##_set1_##sfx(x) }; } \
+		static Pack<T, width> load(T const* p) { return { pre##_load_##sfx(p) }; } \
+		static Pack<T, width> loadu(T const* p) { return { pre##_loadu_##sfx(p) }; } \
+		void store(T* p) const { pre##_storeu_##sfx(p, v); } \
+		T operator[](int i) const \
+		{ \
+			alignas(sizeof(Reg)) T lanes[width]; \
+			pre##_store_##sfx(lanes, v); \
+			return lanes[i]; \
+		} \
+	}; \
+	template <> inline Pack<T, width> \
+	operator+(Pack<T, width> const& a, Pack<T, width> const& b) \
+	{ return { pre##_add_##sfx(a.v, b.v) }; } \
+	template <> inline Pack<T, width> \
+	operator-(Pack<T, width> const& a, Pack<T, width> const& b) \
+	{ return { pre##_sub_##sfx(a.v, b.v) }; } \
+	template <> inline Pack<T, width> \
+	operator*(Pack<T, width> const& a, Pack<T, width> const& b) \
+	{ return { pre##_mul_##sfx(a.v, b.v) }; } \
+	template <> inline Pack<T, width> \
+	operator/(Pack<T, width> const& a, Pack<T, width> const& b) \
+	{ return { pre##_div_##sfx(a.v, b.v) }; } \
+	template <> inline Pack<T, width> \
+	min(Pack<T, width> const& a, Pack<T, width> const& b) \
+	{ return { pre##_min_##sfx(a.v, b.v) }; } \
+	template <> inline Pack<T, width> \
+	max(Pack<T, width> const& a, Pack<T, width> const& b) \
+	{ return { pre##_max_##sfx(a.v, b.v) }; } \
+	template <> inline Pack<T, width> \
+	sqrt(Pack<T, width> const& a) \
+	{ return { pre##_sqrt_##sfx(a.v) }; }
+
+#ifdef __SSE2__
+PHOTINO_SIMD_PACK(float, 4, __m128, _mm, ps)
+PHOTINO_SIMD_PACK(double, 2, __m128d, _mm, pd)
+
+template <> inline int
+maskLessEqual(Pack<float, 4> const& a, Pack<float, 4> const& b)
+{
+	return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+}
+template <> inline int
+maskLess(Pack<float, 4> const& a, Pack<float, 4> const& b)
+{
+	return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v));
+}
+template <> inline int
+maskLessEqual(Pack<double, 2> const& a, Pack<double, 2> const& b)
+{
+	return _mm_movemask_pd(_mm_cmple_pd(a.v, b.v));
+}
+template <> inline int
+maskLess(Pack<double, 2> const& a, Pack<double, 2> const& b)
+{
+	return _mm_movemask_pd(_mm_cmplt_pd(a.v, b.v));
+}
+#ifdef __FMA__
+template <> inline Pack<float, 4>
+fmadd(Pack<float, 4> const& a, Pack<float, 4> const& b,
+      Pack<float, 4> const& c)
+{
+	return { _mm_fmadd_ps(a.v, b.v, c.v) };
+}
+template <> inline Pack<double, 2>
+fmadd(Pack<double, 2> const& a, Pack<double, 2> const& b,
+      Pack<double, 2> const& c)
+{
+	return { _mm_fmadd_pd(a.v, b.v, c.v) };
+}
+#endif // __FMA__
+#endif // __SSE2__
+
+#ifdef __AVX__
+PHOTINO_SIMD_PACK(float, 8, __m256, _mm256, ps)
+PHOTINO_SIMD_PACK(double, 4, __m256d, _mm256, pd)
+
+template <> inline int
+maskLessEqual(Pack<float, 8> const& a, Pack<float, 8> const& b)
+{
+	return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+}
+template <> inline int
+maskLess(Pack<float, 8> const& a, Pack<float, 8> const& b)
+{
+	return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ));
+}
+template <> inline int
+maskLessEqual(Pack<double, 4> const& a, Pack<double, 4> const& b)
+{
+	return _mm256_movemask_pd(_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ));
+}
+template <> inline int
+maskLess(Pack<double, 4> const& a, Pack<double, 4> const& b)
+{
+	return _mm256_movemask_pd(_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ));
+}
+#ifdef __FMA__
+template <> inline Pack<float, 8>
+fmadd(Pack<float, 8> const& a, Pack<float, 8> const& b,
+      Pack<float, 8> const& c)
+{
+	return { _mm256_fmadd_ps(a.v, b.v, c.v) };
+}
+template <> inline Pack<double, 4>
+fmadd(Pack<double, 4> const& a, Pack<double, 4> const& b,
+      Pack<double, 4> const& c)
+{
+	return { _mm256_fmadd_pd(a.v, b.v, c.v) };
+}
+#endif // __FMA__
+#endif // __AVX__
+
+#undef PHOTINO_SIMD_PACK
+
+template <typename T> constexpr inline int nativeWidth()
+{
+#if defined(__AVX__)
+	return 32 / sizeof(T);
+#elif defined(__SSE2__)
+	return 16 / sizeof(T);
+#else
+	return 1;
+#endif
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_MATH_SIMD_HPP_
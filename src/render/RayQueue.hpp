@@ -0,0 +1,210 @@
+#ifndef PHOTINO_RENDER_RAYQUEUE_HPP_
+#define PHOTINO_RENDER_RAYQUEUE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+#include "../core/MemoryPool.hpp"
+#include "../math/RayPacket.hpp"
+
+namespace photino
+{
+
+/**
+ * Each field is a separate array, so that a stage streams only the fields it
+ * reads and loads consecutive rays into SIMD lanes. The arrays are allocated
+ * once from a \ref MemoryPool and reused by \ref clear.
+ *
+ * Besides the ray, an entry holds the index of the path it belongs to, whose
+ * state is kept by the stages, and the primitive it hit, written by the
+ * intersection stages.
+ *
+ * @brief Fixed capacity structure of arrays queue of rays, shared by the
+ *  stages of a wavefront pipeline.
+ */
+class RayQueue final
+{
+public:
+	static constexpr uint32_t const noHit = UINT32_MAX;
+	/**
+	 * @brief Returned by \ref push when the queue is full
+	 */
+	static constexpr std::size_t const full = SIZE_MAX;
+
+	/**
+	 * @param[in] pool Owner of the arrays, which must outlive the queue
+	 */
+	RayQueue(std::size_t capacity, MemoryPool* const pool);
+	RayQueue(RayQueue const&) = delete;
+	RayQueue& operator=(RayQueue const&) = delete;
+
+	std::size_t capacity() const;
+	std::size_t size() const;
+	bool empty() const;
+	/**
+	 * @brief Empties the queue and resets \ref nOverflowed.
+	 */
+	void clear();
+	/**
+	 * @brief Number of entries requested beyond the capacity since the last
+	 *  \ref clear, which were dropped
+	 */
+	std::size_t nOverflowed() const;
+
+	/**
+	 * Entries past the capacity are not appended but counted by
+	 * \ref nOverflowed, in all builds. Debug builds also assert.
+	 *
+	 * @brief Appends up to n uninitialised entries. Thread-safe. Threads
+	 *  should reserve their rays in batches rather than one by one, since the
+	 *  queue has a single counter.
+	 * @param[out] nReserved Number of entries appended, n unless the queue
+	 *  is full
+	 * @return Index of the first entry
+	 */
+	std::size_t reserve(std::size_t n, std::size_t* const nReserved);
+	/**
+	 * @brief Appends a ray. Thread-safe.
+	 * @return Index of the entry, or \ref full if the ray was dropped
+	 */
+	std::size_t push(RenderRay<3> const&, uint32_t path);
+	/**
+	 * @brief Sets entry i, whose hit is reset to \ref noHit.
+	 */
+	void set(std::size_t i, RenderRay<3> const&, uint32_t path);
+	RenderRay<3> ray(std::size_t i) const;
+
+	/**
+	 * @brief Loads entries [first, first + width) into the lanes of a packet,
+	 *  clipped at the end of the queue.
+	 * @return Mask of the lanes loaded
+	 */
+	template <int width> int
+	load(std::size_t first, RayPacket<width>* const) const;
+
+	real* o[3];
+	real* d[3];
+	real* tMax;
+	real* time;
+	uint32_t* path; ///< Index of the path of each ray
+	uint32_t* prim; ///< Primitive hit, or \ref noHit
+
+private:
+	std::size_t nMax;
+	/**
+	 * Entries requested, which exceeds nMax if the queue overflowed
+	 */
+	std::atomic<std::size_t> count;
+};
+
+
+// Implementations
+
+inline RayQueue::RayQueue(std::size_t capacity, MemoryPool* const pool):
+	nMax(capacity), count(0)
+{
+	for (int j = 0; j < 3; ++j)
+	{
+		o[j] = pool->alloc<real>(capacity);
+		d[j] = pool->alloc<real>(capacity);
+	}
+	tMax = pool->alloc<real>(capacity);
+	time = pool->alloc<real>(capacity);
+	path = pool->alloc<uint32_t>(capacity);
+	prim = pool->alloc<uint32_t>(capacity);
+}
+
+inline std::size_t RayQueue::capacity() const
+{
+	return nMax;
+}
+inline std::size_t RayQueue::size() const
+{
+	std::size_t const n = count.load(std::memory_order_acquire);
+	return n < nMax ? n : nMax;
+}
+inline bool RayQueue::empty() const
+{
+	return size() == 0;
+}
+inline void RayQueue::clear()
+{
+	count.store(0, std::memory_order_release);
+}
+inline std::size_t RayQueue::nOverflowed() const
+{
+	std::size_t const n = count.load(std::memory_order_acquire);
+	return n > nMax ? n - nMax : 0;
+}
+
+inline std::size_t
+RayQueue::reserve(std::size_t n, std::size_t* const nReserved)
+{
+	std::size_t const first = count.fetch_add(n, std::memory_order_relaxed);
+	assert(first + n <= nMax && "Ray queue overflow");
+	*nReserved = first >= nMax ? 0 : std::min(n, nMax - first);
+	return first;
+}
+inline std::size_t RayQueue::push(RenderRay<3> const& r, uint32_t path)
+{
+	std::size_t n;
+	std::size_t const i = reserve(1, &n);
+	if (!n) return full;
+	set(i, r, path);
+	return i;
+}
+inline void RayQueue::set(std::size_t i, RenderRay<3> const& r, uint32_t p)
+{
+	for (int j = 0; j < 3; ++j)
+	{
+		o[j][i] = r.origin()[j];
+		d[j][i] = r.direction()[j];
+	}
+	tMax[i] = r.tMax();
+	time[i] = r.time();
+	path[i] = p;
+	prim[i] = noHit;
+}
+inline RenderRay<3> RayQueue::ray(std::size_t i) const
+{
+	return RenderRay<3>(Point<3>(o[0][i], o[1][i], o[2][i]),
+	                    Vector<3>(d[0][i], d[1][i], d[2][i]),
+	                    tMax[i], time[i]);
+}
+
+template <int width> inline int
+RayQueue::load(std::size_t first, RayPacket<width>* const packet) const
+{
+	std::size_t const n = size();
+	int const nLanes = first + width <= n ? width : (int) (n - first);
+	for (int i = 0; i < nLanes; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			packet->o[j][i] = o[j][first + i];
+			packet->d[j][i] = d[j][first + i];
+			packet->invDir[j][i] = 1 / d[j][first + i];
+		}
+		packet->tMax[i] = tMax[first + i];
+		packet->time[i] = time[first + i];
+	}
+	// Unused lanes must not produce spurious NaNs or exceptions
+	for (int i = nLanes; i < width; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			packet->o[j][i] = 0;
+			packet->d[j][i] = 1;
+			packet->invDir[j][i] = 1;
+		}
+		packet->tMax[i] = 0;
+		packet->time[i] = 0;
+	}
+	return (int) ((1ull << nLanes) - 1);
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_RENDER_RAYQUEUE_HPP_
@@ -0,0 +1,95 @@
+#include "TileScheduler.hpp"
+
+#include <algorithm>
+
+namespace photino
+{
+
+namespace
+{
+
+/**
+ * @brief Converts a distance along the Hilbert curve filling a square of side
+ *  2^logSide into coordinates.
+ */
+void hilbertToPoint(uint64_t d, int logSide,
+                    std::size_t* const j, std::size_t* const k)
+{
+	std::size_t x = 0, y = 0;
+	for (std::size_t s = 1; s < (std::size_t(1) << logSide); s <<= 1)
+	{
+		std::size_t const rx = 1 & (d >> 1);
+		std::size_t const ry = 1 & (d ^ rx);
+		if (!ry)
+		{
+			if (rx)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d >>= 2;
+	}
+	*j = y;
+	*k = x;
+}
+
+} // namespace <anonymous>
+
+TileScheduler::TileScheduler(std::size_t m, std::size_t n, int logTileSize,
+                             TileOrder tileOrder):
+	m(m), n(n), logTileSize(logTileSize)
+{
+	std::size_t const size = std::size_t(1) << logTileSize;
+	std::size_t const tilesM = (m + size - 1) >> logTileSize;
+	tilesN = (n + size - 1) >> logTileSize;
+	order.reserve(tilesM * tilesN);
+
+	switch (tileOrder)
+	{
+	case TileOrder::Scanline:
+		for (std::size_t i = 0; i < tilesM * tilesN; ++i)
+			order.push_back((uint32_t) i);
+		break;
+	case TileOrder::Hilbert:
+	{
+		// Walk the curve over the enclosing power of two square
+		int logSide = 0;
+		while ((std::size_t(1) << logSide) < std::max(tilesM, tilesN)) ++logSide;
+		uint64_t const nCells = uint64_t(1) << (2 * logSide);
+		for (uint64_t d = 0; d < nCells; ++d)
+		{
+			std::size_t j, k;
+			hilbertToPoint(d, logSide, &j, &k);
+			if (j < tilesM && k < tilesN)
+				order.push_back((uint32_t) (j * tilesN + k));
+		}
+		break;
+	}
+	case TileOrder::CenterOut:
+	{
+		for (std::size_t i = 0; i < tilesM * tilesN; ++i)
+			order.push_back((uint32_t) i);
+		// Twice the pixel coordinates of the centres, to keep them integral
+		auto distance2 = [&](uint32_t i)
+		{
+			int64_t const dj = int64_t(2 * ((i / tilesN) << logTileSize) + size) -
+			                   int64_t(m);
+			int64_t const dk = int64_t(2 * ((i % tilesN) << logTileSize) + size) -
+			                   int64_t(n);
+			return dj * dj + dk * dk;
+		};
+		std::stable_sort(order.begin(), order.end(),
+		                 [&](uint32_t a, uint32_t b)
+		{
+			return distance2(a) < distance2(b);
+		});
+		break;
+	}
+	}
+}
+
+} // namespace photino
@@ -0,0 +1,221 @@
+#ifndef PHOTINO_RENDER_TILESCHEDULER_HPP_
+#define PHOTINO_RENDER_TILESCHEDULER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "../core/MemoryPool.hpp"
+#include "../core/parallel.hpp"
+
+namespace photino
+{
+
+/**
+ * @brief Order in which the tiles of the film are dispatched
+ */
+enum class TileOrder
+{
+	Scanline, ///< Row by row
+	Hilbert, ///< Along a Hilbert curve, keeping consecutive tiles adjacent
+	CenterOut ///< By increasing distance to the centre of the film
+};
+
+/**
+ * @brief Rectangle [j0, j1) x [k0, k1) of the film. Tile (jTile, kTile)
+ *  coincides with block (jTile, kTile) of a \ref BlockArray whose blocks have
+ *  the side of the tiles.
+ */
+struct Tile
+{
+	std::size_t jTile, kTile;
+	std::size_t j0, k0;
+	std::size_t j1, k1;
+};
+
+/**
+ * Tiles are dealt round-robin in the chosen order, so that the tiles in
+ * flight at any time are consecutive in that order. Each worker owns a range
+ * of its tiles, packed into one atomic word, and takes tiles from its front.
+ * A worker whose range is exhausted steals the back half of the largest
+ * remaining range.
+ *
+ * @brief Distributes the tiles of a film over threads with work stealing.
+ */
+class TileScheduler final
+{
+public:
+	/**
+	 * @param[in] m, n Dimensions of the film
+	 * @param[in] logTileSize Tiles are squares of side 2^logTileSize, clipped
+	 *  at the border of the film. Use the logBlockSize of the film BlockArray
+	 *  to align tiles with its blocks.
+	 */
+	TileScheduler(std::size_t m, std::size_t n, int logTileSize,
+	              TileOrder = TileOrder::Hilbert);
+
+	std::size_t nTiles() const;
+	/**
+	 * @brief i-th tile in dispatch order
+	 */
+	Tile tile(std::size_t i) const;
+
+	/**
+	 * @brief Calls f(tile, pool, workerIndex) once for each tile. Blocks until
+	 *  all tiles are processed.
+	 * @param[in] f Receives a MemoryPool* const owned by the worker, which is
+	 *  reset with \ref MemoryPool::freeAll after each tile.
+	 */
+	template <typename F> void
+	run(F&& f, unsigned int nThreads = nHardwareThreads()) const;
+
+private:
+	/**
+	 * @brief Range [begin, end) of slots packed as (begin << 32) | end, alone in
+	 *  its cache line
+	 */
+	struct alignas(PHOTINO_MEMALIGN) WorkerRange
+	{
+		std::atomic<uint64_t> range;
+	};
+
+	static uint64_t pack(uint32_t begin, uint32_t end);
+	/**
+	 * @brief Takes the first slot of a range.
+	 * @return false if the range is empty
+	 */
+	static bool pop(WorkerRange* const, uint32_t* const slot);
+	/**
+	 * @brief Moves the back half of the largest range of other workers to the
+	 *  range of the thief, which must be empty.
+	 * @return false if there is nothing left to steal
+	 */
+	static bool steal(WorkerRange* const ranges, unsigned int nWorkers,
+	                  unsigned int thief);
+
+	std::size_t m, n;
+	int logTileSize;
+	std::size_t tilesN; ///< Number of tiles along the second dimension
+	std::vector<uint32_t> order; ///< Tile indices j * tilesN + k in dispatch order
+};
+
+
+// Implementations
+
+inline std::size_t TileScheduler::nTiles() const
+{
+	return order.size();
+}
+inline Tile TileScheduler::tile(std::size_t i) const
+{
+	std::size_t const size = std::size_t(1) << logTileSize;
+	Tile result;
+	result.jTile = order[i] / tilesN;
+	result.kTile = order[i] % tilesN;
+	result.j0 = result.jTile << logTileSize;
+	result.k0 = result.kTile << logTileSize;
+	result.j1 = result.j0 + size < m ? result.j0 + size : m;
+	result.k1 = result.k0 + size < n ? result.k0 + size : n;
+	return result;
+}
+
+template <typename F> inline void
+TileScheduler::run(F&& f, unsigned int nThreads) const
+{
+	std::size_t const nTotal = order.size();
+	if (!nTotal) return;
+	if (nThreads < 1) nThreads = 1;
+	if (nThreads > nTotal) nThreads = (unsigned int) nTotal;
+
+	/*
+	 * Worker w initially owns slots [w * stride, (w + 1) * stride), and slot
+	 * w * stride + i refers to tile i * nThreads + w in dispatch order. Slots
+	 * past the last tile are skipped.
+	 */
+	uint32_t const stride = (uint32_t) ((nTotal + nThreads - 1) / nThreads);
+	std::vector<WorkerRange> ranges(nThreads);
+	for (unsigned int w = 0; w < nThreads; ++w)
+		ranges[w].range = pack(w * stride, (w + 1) * stride);
+
+	parallelChunks(0, nThreads, nThreads,
+	               [&](std::size_t, std::size_t, unsigned int worker)
+	{
+		MemoryPool pool(BlockCache::global().blockSize(), &BlockCache::global());
+		do
+		{
+			uint32_t slot;
+			while (pop(&ranges[worker], &slot))
+			{
+				std::size_t const i = (std::size_t) (slot % stride) * nThreads +
+				                      slot / stride;
+				if (i >= nTotal) continue;
+				f(tile(i), &pool, worker);
+				pool.freeAll();
+			}
+		}
+		while (steal(ranges.data(), nThreads, worker));
+	});
+}
+
+inline uint64_t TileScheduler::pack(uint32_t begin, uint32_t end)
+{
+	return (uint64_t(begin) << 32) | end;
+}
+inline bool TileScheduler::pop(WorkerRange* const worker, uint32_t* const slot)
+{
+	uint64_t r = worker->range.load(std::memory_order_acquire);
+	while (true)
+	{
+		uint32_t const begin = (uint32_t) (r >> 32);
+		uint32_t const end = (uint32_t) r;
+		if (begin >= end) return false;
+		if (worker->range.compare_exchange_weak(r, pack(begin + 1, end),
+		                                        std::memory_order_acq_rel))
+		{
+			*slot = begin;
+			return true;
+		}
+	}
+}
+inline bool TileScheduler::steal(WorkerRange* const ranges,
+                                 unsigned int nWorkers, unsigned int thief)
+{
+	/*
+	 * Slots are handed out at most once, so a nonempty range never reappears
+	 * and the exchanges below are free of ABA.
+	 */
+	while (true)
+	{
+		unsigned int victim = thief;
+		uint64_t r = 0;
+		uint32_t largest = 0;
+		for (unsigned int w = 0; w < nWorkers; ++w)
+		{
+			if (w == thief) continue;
+			uint64_t const candidate = ranges[w].range.load(std::memory_order_acquire);
+			uint32_t const begin = (uint32_t) (candidate >> 32);
+			uint32_t const end = (uint32_t) candidate;
+			if (begin < end && end - begin > largest)
+			{
+				victim = w;
+				r = candidate;
+				largest = end - begin;
+			}
+		}
+		if (victim == thief) return false;
+
+		uint32_t const begin = (uint32_t) (r >> 32);
+		uint32_t const end = (uint32_t) r;
+		uint32_t const half = (end - begin + 1) / 2;
+		if (ranges[victim].range.compare_exchange_strong(r, pack(begin, end - half),
+		                                                 std::memory_order_acq_rel))
+		{
+			ranges[thief].range.store(pack(end - half, end), std::memory_order_release);
+			return true;
+		}
+	}
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_RENDER_TILESCHEDULER_HPP_
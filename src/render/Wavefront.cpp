@@ -0,0 +1,146 @@
+#include "Wavefront.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+namespace photino
+{
+
+namespace
+{
+
+/**
+ * @brief Reorders an array by the indices in the lower halves of order.
+ * @param[out] buffer Scratch space of n elements
+ */
+template <typename T>
+void permute(T* const array, uint64_t const* order, std::size_t n,
+             T* const buffer)
+{
+	for (std::size_t i = 0; i < n; ++i)
+		buffer[i] = array[(uint32_t) order[i]];
+	std::copy(buffer, buffer + n, array);
+}
+
+} // namespace <anonymous>
+
+SortStage::SortStage(BoxAxisAligned<3> const& bounds, std::size_t batchSize):
+	nBatch(batchSize ? batchSize : 1), origin(bounds.min())
+{
+	Vector<3> const extent = bounds.max() - bounds.min();
+	for (int j = 0; j < 3; ++j)
+		scale[j] = extent[j] > 0 ? (1 << mortonBits) / extent[j] : 0;
+}
+
+void SortStage::prepare(unsigned int nWorkers)
+{
+	if (scratch.size() >= nWorkers) return;
+	scratch.resize(nWorkers);
+	for (Scratch& buffers : scratch)
+	{
+		buffers.order.resize(nBatch);
+		buffers.reals.resize(nBatch);
+		buffers.indices.resize(nBatch);
+	}
+}
+
+void SortStage::process(WavefrontState const& state, std::size_t first,
+                        std::size_t last, unsigned int worker)
+{
+	RayQueue& rays = *state.rays;
+	std::size_t const n = last - first;
+	Scratch& buffers = scratch[worker];
+	// Keys in the upper half, indices in the lower half
+	uint64_t* const order = buffers.order.data();
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		std::size_t const r = first + i;
+		Point<3> const o(rays.o[0][r], rays.o[1][r], rays.o[2][r]);
+		Vector<3> const d(rays.d[0][r], rays.d[1][r], rays.d[2][r]);
+		order[i] = uint64_t(key(o, d)) << 32 | i;
+	}
+	std::sort(order, order + n);
+
+	real* const reals = buffers.reals.data();
+	for (int j = 0; j < 3; ++j)
+	{
+		permute(rays.o[j] + first, order, n, reals);
+		permute(rays.d[j] + first, order, n, reals);
+	}
+	permute(rays.tMax + first, order, n, reals);
+	permute(rays.time + first, order, n, reals);
+	uint32_t* const indices = buffers.indices.data();
+	permute(rays.path + first, order, n, indices);
+	permute(rays.prim + first, order, n, indices);
+}
+
+WavefrontPipeline::WavefrontPipeline(WavefrontStage* const generator,
+                                     std::size_t waveSize, int maxDepth,
+                                     unsigned int nThreads):
+	queues{ { waveSize, &pool }, { waveSize, &pool }, { waveSize, &pool } },
+	depthMax(maxDepth), nThreads(nThreads ? nThreads : 1), nRaysDropped(0)
+{
+	addStage(generator);
+}
+
+void WavefrontPipeline::resetTimes()
+{
+	std::fill(times.begin(), times.end(), 0);
+}
+
+void WavefrontPipeline::run(std::size_t nPaths)
+{
+	std::size_t const wave = waveSize();
+	for (std::size_t first = 0; first < nPaths; first += wave)
+	{
+		WavefrontState state;
+		state.rays = &queues[0];
+		state.nextRays = &queues[1];
+		state.shadowRays = &queues[2];
+		state.firstPath = first;
+		state.nPaths = std::min(wave, nPaths - first);
+		state.depth = 0;
+		for (RayQueue& queue : queues)
+			queue.clear();
+
+		runStage(0, state);
+		nRaysDropped += state.rays->nOverflowed();
+		for (; !state.rays->empty() && state.depth <= depthMax; ++state.depth)
+		{
+			for (std::size_t i = 1; i < stages.size(); ++i)
+				runStage(i, state);
+			nRaysDropped += state.nextRays->nOverflowed() +
+			                state.shadowRays->nOverflowed();
+			std::swap(state.rays, state.nextRays);
+			state.nextRays->clear();
+			state.shadowRays->clear();
+		}
+	}
+}
+
+void WavefrontPipeline::runStage(std::size_t index, WavefrontState const& state)
+{
+	boost::timer::cpu_timer timer;
+	WavefrontStage* const stage = stages[index];
+	std::size_t const n = stage->nItems(state);
+	if (n)
+	{
+		// Batches are handed out dynamically, since their costs vary widely
+		std::size_t const batch = stage->batchSize();
+		std::atomic<std::size_t> next(0);
+		unsigned int const nWorkers = (unsigned int)
+			std::min<std::size_t>(nThreads, (n + batch - 1) / batch);
+		stage->prepare(nWorkers);
+		parallelChunks(0, nWorkers, nWorkers,
+		               [&](std::size_t, std::size_t, unsigned int worker)
+		{
+			std::size_t first;
+			while ((first = next.fetch_add(batch)) < n)
+				stage->process(state, first, std::min(first + batch, n), worker);
+		});
+	}
+	times[index] += timer.elapsed().wall;
+}
+
+} // namespace photino
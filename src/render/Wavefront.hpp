@@ -0,0 +1,436 @@
+#ifndef PHOTINO_RENDER_WAVEFRONT_HPP_
+#define PHOTINO_RENDER_WAVEFRONT_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <boost/timer/timer.hpp>
+
+#include "RayQueue.hpp"
+#include "../accel/BVH.hpp"
+#include "../core/parallel.hpp"
+
+namespace photino
+{
+
+/**
+ * @brief Queues and progress of the wave of paths being traced
+ */
+struct WavefrontState
+{
+	RayQueue* rays; ///< Rays traced at the current bounce
+	RayQueue* nextRays; ///< Continuations of the paths, traced next bounce
+	RayQueue* shadowRays; ///< Shadow rays spawned at the current bounce
+	std::size_t firstPath; ///< Index of the first path of the wave
+	std::size_t nPaths; ///< Number of paths in the wave
+	int depth; ///< Current bounce, 0 for the rays leaving the camera
+};
+
+/**
+ * A stage performs one kind of work, such as generating camera rays,
+ * intersecting or shading, on a range of items, which are usually the
+ * entries of one of the queues. Stages communicate only through the queues
+ * and through the path states they own, indexed by \ref RayQueue::path.
+ *
+ * @brief Step of a \ref WavefrontPipeline
+ */
+class WavefrontStage
+{
+public:
+	static constexpr std::size_t const defaultBatchSize = 1024;
+
+	virtual ~WavefrontStage() {}
+
+	virtual char const* name() const = 0;
+	/**
+	 * @brief Number of items handed to a worker at once. The ranges passed to
+	 *  \ref process start at multiples of it.
+	 */
+	virtual std::size_t batchSize() const;
+	/**
+	 * @brief Number of items to process, read before the stage starts
+	 */
+	virtual std::size_t nItems(WavefrontState const&) const = 0;
+	/**
+	 * @brief Called before the workers start on the stage, e.g. to allocate
+	 *  scratch space for each of them once rather than in \ref process.
+	 * @param[in] nWorkers Number of workers, which call \ref process with
+	 *  worker in [0, nWorkers)
+	 */
+	virtual void prepare(unsigned int nWorkers);
+	/**
+	 * @brief Processes items [first, last). Called concurrently by several
+	 *  workers, on disjoint ranges.
+	 * @param[in] worker Index of the calling worker, in [0, nThreads)
+	 */
+	virtual void process(WavefrontState const&, std::size_t first,
+	                     std::size_t last, unsigned int worker) = 0;
+};
+
+/**
+ * Instead of tracing each path to its end before the next, as a megakernel
+ * does, the paths of a wave advance together one bounce at a time. Each
+ * bounce runs the stages in order, and each stage processes all its items
+ * before the next begins, on all the threads in batches of
+ * \ref WavefrontStage::batchSize.
+ * A stage thus runs the same code over many rays in a row, which keeps its
+ * data in cache and its loops free of divergent branches.
+ *
+ * For each wave the generator fills state.rays, typically with camera rays.
+ * Then, until no ray is left or maxDepth is exceeded, the stages added by
+ * \ref addStage run with the current bounce, after which the continuation
+ * queue becomes the ray queue. A typical sequence is a \ref SortStage, an
+ * \ref IntersectStage, a shading stage pushing continuations and shadow rays,
+ * a \ref ShadowStage and an accumulation stage.
+ *
+ * @brief Breadth-first path tracing through queues of rays
+ * @warning Stages may push at most one continuation and one shadow ray per
+ *  path and bounce, the capacity of the queues being the size of a wave.
+ */
+class WavefrontPipeline final
+{
+public:
+	/**
+	 * @param[in] generator Stage run once per wave, over its paths, which must
+	 *  push their first rays into state.rays. It must outlive the object.
+	 * @param[in] waveSize Number of paths in flight
+	 * @param[in] maxDepth Index of the last bounce traced
+	 */
+	WavefrontPipeline(WavefrontStage* const generator, std::size_t waveSize,
+	                  int maxDepth, unsigned int nThreads = nHardwareThreads());
+	WavefrontPipeline(WavefrontPipeline const&) = delete;
+	WavefrontPipeline& operator=(WavefrontPipeline const&) = delete;
+
+	/**
+	 * @brief Appends a stage to those run at each bounce. It must outlive the
+	 *  object.
+	 */
+	void addStage(WavefrontStage* const);
+
+	std::size_t waveSize() const;
+	int maxDepth() const;
+	/**
+	 * @brief Number of stages, the generator being stage 0
+	 */
+	std::size_t nStages() const;
+	WavefrontStage const& stage(std::size_t) const;
+	/**
+	 * @brief Wall time spent in a stage since the last \ref resetTimes
+	 */
+	boost::timer::nanosecond_type stageTime(std::size_t) const;
+	void resetTimes();
+	/**
+	 * @brief Number of rays dropped since construction because a stage pushed
+	 *  more rays than a queue holds. Nonzero only if a stage breaks the rule
+	 *  of one continuation and one shadow ray per path and bounce.
+	 */
+	std::size_t nDropped() const;
+
+	/**
+	 * @brief Traces paths [0, nPaths) in waves of \ref waveSize paths.
+	 */
+	void run(std::size_t nPaths);
+
+private:
+	/**
+	 * @brief Runs a stage over all its items and accumulates its time
+	 */
+	void runStage(std::size_t index, WavefrontState const&);
+
+	MemoryPool pool;
+	RayQueue queues[3];
+	int depthMax;
+	unsigned int nThreads;
+	std::vector<WavefrontStage*> stages;
+	std::vector<boost::timer::nanosecond_type> times;
+	std::size_t nRaysDropped;
+};
+
+/**
+ * The key of a ray is the octant of its direction followed by the Morton
+ * code of its origin, quantised over the given bounds. Rays sorted by key
+ * are grouped by direction, then by origin along a Z-order curve, so that
+ * consecutive rays traverse the same nodes and packets of them share an
+ * octant, which \ref IntersectStage requires to cull by frustum.
+ *
+ * Sorting is local to batches of consecutive rays, which are independent.
+ * Larger batches find more coherence at a higher cost per ray.
+ *
+ * @brief Stage reordering state.rays by direction and origin
+ */
+class SortStage final: public WavefrontStage
+{
+public:
+	/**
+	 * @param[in] bounds Bounds of the ray origins, usually of the scene.
+	 *  Origins outside are clamped.
+	 * @param[in] batchSize Number of consecutive rays sorted together
+	 */
+	SortStage(BoxAxisAligned<3> const& bounds, std::size_t batchSize = 4096);
+
+	char const* name() const override;
+	std::size_t batchSize() const override;
+	std::size_t nItems(WavefrontState const&) const override;
+	void prepare(unsigned int nWorkers) override;
+	void process(WavefrontState const&, std::size_t first, std::size_t last,
+	             unsigned int worker) override;
+
+	/**
+	 * @brief Sort key of a ray, in 30 bits
+	 */
+	uint32_t key(Point<3> const& origin, Vector<3> const& direction) const;
+
+private:
+	static constexpr int const mortonBits = 9; ///< Bits per axis
+
+	/**
+	 * @brief Buffers of a worker, of one batch each. Aligned so that the
+	 *  workers do not share cache lines.
+	 */
+	struct alignas(PHOTINO_MEMALIGN) Scratch
+	{
+		std::vector<uint64_t> order;
+		std::vector<real> reals;
+		std::vector<uint32_t> indices;
+	};
+
+	std::size_t nBatch;
+	Point<3> origin;
+	Vector<3> scale; ///< Maps the bounds to [0, 2^mortonBits]
+	std::vector<Scratch> scratch; ///< Per worker
+};
+
+/**
+ * Rays are traced in packets of consecutive queue entries, so the stage is
+ * fastest when the queue is sorted by coherence, e.g. by \ref SortStage.
+ *
+ * @brief Stage finding the closest hit of the rays of state.rays. The extent
+ *  of each ray is shrunk to its hit, whose primitive is written in
+ *  \ref RayQueue::prim.
+ * @tparam width Number of rays per packet
+ * @tparam Intersector Called as intersector(primIndex, packet, mask), see
+ *  \ref BVH::intersect
+ */
+template <int width, typename Intersector>
+class IntersectStage final: public WavefrontStage
+{
+public:
+	/**
+	 * @param[in] bvh Hierarchy, which must outlive the object
+	 */
+	IntersectStage(BVH const& bvh, Intersector const& intersector);
+
+	char const* name() const override;
+	std::size_t nItems(WavefrontState const&) const override;
+	void process(WavefrontState const&, std::size_t first, std::size_t last,
+	             unsigned int worker) override;
+
+private:
+	BVH const& bvh;
+	Intersector intersector;
+};
+
+/**
+ * @brief Stage testing the rays of state.shadowRays for occlusion. The
+ *  primitive found to occlude a ray, if any, is written in
+ *  \ref RayQueue::prim.
+ * @tparam Predicate Called as predicate(primIndex, ray), see
+ *  \ref BVH::intersectAny
+ */
+template <typename Predicate>
+class ShadowStage final: public WavefrontStage
+{
+public:
+	/**
+	 * @param[in] bvh Hierarchy, which must outlive the object
+	 */
+	ShadowStage(BVH const& bvh, Predicate const& predicate);
+
+	char const* name() const override;
+	std::size_t nItems(WavefrontState const&) const override;
+	void process(WavefrontState const&, std::size_t first, std::size_t last,
+	             unsigned int worker) override;
+
+private:
+	BVH const& bvh;
+	Predicate predicate;
+};
+
+/**
+ * @brief Deduces the type of the intersector of an \ref IntersectStage
+ */
+template <int width, typename Intersector> IntersectStage<width, Intersector>
+makeIntersectStage(BVH const&, Intersector const&);
+/**
+ * @brief Deduces the type of the predicate of a \ref ShadowStage
+ */
+template <typename Predicate> ShadowStage<Predicate>
+makeShadowStage(BVH const&, Predicate const&);
+
+
+// Implementations
+
+inline std::size_t WavefrontStage::batchSize() const
+{
+	return defaultBatchSize;
+}
+inline void WavefrontStage::prepare(unsigned int)
+{
+}
+
+inline void WavefrontPipeline::addStage(WavefrontStage* const stage)
+{
+	stages.push_back(stage);
+	times.push_back(0);
+}
+inline std::size_t WavefrontPipeline::waveSize() const
+{
+	return queues[0].capacity();
+}
+inline int WavefrontPipeline::maxDepth() const
+{
+	return depthMax;
+}
+inline std::size_t WavefrontPipeline::nStages() const
+{
+	return stages.size();
+}
+inline WavefrontStage const& WavefrontPipeline::stage(std::size_t i) const
+{
+	return *stages[i];
+}
+inline boost::timer::nanosecond_type
+WavefrontPipeline::stageTime(std::size_t i) const
+{
+	return times[i];
+}
+inline std::size_t WavefrontPipeline::nDropped() const
+{
+	return nRaysDropped;
+}
+
+inline char const* SortStage::name() const
+{
+	return "Sort";
+}
+inline std::size_t SortStage::batchSize() const
+{
+	return nBatch;
+}
+inline std::size_t SortStage::nItems(WavefrontState const& state) const
+{
+	return state.rays->size();
+}
+inline uint32_t SortStage::key(Point<3> const& o, Vector<3> const& d) const
+{
+	uint32_t cell[3];
+	int octant = 0;
+	for (int j = 0; j < 3; ++j)
+	{
+		real const x = (o[j] - origin[j]) * scale[j];
+		// Also maps NaN to 0
+		cell[j] = x > 0 ? (uint32_t) std::min<real>(x, (1 << mortonBits) - 1) : 0;
+		octant |= std::signbit(d[j]) << j;
+	}
+	return (uint32_t) octant << (3 * mortonBits) |
+	       encodeMorton3(cell[0], cell[1], cell[2]);
+}
+
+template <int width, typename Intersector> inline
+IntersectStage<width, Intersector>::IntersectStage(BVH const& bvh,
+                                                   Intersector const& intersector):
+	bvh(bvh), intersector(intersector)
+{
+}
+template <int width, typename Intersector> inline char const*
+IntersectStage<width, Intersector>::name() const
+{
+	return "Intersect";
+}
+template <int width, typename Intersector> inline std::size_t
+IntersectStage<width, Intersector>::nItems(WavefrontState const& state) const
+{
+	return state.rays->size();
+}
+template <int width, typename Intersector> inline void
+IntersectStage<width, Intersector>::process(WavefrontState const& state,
+                                            std::size_t first, std::size_t last,
+                                            unsigned int)
+{
+	RayQueue& rays = *state.rays;
+	RayPacket<width> packet;
+	for (std::size_t i = first; i < last; i += width)
+	{
+		int mask = rays.load(i, &packet);
+		if (last - i < (std::size_t) width)
+			mask &= (int) ((1ull << (last - i)) - 1);
+		packet.prepare(mask);
+
+		uint32_t prims[width];
+		int const hit = bvh.intersect(&packet, mask,
+			[&](uint32_t prim, RayPacket<width>* const p, int m)
+			{
+				int const hit = intersector(prim, p, m);
+				for (int h = hit; h; h &= h - 1)
+					prims[countTrailingZeros((uint32_t) h)] = prim;
+				return hit;
+			});
+		for (int m = mask; m; m &= m - 1)
+		{
+			int const lane = countTrailingZeros((uint32_t) m);
+			rays.tMax[i + lane] = packet.tMax[lane];
+			rays.prim[i + lane] = hit >> lane & 1 ? prims[lane] : RayQueue::noHit;
+		}
+	}
+}
+
+template <typename Predicate> inline
+ShadowStage<Predicate>::ShadowStage(BVH const& bvh, Predicate const& predicate):
+	bvh(bvh), predicate(predicate)
+{
+}
+template <typename Predicate> inline char const*
+ShadowStage<Predicate>::name() const
+{
+	return "Shadow";
+}
+template <typename Predicate> inline std::size_t
+ShadowStage<Predicate>::nItems(WavefrontState const& state) const
+{
+	return state.shadowRays->size();
+}
+template <typename Predicate> inline void
+ShadowStage<Predicate>::process(WavefrontState const& state,
+                                std::size_t first, std::size_t last,
+                                unsigned int)
+{
+	RayQueue& rays = *state.shadowRays;
+	for (std::size_t i = first; i < last; ++i)
+	{
+		uint32_t occluder = RayQueue::noHit;
+		bvh.intersectAny(rays.ray(i), [&](uint32_t prim, RenderRay<3> const& r)
+		{
+			if (!predicate(prim, r)) return false;
+			occluder = prim;
+			return true;
+		});
+		rays.prim[i] = occluder;
+	}
+}
+
+template <int width, typename Intersector> inline IntersectStage<width, Intersector>
+makeIntersectStage(BVH const& bvh, Intersector const& intersector)
+{
+	return IntersectStage<width, Intersector>(bvh, intersector);
+}
+template <typename Predicate> inline ShadowStage<Predicate>
+makeShadowStage(BVH const& bvh, Predicate const& predicate)
+{
+	return ShadowStage<Predicate>(bvh, predicate);
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_RENDER_WAVEFRONT_HPP_
@@ -0,0 +1,125 @@
+#include "HaltonSampler.hpp"
+
+namespace photino
+{
+
+namespace
+{
+
+constexpr int const primes[HaltonSampler::maxDimensions] =
+{
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53
+};
+
+/**
+ * @brief Number of digits in the base needed to represent any 32 bit index
+ */
+constexpr int nDigits(int base)
+{
+	int n = 0;
+	for (uint64_t power = 1; power < (uint64_t(1) << 32); power *= base) ++n;
+	return n;
+}
+
+/**
+ * @brief Radical inverse in the base with digit i permuted by
+ *  permutations[i * base, (i + 1) * base). The base is a template parameter
+ *  so that the divisions compile to multiplications.
+ */
+template <int base>
+real radicalInverse(uint32_t index, uint16_t const* permutations)
+{
+	// Integral accumulation is exact since base^nDigits fits in 64 bits
+	uint64_t reversed = 0;
+	uint64_t power = 1;
+	for (int i = 0; i < nDigits(base); ++i)
+	{
+		uint32_t const next = index / base;
+		reversed = reversed * base + permutations[index - next * base];
+		power *= base;
+		permutations += base;
+		index = next;
+	}
+	constexpr real const oneMinusEpsilon = 1 - std::numeric_limits<real>::epsilon() / 2;
+	real const x = real(reversed) / real(power);
+	return x < oneMinusEpsilon ? x : oneMinusEpsilon;
+}
+
+typedef real (*RadicalInverse)(uint32_t, uint16_t const*);
+RadicalInverse const radicalInverses[HaltonSampler::maxDimensions] =
+{
+	radicalInverse<2>, radicalInverse<3>, radicalInverse<5>, radicalInverse<7>,
+	radicalInverse<11>, radicalInverse<13>, radicalInverse<17>,
+	radicalInverse<19>, radicalInverse<23>, radicalInverse<29>,
+	radicalInverse<31>, radicalInverse<37>, radicalInverse<41>,
+	radicalInverse<43>, radicalInverse<47>, radicalInverse<53>
+};
+
+} // namespace <anonymous>
+
+HaltonSampler::HaltonSampler(uint32_t samplesPerPixel, uint64_t seed):
+	Sampler(samplesPerPixel, seed), valid(false)
+{
+	// Random digit permutations (Fisher-Yates)
+	Random random(mixBits(seed));
+	for (int d = 0; d < maxDimensions; ++d)
+	{
+		int const base = primes[d];
+		offsets[d] = permutations.size();
+		for (int i = 0; i < nDigits(base); ++i)
+		{
+			std::size_t const first = permutations.size();
+			for (int j = 0; j < base; ++j)
+				permutations.push_back((uint16_t) j);
+			for (int j = base - 1; j > 0; --j)
+			{
+				int const k = (int) ((uint64_t(random()) * uint64_t(j + 1)) >> 32);
+				std::swap(permutations[first + j], permutations[first + k]);
+			}
+		}
+	}
+}
+
+void HaltonSampler::startSample(uint64_t pixel, uint32_t index)
+{
+	// The first sample started need not be sample 0 of pixel 0, e.g. when
+	// resuming a pixel
+	if (!valid || pixel != this->pixel)
+	{
+		uint64_t const hash = mixBits(pixel ^ mixBits(seed));
+		for (int d = 0; d < maxDimensions; ++d)
+			rotations[d] = uniformFromBits((uint32_t) mixBits(hash + uint64_t(d)));
+		valid = true;
+	}
+	Sampler::startSample(pixel, index);
+}
+real HaltonSampler::get1D()
+{
+	if (dimension >= maxDimensions)
+	{
+		++dimension;
+		return rng.uniform();
+	}
+	return sample(dimension++);
+}
+void HaltonSampler::getND(real* const out, int n)
+{
+	// The dimensions are independent, which lets their divisions overlap
+	int i = 0;
+	for (; i < n && dimension < maxDimensions; ++i)
+		out[i] = sample(dimension++);
+	for (; i < n; ++i)
+		out[i] = get1D();
+}
+
+real HaltonSampler::sample(int dimension) const
+{
+	real x = radicalInverses[dimension](sampleIndex,
+	                                    permutations.data() + offsets[dimension]);
+	x += rotations[dimension];
+	if (x >= 1) x -= 1;
+	constexpr real const oneMinusEpsilon = 1 - std::numeric_limits<real>::epsilon() / 2;
+	return x < oneMinusEpsilon ? x : oneMinusEpsilon;
+}
+
+} // namespace photino
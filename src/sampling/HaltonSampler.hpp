@@ -0,0 +1,49 @@
+#ifndef PHOTINO_SAMPLING_HALTONSAMPLER_HPP_
+#define PHOTINO_SAMPLING_HALTONSAMPLER_HPP_
+
+#include <vector>
+
+#include "Sampler.hpp"
+
+namespace photino
+{
+
+/**
+ * Dimension d is the radical inverse in the d-th prime base, with the digits
+ * scrambled by random permutations fixed at construction. Each pixel applies
+ * its own Cranley-Patterson rotation to the points. Dimensions past
+ * \ref maxDimensions are drawn from \ref Sampler::rng.
+ *
+ * @brief Scrambled Halton sampler
+ */
+class HaltonSampler final: public Sampler
+{
+public:
+	static constexpr int const maxDimensions = 16;
+
+	HaltonSampler(uint32_t samplesPerPixel, uint64_t seed = 0);
+
+	void startSample(uint64_t pixel, uint32_t index) override;
+	real get1D() override;
+	void getND(real* const out, int n) override;
+
+private:
+	/**
+	 * @brief Scrambled radical inverse of the sample index in a dimension,
+	 *  rotated by the offset of the pixel.
+	 */
+	real sample(int dimension) const;
+
+	/**
+	 * Digit permutations. Those of dimension d start at offsets[d], one
+	 * permutation of its base per digit.
+	 */
+	std::vector<uint16_t> permutations;
+	std::size_t offsets[maxDimensions];
+	real rotations[maxDimensions]; ///< Cranley-Patterson rotations of the pixel
+	bool valid; ///< Whether rotations belong to the current pixel
+};
+
+} // namespace photino
+
+#endif // !PHOTINO_SAMPLING_HALTONSAMPLER_HPP_
@@ -0,0 +1,102 @@
+#ifndef PHOTINO_SAMPLING_SAMPLER_HPP_
+#define PHOTINO_SAMPLING_SAMPLER_HPP_
+
+#include <cstdint>
+
+#include "../core/Random.hpp"
+#include "../math/geometry.hpp"
+
+namespace photino
+{
+
+/**
+ * A sample is a point of the unit hypercube, read one dimension after
+ * another. Samples are a pure function of the seed, the pixel, the sample
+ * index and the dimension, so images do not depend on the order in which
+ * pixels are rendered.
+ *
+ * @brief Generator of sample points for the pixels of the film
+ * @warning Not thread-safe. Use one instance per thread.
+ */
+class Sampler
+{
+public:
+	/**
+	 * @param[in] seed Decorrelates images rendered with different seeds
+	 */
+	Sampler(uint32_t samplesPerPixel, uint64_t seed);
+	virtual ~Sampler() {}
+	Sampler(Sampler const&) = delete;
+	Sampler& operator=(Sampler const&) = delete;
+
+	uint32_t samplesPerPixel() const;
+
+	/**
+	 * @brief Starts a sample of a pixel, at dimension 0.
+	 * @param[in] pixel Index of the pixel in the film
+	 * @param[in] index Index of the sample, in [0, samplesPerPixel)
+	 */
+	virtual void startSample(uint64_t pixel, uint32_t index);
+
+	/**
+	 * @brief Next dimension of the sample, in [0, 1)
+	 */
+	virtual real get1D() = 0;
+	/**
+	 * @brief Next two dimensions of the sample
+	 */
+	Point<2> get2D();
+	/**
+	 * @brief Next n dimensions of the sample. Equivalent to n calls to
+	 *  \ref get1D. Implementations generate several dimensions at once.
+	 */
+	virtual void getND(real* const out, int n);
+
+protected:
+	/**
+	 * @brief Source of the dimensions not covered by a sampler. It is seeded
+	 *  from the pixel and the sample index in \ref startSample.
+	 */
+	Random rng;
+	uint32_t const nSamples;
+	uint64_t const seed;
+	uint64_t pixel;
+	uint32_t sampleIndex;
+	int dimension; ///< Next dimension
+};
+
+
+// Implementations
+
+inline Sampler::Sampler(uint32_t samplesPerPixel, uint64_t seed):
+	nSamples(samplesPerPixel), seed(seed), pixel(0), sampleIndex(0),
+	dimension(0)
+{
+}
+
+inline uint32_t Sampler::samplesPerPixel() const
+{
+	return nSamples;
+}
+inline void Sampler::startSample(uint64_t pixel, uint32_t index)
+{
+	this->pixel = pixel;
+	sampleIndex = index;
+	dimension = 0;
+	rng.seed(mixBits(pixel ^ mixBits(seed)), index);
+}
+inline Point<2> Sampler::get2D()
+{
+	real u[2];
+	getND(u, 2);
+	return Point<2>(u[0], u[1]);
+}
+inline void Sampler::getND(real* const out, int n)
+{
+	for (int i = 0; i < n; ++i)
+		out[i] = get1D();
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_SAMPLING_SAMPLER_HPP_
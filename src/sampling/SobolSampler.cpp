@@ -0,0 +1,185 @@
+#include "SobolSampler.hpp"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../math/integers.hpp"
+
+namespace photino
+{
+
+namespace
+{
+
+constexpr int const nBits = 32;
+
+/**
+ * @brief Primitive polynomial and initial direction numbers of a dimension,
+ *  from the new-joe-kuo-6.21201 table
+ */
+struct Primitive
+{
+	int degree;
+	uint32_t coefficients; ///< Interior coefficients of the polynomial
+	uint32_t m[6];
+};
+
+/*
+ * The first dimension is the van der Corput sequence and has no polynomial.
+ */
+Primitive const primitives[SobolSampler::maxDimensions - 1] =
+{
+	{ 1, 0, { 1 } },
+	{ 2, 1, { 1, 3 } },
+	{ 3, 1, { 1, 3, 1 } },
+	{ 3, 2, { 1, 1, 1 } },
+	{ 4, 1, { 1, 1, 3, 3 } },
+	{ 4, 4, { 1, 3, 5, 13 } },
+	{ 5, 2, { 1, 1, 5, 5, 17 } },
+	{ 5, 4, { 1, 1, 5, 5, 5 } },
+	{ 5, 7, { 1, 1, 7, 11, 19 } },
+	{ 5, 11, { 1, 1, 5, 1, 1 } },
+	{ 5, 13, { 1, 1, 1, 3, 11 } },
+	{ 5, 14, { 1, 3, 5, 5, 31 } },
+	{ 6, 1, { 1, 3, 3, 9, 7, 49 } },
+	{ 6, 13, { 1, 1, 1, 15, 21, 21 } },
+	{ 6, 16, { 1, 3, 1, 13, 27, 49 } },
+};
+
+/**
+ * @brief Direction numbers, stored bit-major so that consecutive dimensions
+ *  are contiguous.
+ */
+struct Directions
+{
+	uint32_t v[nBits][SobolSampler::maxDimensions];
+
+	Directions()
+	{
+		for (int k = 0; k < nBits; ++k)
+			v[k][0] = uint32_t(1) << (nBits - 1 - k);
+		for (int d = 1; d < SobolSampler::maxDimensions; ++d)
+		{
+			Primitive const& p = primitives[d - 1];
+			int const s = p.degree;
+			for (int k = 0; k < s; ++k)
+				v[k][d] = p.m[k] << (nBits - 1 - k);
+			for (int k = s; k < nBits; ++k)
+			{
+				v[k][d] = v[k - s][d] ^ (v[k - s][d] >> s);
+				for (int l = 1; l < s; ++l)
+					if ((p.coefficients >> (s - 1 - l)) & 1)
+						v[k][d] ^= v[k - l][d];
+			}
+		}
+	}
+};
+
+Directions const directions;
+
+#ifdef __AVX2__
+__m256i reverseBits(__m256i x)
+{
+	__m256i const bytes = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i const nibbles = _mm256_setr_epi8(
+		0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF,
+		0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+	__m256i const low = _mm256_set1_epi8(0x0F);
+	x = _mm256_shuffle_epi8(x, bytes);
+	__m256i const lo = _mm256_shuffle_epi8(nibbles, _mm256_and_si256(x, low));
+	__m256i const hi = _mm256_shuffle_epi8(nibbles,
+		_mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+	return _mm256_or_si256(_mm256_slli_epi16(lo, 4), hi);
+}
+__m256i xorMul(__m256i x, uint32_t c)
+{
+	return _mm256_xor_si256(x, _mm256_mullo_epi32(x, _mm256_set1_epi32((int) c)));
+}
+#endif // __AVX2__
+
+} // namespace <anonymous>
+
+SobolSampler::SobolSampler(uint32_t samplesPerPixel, uint64_t seed):
+	Sampler(samplesPerPixel, seed), valid(false)
+{
+}
+
+void SobolSampler::startSample(uint64_t pixel, uint32_t index)
+{
+	// The first sample started need not be sample 0 of pixel 0, e.g. when
+	// resuming a pixel
+	if (!valid || pixel != this->pixel)
+	{
+		uint64_t const hash = mixBits(pixel ^ mixBits(seed));
+		for (int d = 0; d < maxDimensions; ++d)
+			seeds[d] = (uint32_t) mixBits(hash + uint64_t(d));
+		valid = true;
+	}
+	Sampler::startSample(pixel, index);
+}
+real SobolSampler::get1D()
+{
+	if (dimension >= maxDimensions)
+	{
+		++dimension;
+		return rng.uniform();
+	}
+	uint32_t const x = scramble(sobol(sampleIndex, dimension), seeds[dimension]);
+	++dimension;
+	return uniformFromBits(x);
+}
+void SobolSampler::getND(real* const out, int n)
+{
+	int i = 0;
+#ifdef __AVX2__
+	for (; i + 8 <= n && dimension + 8 <= maxDimensions; i += 8, dimension += 8)
+	{
+		__m256i x = _mm256_setzero_si256();
+		int k = 0;
+		for (uint32_t index = sampleIndex; index; index >>= 1, ++k)
+			if (index & 1)
+				x = _mm256_xor_si256(x, _mm256_loadu_si256(
+					(__m256i const*) &directions.v[k][dimension]));
+
+		// Laine-Karras permutation in reversed bit order
+		x = reverseBits(x);
+		x = _mm256_add_epi32(x, _mm256_loadu_si256((__m256i const*) &seeds[dimension]));
+		x = xorMul(x, 0x6C50B47C);
+		x = xorMul(x, 0xB82F1E52);
+		x = xorMul(x, 0xC7AFE638);
+		x = xorMul(x, 0x8D22F6E6);
+		x = reverseBits(x);
+
+		alignas(32) uint32_t bits[8];
+		_mm256_store_si256((__m256i*) bits, x);
+		for (int j = 0; j < 8; ++j)
+			out[i + j] = uniformFromBits(bits[j]);
+	}
+#endif // __AVX2__
+	for (; i < n; ++i)
+		out[i] = get1D();
+}
+
+uint32_t SobolSampler::sobol(uint32_t index, int dimension)
+{
+	uint32_t x = 0;
+	for (int k = 0; index; index >>= 1, ++k)
+		if (index & 1)
+			x ^= directions.v[k][dimension];
+	return x;
+}
+uint32_t SobolSampler::scramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6C50B47C;
+	x ^= x * 0xB82F1E52;
+	x ^= x * 0xC7AFE638;
+	x ^= x * 0x8D22F6E6;
+	return reverseBits(x);
+}
+
+} // namespace photino
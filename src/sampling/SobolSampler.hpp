@@ -0,0 +1,52 @@
+#ifndef PHOTINO_SAMPLING_SOBOLSAMPLER_HPP_
+#define PHOTINO_SAMPLING_SOBOLSAMPLER_HPP_
+
+#include "Sampler.hpp"
+
+namespace photino
+{
+
+/**
+ * Each pixel uses the first samplesPerPixel points of the Sobol' sequence
+ * with Owen scrambling, seeded per pixel and dimension, and evaluated with
+ * the hash-based nested uniform scramble of Laine and Karras (Burley 2020).
+ * Direction numbers are those of Joe and Kuo. Dimensions past
+ * \ref maxDimensions are drawn from \ref Sampler::rng.
+ *
+ * @brief Owen-scrambled Sobol' sampler
+ * @warning samplesPerPixel should be a power of 2 for the points of a pixel
+ *  to be stratified.
+ */
+class SobolSampler final: public Sampler
+{
+public:
+	static constexpr int const maxDimensions = 16;
+
+	SobolSampler(uint32_t samplesPerPixel, uint64_t seed = 0);
+
+	void startSample(uint64_t pixel, uint32_t index) override;
+	real get1D() override;
+	/**
+	 * @brief Evaluates eight dimensions at once with AVX2.
+	 */
+	void getND(real* const out, int n) override;
+
+	/**
+	 * @brief Unscrambled coordinate of the Sobol' point, as a 0.32 fixed point
+	 *  number
+	 */
+	static uint32_t sobol(uint32_t index, int dimension);
+
+private:
+	/**
+	 * @brief Nested uniform scramble of the bits of x
+	 */
+	static uint32_t scramble(uint32_t x, uint32_t seed);
+
+	uint32_t seeds[maxDimensions]; ///< Scrambling seeds of the pixel
+	bool valid; ///< Whether seeds belong to the current pixel
+};
+
+} // namespace photino
+
+#endif // !PHOTINO_SAMPLING_SOBOLSAMPLER_HPP_
@@ -0,0 +1,157 @@
+#include "StratifiedSampler.hpp"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace photino
+{
+
+namespace
+{
+
+#ifdef __AVX2__
+/**
+ * @brief \ref StratifiedSampler::permutationElement for 8 keys, before the
+ *  final offset by the key
+ */
+__m256i permutationElements(uint32_t index, uint32_t n, __m256i key)
+{
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	__m256i const mask = _mm256_set1_epi32((int) w);
+	__m256i const last = _mm256_set1_epi32((int) (n - 1));
+	auto mul = [](__m256i x, uint32_t c)
+	{
+		return _mm256_mullo_epi32(x, _mm256_set1_epi32((int) c));
+	};
+	auto xorShifted = [&](__m256i x, int shift)
+	{
+		return _mm256_xor_si256(x, _mm256_srli_epi32(_mm256_and_si256(x, mask),
+		                                             shift));
+	};
+	__m256i const keyMul = _mm256_or_si256(_mm256_set1_epi32(1),
+	                                       _mm256_srli_epi32(key, 27));
+
+	// Lanes keep walking the cycle until every one has fallen in [0, n)
+	__m256i i = _mm256_set1_epi32((int) index);
+	__m256i result = _mm256_setzero_si256();
+	__m256i pending = _mm256_set1_epi32(-1);
+	do
+	{
+		i = _mm256_xor_si256(i, key);
+		i = mul(i, 0xE170893D);
+		i = _mm256_xor_si256(i, _mm256_srli_epi32(key, 16));
+		i = xorShifted(i, 4);
+		i = _mm256_xor_si256(i, _mm256_srli_epi32(key, 8));
+		i = mul(i, 0x0929EB3F);
+		i = _mm256_xor_si256(i, _mm256_srli_epi32(key, 23));
+		i = xorShifted(i, 1);
+		i = _mm256_mullo_epi32(i, keyMul);
+		i = mul(i, 0x6935FA69);
+		i = xorShifted(i, 11);
+		i = mul(i, 0x74DCB303);
+		i = xorShifted(i, 2);
+		i = mul(i, 0x9E501CC3);
+		i = xorShifted(i, 2);
+		i = mul(i, 0xC860A3DF);
+		i = _mm256_and_si256(i, mask);
+		i = _mm256_xor_si256(i, _mm256_srli_epi32(i, 5));
+		// i < n, unsigned
+		__m256i const inside = _mm256_cmpeq_epi32(_mm256_max_epu32(i, last), last);
+		__m256i const accepted = _mm256_and_si256(inside, pending);
+		result = _mm256_blendv_epi8(result, i, accepted);
+		pending = _mm256_andnot_si256(accepted, pending);
+	}
+	while (!_mm256_testz_si256(pending, pending));
+	return result;
+}
+#endif // __AVX2__
+
+} // namespace <anonymous>
+
+StratifiedSampler::StratifiedSampler(uint32_t samplesPerPixel, uint64_t seed):
+	Sampler(samplesPerPixel, seed), pixelHash(0)
+{
+}
+
+void StratifiedSampler::startSample(uint64_t pixel, uint32_t index)
+{
+	pixelHash = mixBits(pixel ^ mixBits(seed));
+	Sampler::startSample(pixel, index);
+}
+real StratifiedSampler::get1D()
+{
+	uint32_t const key = (uint32_t) mixBits(pixelHash + uint64_t(dimension++));
+	uint32_t const stratum = permutationElement(sampleIndex, nSamples, key);
+	real const x = (stratum + rng.uniform()) / nSamples;
+	constexpr real const oneMinusEpsilon = 1 - std::numeric_limits<real>::epsilon() / 2;
+	return x < oneMinusEpsilon ? x : oneMinusEpsilon;
+}
+void StratifiedSampler::getND(real* const out, int n)
+{
+	int i = 0;
+#ifdef __AVX2__
+	// The hashed permutations of 8 dimensions are evaluated at once. The keys
+	// need 64 bit products and the offsets a modulo, which AVX2 lacks.
+	constexpr real const oneMinusEpsilon = 1 - std::numeric_limits<real>::epsilon() / 2;
+	for (; i + 8 <= n; i += 8, dimension += 8)
+	{
+		alignas(32) uint32_t keys[8];
+		for (int j = 0; j < 8; ++j)
+			keys[j] = (uint32_t) mixBits(pixelHash + uint64_t(dimension + j));
+		__m256i const key = _mm256_load_si256((__m256i const*) keys);
+		alignas(32) uint32_t strata[8];
+		_mm256_store_si256((__m256i*) strata,
+			_mm256_add_epi32(permutationElements(sampleIndex, nSamples, key), key));
+		for (int j = 0; j < 8; ++j)
+		{
+			real const x = (strata[j] % nSamples + rng.uniform()) / nSamples;
+			out[i + j] = x < oneMinusEpsilon ? x : oneMinusEpsilon;
+		}
+	}
+#endif // __AVX2__
+	for (; i < n; ++i)
+		out[i] = StratifiedSampler::get1D();
+}
+
+uint32_t StratifiedSampler::permutationElement(uint32_t i, uint32_t n,
+                                               uint32_t key)
+{
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	// Bijection of [0, w], repeated until the result falls in [0, n)
+	do
+	{
+		i ^= key;
+		i *= 0xE170893D;
+		i ^= key >> 16;
+		i ^= (i & w) >> 4;
+		i ^= key >> 8;
+		i *= 0x0929EB3F;
+		i ^= key >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | key >> 27;
+		i *= 0x6935FA69;
+		i ^= (i & w) >> 11;
+		i *= 0x74DCB303;
+		i ^= (i & w) >> 2;
+		i *= 0x9E501CC3;
+		i ^= (i & w) >> 2;
+		i *= 0xC860A3DF;
+		i &= w;
+		i ^= i >> 5;
+	}
+	while (i >= n);
+	return (i + key) % n;
+}
+
+} // namespace photino
@@ -0,0 +1,39 @@
+#ifndef PHOTINO_SAMPLING_STRATIFIEDSAMPLER_HPP_
+#define PHOTINO_SAMPLING_STRATIFIEDSAMPLER_HPP_
+
+#include "Sampler.hpp"
+
+namespace photino
+{
+
+/**
+ * Every dimension is split into samplesPerPixel strata. A sample takes a
+ * stratum given by a pseudo-random permutation of the sample indices, drawn
+ * per pixel and dimension, and is jittered within it. The strata of
+ * different dimensions are therefore paired at random, as in Latin hypercube
+ * sampling, and no dimension limit applies.
+ *
+ * @brief Jittered stratified sampler
+ */
+class StratifiedSampler final: public Sampler
+{
+public:
+	StratifiedSampler(uint32_t samplesPerPixel, uint64_t seed = 0);
+
+	void startSample(uint64_t pixel, uint32_t index) override;
+	real get1D() override;
+	void getND(real* const out, int n) override;
+
+	/**
+	 * @brief Element i of a pseudo-random permutation of [0, n), selected by
+	 *  the key (Kensler 2013)
+	 */
+	static uint32_t permutationElement(uint32_t i, uint32_t n, uint32_t key);
+
+private:
+	uint64_t pixelHash;
+};
+
+} // namespace photino
+
+#endif // !PHOTINO_SAMPLING_STRATIFIEDSAMPLER_HPP_
@@ -0,0 +1,589 @@
+#ifndef PHOTINO_SHAPE_QUADRIC_HPP_
+#define PHOTINO_SHAPE_QUADRIC_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+extern "C"
+{
+#include "../core/memory.h"
+}
+#include "../accel/BVH.hpp"
+#include "../math/InterpTransform3.hpp"
+#include "../math/RayPacket.hpp"
+#include "../math/Transform.hpp"
+#include "../math/integers.hpp"
+#include "../math/simd.hpp"
+
+namespace photino
+{
+
+/*
+ * Quadrics are defined in object space, about the z axis, and placed in the
+ * world by an affine transform. Since directions are not renormalised,
+ * distances along a ray are the same in both spaces.
+ *
+ * Each shape provides a lane kernel
+ *
+ *   template <int width> static void
+ *   intersectLanes(P const o[3], P const d[3], P const* params,
+ *                  P const& tMax, P* const t, int* const hits);
+ *
+ * with P = Pack<real, width>, which intersects lane i of the rays in object
+ * space with the shape of parameters params[k][i]. The kernel writes the two
+ * roots in t[0] <= t[1] and in hits[0], hits[1] the lanes where each root is
+ * an intersection within (0, tMax), so the intersection of a lane is t[0] if
+ * it is in hits[0], and t[1] otherwise. Degenerate rays give NaN roots, which
+ * fail the comparisons. The same kernel thus intersects many quadrics with one
+ * ray, as in \ref QuadricBlock, and one quadric with a \ref RayPacket.
+ */
+
+/**
+ * @brief Sphere centred at the origin
+ */
+struct Sphere
+{
+	static constexpr int const nParams = 1;
+
+	real radius;
+
+	BoxAxisAligned<3> bounds() const;
+	/**
+	 * @brief Outward normal, not normalised, at a point of the surface
+	 */
+	Normal<3> normal(Point<3> const&) const;
+	/**
+	 * @param[out] out Array of \ref nParams parameters for the lane kernel
+	 */
+	void params(real* const out) const;
+
+	template <int width> static void
+	intersectLanes(Pack<real, width> const o[3], Pack<real, width> const d[3],
+	               Pack<real, width> const* params,
+	               Pack<real, width> const& tMax, Pack<real, width>* const t,
+	               int* const hits);
+};
+
+/**
+ * @brief Annulus in the plane z = height, or a disk if innerRadius is 0
+ */
+struct Disk
+{
+	static constexpr int const nParams = 3;
+
+	real height;
+	real radius;
+	real innerRadius;
+
+	BoxAxisAligned<3> bounds() const;
+	Normal<3> normal(Point<3> const&) const;
+	void params(real* const out) const;
+
+	template <int width> static void
+	intersectLanes(Pack<real, width> const o[3], Pack<real, width> const d[3],
+	               Pack<real, width> const* params,
+	               Pack<real, width> const& tMax, Pack<real, width>* const t,
+	               int* const hits);
+};
+
+/**
+ * @brief Open cylinder about the z axis, between zMin and zMax
+ */
+struct Cylinder
+{
+	static constexpr int const nParams = 3;
+
+	real radius;
+	real zMin;
+	real zMax;
+
+	BoxAxisAligned<3> bounds() const;
+	Normal<3> normal(Point<3> const&) const;
+	void params(real* const out) const;
+
+	template <int width> static void
+	intersectLanes(Pack<real, width> const o[3], Pack<real, width> const d[3],
+	               Pack<real, width> const* params,
+	               Pack<real, width> const& tMax, Pack<real, width>* const t,
+	               int* const hits);
+};
+
+/**
+ * @brief Intersects a shape with a ray in its object space.
+ * @param[inout] objectRay Its extent is shrunk to the intersection, if any.
+ * @return true if the ray hits the shape within its extent
+ */
+template <typename Shape> bool
+intersectQuadric(Shape const&, RenderRay<3>* const objectRay);
+/**
+ * @brief Intersects a shape placed by a static transform with a world space
+ *  ray.
+ * @param[in] worldToObject Inverse of the placement of the shape
+ * @param[inout] ray Its extent is shrunk to the intersection, if any.
+ */
+template <typename Shape> bool
+intersectQuadric(Shape const&, TransformAffine<3> const& worldToObject,
+                 RenderRay<3>* const ray);
+/**
+ * The transform is interpolated and inverted at the time of the ray. The
+ * world bounds of the shape are given by
+ * \ref InterpTransform3::motionBounds of its object bounds.
+ *
+ * @brief Intersects a moving shape with a world space ray.
+ * @param[in] objectToWorld Animated placement of the shape
+ * @param[inout] ray Its extent is shrunk to the intersection, if any.
+ */
+template <typename Shape> bool
+intersectQuadric(Shape const&, InterpTransform3 const& objectToWorld,
+                 RenderRay<3>* const ray);
+/**
+ * @brief Intersects a shape placed by a static transform with the lanes of a
+ *  packet. The extent of each lane hit is shrunk to its intersection.
+ * @param[in] worldToObject Inverse of the placement of the shape
+ * @return Mask of the lanes among mask that hit the shape
+ */
+template <typename Shape, int width> int
+intersectQuadric(Shape const&, TransformAffine<3> const& worldToObject,
+                 RayPacket<width>* const, int mask);
+
+/**
+ * @brief Transforms rays by affine matrices, lane by lane.
+ * @param[in] m Rows of the matrices, m[j][3] being the translation
+ */
+template <int width> void
+trRayLanes(Pack<real, width> const m[3][4], Pack<real, width> const o[3],
+           Pack<real, width> const d[3], Pack<real, width>* const oOut,
+           Pack<real, width>* const dOut);
+
+/**
+ * Each lane holds the world to object matrix of its quadric, so that a ray
+ * is transformed into the object space of width quadrics at once.
+ *
+ * @brief Up to width quadrics of one shape, in SIMD lanes. Unused lanes hold
+ *  NaN matrices, which fail every test.
+ */
+template <int width, typename Shape>
+struct alignas(PHOTINO_MEMALIGN) QuadricBlock
+{
+	static constexpr uint32_t const invalid = UINT32_MAX;
+
+	/**
+	 * Entry (j, k) of the world to object matrix of lane i at m[j][k][i],
+	 * column 3 being the translation
+	 */
+	real m[3][4][width];
+	real params[Shape::nParams][width];
+	uint32_t prim[width]; ///< Quadric of each lane, or invalid
+};
+
+/**
+ * @brief Intersects one world space ray with the quadrics of a block.
+ * @param[inout] ray Its extent is shrunk to the closest intersection.
+ * @param[out] prim Quadric hit closest
+ * @return true if any quadric of the block is hit within the extent
+ */
+template <int width, typename Shape> bool
+intersectQuadric(QuadricBlock<width, Shape> const&, RenderRay<3>* const ray,
+                 uint32_t* const prim);
+
+/**
+ * The quadrics of each leaf of a \ref BVH are packed into consecutive
+ * blocks, as in \ref TriangleBlocks, so that a leaf is intersected width
+ * quadrics at a time with \ref BVH::intersectLeaves.
+ *
+ * Moving quadrics cannot be precomputed in blocks, and are intersected one
+ * at a time with the \ref InterpTransform3 overload of
+ * \ref intersectQuadric.
+ *
+ * @brief Quadrics placed by static transforms, precomputed for SIMD
+ *  intersection
+ * @tparam width Number of lanes, 4 or 8
+ * @tparam Shape \ref Sphere, \ref Disk or \ref Cylinder
+ */
+template <int width, typename Shape>
+class QuadricBlocks final
+{
+public:
+	/**
+	 * @param[in] shapes Shapes in object space
+	 * @param[in] objectToWorld Placement of each shape
+	 * @param[in] bvh Hierarchy built over the world bounds of the shapes,
+	 *  objectToWorld[i].trBoxAA(shapes[i].bounds())
+	 */
+	QuadricBlocks(Shape const* shapes, TransformAffine<3> const* objectToWorld,
+	              BVH const& bvh);
+	~QuadricBlocks();
+	QuadricBlocks(QuadricBlocks const&) = delete;
+	QuadricBlocks& operator=(QuadricBlocks const&) = delete;
+
+	std::size_t nBlocks() const;
+
+	/**
+	 * @brief Intersects the quadrics of a leaf. Suitable as the intersector
+	 *  of \ref BVH::intersectLeaves.
+	 * @param[out] prim Quadric hit closest
+	 */
+	bool intersect(uint32_t primOffset, uint32_t nPrims,
+	               RenderRay<3>* const, uint32_t* const prim) const;
+
+private:
+	QuadricBlock<width, Shape>* blocks;
+	std::size_t nBlocksTotal;
+	std::vector<uint32_t> firstBlock; ///< Indexed by the offset of a leaf
+};
+
+
+// Implementations
+
+inline BoxAxisAligned<3> Sphere::bounds() const
+{
+	return BoxAxisAligned<3>(Point<3>::Constant(-radius),
+	                         Point<3>::Constant(radius));
+}
+inline Normal<3> Sphere::normal(Point<3> const& p) const
+{
+	return Normal<3>(p[0], p[1], p[2]);
+}
+inline void Sphere::params(real* const out) const
+{
+	out[0] = radius;
+}
+template <int width> inline void
+Sphere::intersectLanes(Pack<real, width> const o[3],
+                       Pack<real, width> const d[3],
+                       Pack<real, width> const* params,
+                       Pack<real, width> const& tMax,
+                       Pack<real, width>* const t, int* const hits)
+{
+	typedef Pack<real, width> P;
+	/*
+	 * The discriminant is evaluated from the distance between the centre and
+	 * the closest point of the line, o + f d, rather than from b^2 - 4ac,
+	 * which cancels catastrophically for small spheres far from the origin.
+	 */
+	P const a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+	P const f = P::set1(0) - (o[0] * d[0] + o[1] * d[1] + o[2] * d[2]) / a;
+	P v[3];
+	for (int j = 0; j < 3; ++j) v[j] = fmadd(f, d[j], o[j]);
+	P const r = params[0];
+	P const disc = r * r - (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	// A negative discriminant gives NaN roots
+	P const q = sqrt(disc / a);
+	t[0] = f - q;
+	t[1] = f + q;
+	P const zero = P::set1(0);
+	hits[0] = maskLess(zero, t[0]) & maskLess(t[0], tMax);
+	hits[1] = maskLess(zero, t[1]) & maskLess(t[1], tMax);
+}
+
+inline BoxAxisAligned<3> Disk::bounds() const
+{
+	return BoxAxisAligned<3>(Point<3>(-radius, -radius, height),
+	                         Point<3>(radius, radius, height));
+}
+inline Normal<3> Disk::normal(Point<3> const&) const
+{
+	return Normal<3>(0, 0, 1);
+}
+inline void Disk::params(real* const out) const
+{
+	out[0] = height;
+	out[1] = radius * radius;
+	out[2] = innerRadius * innerRadius;
+}
+template <int width> inline void
+Disk::intersectLanes(Pack<real, width> const o[3],
+                     Pack<real, width> const d[3],
+                     Pack<real, width> const* params,
+                     Pack<real, width> const& tMax,
+                     Pack<real, width>* const t, int* const hits)
+{
+	typedef Pack<real, width> P;
+	// Rays parallel to the plane give infinite or NaN distances
+	t[0] = t[1] = (params[0] - o[2]) / d[2];
+	P const x = fmadd(t[0], d[0], o[0]);
+	P const y = fmadd(t[0], d[1], o[1]);
+	P const r2 = x * x + y * y;
+	hits[0] = maskLess(P::set1(0), t[0]) & maskLess(t[0], tMax) &
+	          maskLessEqual(r2, params[1]) & maskLessEqual(params[2], r2);
+	hits[1] = 0;
+}
+
+inline BoxAxisAligned<3> Cylinder::bounds() const
+{
+	return BoxAxisAligned<3>(Point<3>(-radius, -radius, zMin),
+	                         Point<3>(radius, radius, zMax));
+}
+inline Normal<3> Cylinder::normal(Point<3> const& p) const
+{
+	return Normal<3>(p[0], p[1], 0);
+}
+inline void Cylinder::params(real* const out) const
+{
+	out[0] = radius;
+	out[1] = zMin;
+	out[2] = zMax;
+}
+template <int width> inline void
+Cylinder::intersectLanes(Pack<real, width> const o[3],
+                         Pack<real, width> const d[3],
+                         Pack<real, width> const* params,
+                         Pack<real, width> const& tMax,
+                         Pack<real, width>* const t, int* const hits)
+{
+	typedef Pack<real, width> P;
+	// As for the sphere, in the xy plane. Rays parallel to the axis give NaN.
+	P const a = d[0] * d[0] + d[1] * d[1];
+	P const f = P::set1(0) - (o[0] * d[0] + o[1] * d[1]) / a;
+	P const vx = fmadd(f, d[0], o[0]);
+	P const vy = fmadd(f, d[1], o[1]);
+	P const r = params[0];
+	P const disc = r * r - (vx * vx + vy * vy);
+	P const q = sqrt(disc / a);
+	t[0] = f - q;
+	t[1] = f + q;
+	P const zero = P::set1(0);
+	for (int k = 0; k < 2; ++k)
+	{
+		P const z = fmadd(t[k], d[2], o[2]);
+		hits[k] = maskLess(zero, t[k]) & maskLess(t[k], tMax) &
+		          maskLessEqual(params[1], z) & maskLessEqual(z, params[2]);
+	}
+}
+
+template <typename Shape> inline bool
+intersectQuadric(Shape const& shape, RenderRay<3>* const objectRay)
+{
+	typedef Pack<real, 1> P;
+	P o[3], d[3], params[Shape::nParams], t[2];
+	for (int j = 0; j < 3; ++j)
+	{
+		o[j] = P::set1(objectRay->origin()[j]);
+		d[j] = P::set1(objectRay->direction()[j]);
+	}
+	real p[Shape::nParams];
+	shape.params(p);
+	for (int k = 0; k < Shape::nParams; ++k)
+		params[k] = P::set1(p[k]);
+	int hits[2];
+	Shape::template intersectLanes<1>(o, d, params,
+	                                  P::set1(objectRay->tMax()), t, hits);
+	if (!(hits[0] | hits[1])) return false;
+	objectRay->tMax() = hits[0] ? t[0][0] : t[1][0];
+	return true;
+}
+template <typename Shape> inline bool
+intersectQuadric(Shape const& shape, TransformAffine<3> const& worldToObject,
+                 RenderRay<3>* const ray)
+{
+	RenderRay<3> objectRay = worldToObject.trRay(*ray);
+	if (!intersectQuadric(shape, &objectRay)) return false;
+	ray->tMax() = objectRay.tMax();
+	return true;
+}
+template <typename Shape> inline bool
+intersectQuadric(Shape const& shape, InterpTransform3 const& objectToWorld,
+                 RenderRay<3>* const ray)
+{
+	return intersectQuadric(shape,
+	                        inverse(objectToWorld.interpolate(ray->time())),
+	                        ray);
+}
+template <typename Shape, int width> inline int
+intersectQuadric(Shape const& shape, TransformAffine<3> const& worldToObject,
+                 RayPacket<width>* const packet, int mask)
+{
+	typedef Pack<real, width> P;
+	Matrix<3> const linear = worldToObject.linear();
+	Vector<3> const translation = worldToObject.translation();
+	P mat[3][4];
+	for (int j = 0; j < 3; ++j)
+	{
+		for (int k = 0; k < 3; ++k)
+			mat[j][k] = P::set1(linear(j, k));
+		mat[j][3] = P::set1(translation[j]);
+	}
+	P o[3], d[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		o[j] = P::loadu(packet->o[j]);
+		d[j] = P::loadu(packet->d[j]);
+	}
+	P objectO[3], objectD[3];
+	trRayLanes(mat, o, d, objectO, objectD);
+
+	real p[Shape::nParams];
+	shape.params(p);
+	P params[Shape::nParams];
+	for (int k = 0; k < Shape::nParams; ++k)
+		params[k] = P::set1(p[k]);
+
+	P t[2];
+	int hits[2];
+	Shape::template intersectLanes<width>(objectO, objectD, params,
+	                                      P::loadu(packet->tMax), t, hits);
+	int const hit = (hits[0] | hits[1]) & mask;
+	if (!hit) return 0;
+
+	// Only the lanes hit are updated
+	alignas(PHOTINO_MEMALIGN) real roots[2][width];
+	t[0].store(roots[0]);
+	t[1].store(roots[1]);
+	for (int m = hit; m; m &= m - 1)
+	{
+		int const i = countTrailingZeros((uint32_t) m);
+		packet->tMax[i] = roots[hits[0] >> i & 1 ? 0 : 1][i];
+	}
+	return hit;
+}
+
+template <int width> inline void
+trRayLanes(Pack<real, width> const m[3][4], Pack<real, width> const o[3],
+           Pack<real, width> const d[3], Pack<real, width>* const oOut,
+           Pack<real, width>* const dOut)
+{
+	for (int j = 0; j < 3; ++j)
+	{
+		oOut[j] = fmadd(m[j][0], o[0],
+		                fmadd(m[j][1], o[1], fmadd(m[j][2], o[2], m[j][3])));
+		dOut[j] = fmadd(m[j][0], d[0], fmadd(m[j][1], d[1], m[j][2] * d[2]));
+	}
+}
+
+template <int width, typename Shape> inline bool
+intersectQuadric(QuadricBlock<width, Shape> const& block,
+                 RenderRay<3>* const ray, uint32_t* const prim)
+{
+	typedef Pack<real, width> P;
+	P mat[3][4];
+	for (int j = 0; j < 3; ++j)
+		for (int k = 0; k < 4; ++k)
+			mat[j][k] = P::load(block.m[j][k]);
+	P o[3], d[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		o[j] = P::set1(ray->origin()[j]);
+		d[j] = P::set1(ray->direction()[j]);
+	}
+	P objectO[3], objectD[3];
+	trRayLanes(mat, o, d, objectO, objectD);
+
+	P params[Shape::nParams];
+	for (int k = 0; k < Shape::nParams; ++k)
+		params[k] = P::load(block.params[k]);
+
+	P t[2];
+	int hits[2];
+	Shape::template intersectLanes<width>(objectO, objectD, params,
+	                                      P::set1(ray->tMax()), t, hits);
+	int const hit = hits[0] | hits[1];
+	if (!hit) return false;
+
+	// Closest lane hit
+	alignas(PHOTINO_MEMALIGN) real roots[2][width];
+	t[0].store(roots[0]);
+	t[1].store(roots[1]);
+	int closest = -1;
+	real tClosest = 0;
+	for (int m = hit; m; m &= m - 1)
+	{
+		int const i = countTrailingZeros((uint32_t) m);
+		real const ti = roots[hits[0] >> i & 1 ? 0 : 1][i];
+		if (closest < 0 || ti < tClosest)
+		{
+			closest = i;
+			tClosest = ti;
+		}
+	}
+	ray->tMax() = tClosest;
+	*prim = block.prim[closest];
+	return true;
+}
+
+template <int width, typename Shape> inline
+QuadricBlocks<width, Shape>::QuadricBlocks(
+	Shape const* shapes, TransformAffine<3> const* objectToWorld,
+	BVH const& bvh):
+	blocks(nullptr), nBlocksTotal(0), firstBlock(bvh.nPrims())
+{
+	typedef QuadricBlock<width, Shape> Block;
+	BVHNode const* const nodes = bvh.nodes();
+	for (std::size_t i = 0; i < bvh.nNodes(); ++i)
+		if (nodes[i].isLeaf())
+			nBlocksTotal += (nodes[i].nPrims + width - 1) / width;
+	blocks = (Block*) alloc_aligned(std::max<std::size_t>(nBlocksTotal, 1) *
+	                                sizeof(Block), PHOTINO_MEMALIGN);
+
+	uint32_t const* const indices = bvh.primIndices();
+	real const nan = std::numeric_limits<real>::quiet_NaN();
+	std::size_t next = 0;
+	for (std::size_t i = 0; i < bvh.nNodes(); ++i)
+	{
+		BVHNode const& node = nodes[i];
+		if (!node.isLeaf()) continue;
+		firstBlock[node.primOffset] = (uint32_t) next;
+		for (uint32_t j = 0; j < node.nPrims; j += width)
+		{
+			Block& block = blocks[next++];
+			for (int lane = 0; lane < width; ++lane)
+			{
+				bool const used = j + lane < node.nPrims;
+				uint32_t const q = used ? indices[node.primOffset + j + lane] : 0;
+				block.prim[lane] = used ? q : Block::invalid;
+
+				real p[Shape::nParams];
+				std::fill(p, p + Shape::nParams, nan);
+				Matrix<3> linear = Matrix<3>::Constant(nan);
+				Vector<3> translation = Vector<3>::Constant(nan);
+				if (used)
+				{
+					TransformAffine<3> const worldToObject =
+						inverse(objectToWorld[q]);
+					linear = worldToObject.linear();
+					translation = worldToObject.translation();
+					shapes[q].params(p);
+				}
+				for (int r = 0; r < 3; ++r)
+				{
+					for (int c = 0; c < 3; ++c)
+						block.m[r][c][lane] = linear(r, c);
+					block.m[r][3][lane] = translation[r];
+				}
+				for (int k = 0; k < Shape::nParams; ++k)
+					block.params[k][lane] = p[k];
+			}
+		}
+	}
+}
+template <int width, typename Shape> inline
+QuadricBlocks<width, Shape>::~QuadricBlocks()
+{
+	free_aligned(blocks);
+}
+template <int width, typename Shape> inline std::size_t
+QuadricBlocks<width, Shape>::nBlocks() const
+{
+	return nBlocksTotal;
+}
+template <int width, typename Shape> inline bool
+QuadricBlocks<width, Shape>::intersect(uint32_t primOffset, uint32_t nPrims,
+                                       RenderRay<3>* const ray,
+                                       uint32_t* const prim) const
+{
+	typedef QuadricBlock<width, Shape> Block;
+	Block const* const first = blocks + firstBlock[primOffset];
+	Block const* const last = first + (nPrims + width - 1) / width;
+	bool hit = false;
+	// Each hit shrinks the extent, so later blocks only report closer hits
+	for (Block const* block = first; block < last; ++block)
+		if (intersectQuadric(*block, ray, prim))
+			hit = true;
+	return hit;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_SHAPE_QUADRIC_HPP_
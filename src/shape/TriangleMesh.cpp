@@ -0,0 +1,62 @@
+#include "TriangleMesh.hpp"
+
+#include <cstring>
+
+namespace photino
+{
+
+namespace
+{
+
+template <typename T> T* allocArray(std::size_t n)
+{
+	return (T*) alloc_aligned(std::max<std::size_t>(n, 1) * sizeof(T),
+	                          PHOTINO_MEMALIGN);
+}
+
+} // namespace <anonymous>
+
+TriangleMesh::TriangleMesh(TransformAffine<3> const& objectToWorld,
+                           std::size_t nTriangles, uint32_t const* indices,
+                           std::size_t nVertices, real const* const p[3],
+                           real const* const n[3], real const* const uv[2]):
+	nTris(nTriangles), nVerts(nVertices),
+	indices(allocArray<uint32_t>(3 * nTriangles)),
+	positions{ allocArray<real>(nVertices), allocArray<real>(nVertices),
+	           allocArray<real>(nVertices) },
+	normals{ nullptr, nullptr, nullptr }, uvs{ nullptr, nullptr }
+{
+	std::memcpy(this->indices, indices, 3 * nTriangles * sizeof(uint32_t));
+	objectToWorld.trPoints(p, positions, nVertices);
+	if (n)
+	{
+		for (int j = 0; j < 3; ++j)
+			normals[j] = allocArray<real>(nVertices);
+		objectToWorld.trNormals(n, normals, nVertices);
+	}
+	if (uv)
+		for (int j = 0; j < 2; ++j)
+		{
+			uvs[j] = allocArray<real>(nVertices);
+			std::memcpy(uvs[j], uv[j], nVertices * sizeof(real));
+		}
+}
+TriangleMesh::~TriangleMesh()
+{
+	free_aligned(indices);
+	for (int j = 0; j < 3; ++j)
+	{
+		free_aligned(positions[j]);
+		free_aligned(normals[j]);
+	}
+	for (int j = 0; j < 2; ++j)
+		free_aligned(uvs[j]);
+}
+
+void TriangleMesh::bounds(BoxAxisAligned<3>* const bounds) const
+{
+	for (std::size_t i = 0; i < nTris; ++i)
+		bounds[i] = this->bounds(i);
+}
+
+} // namespace photino
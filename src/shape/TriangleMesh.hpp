@@ -0,0 +1,423 @@
+#ifndef PHOTINO_SHAPE_TRIANGLEMESH_HPP_
+#define PHOTINO_SHAPE_TRIANGLEMESH_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include "../core/memory.h"
+}
+#include "../accel/BVH.hpp"
+#include "../math/Transform.hpp"
+#include "../math/numbers.hpp"
+#include "../math/simd.hpp"
+
+namespace photino
+{
+
+/**
+ * The ray is translated to the origin, its dominant axis permuted to z and
+ * the space sheared so that the ray becomes the z axis (Woop et al. 2013).
+ * These depend on the ray only, and are precomputed here.
+ *
+ * @brief Ray data shared by the watertight tests of one ray
+ */
+struct WatertightRay
+{
+	explicit WatertightRay(RenderRay<3> const&);
+
+	int kx, ky, kz; ///< Permutation of the axes
+	real sx, sy, sz; ///< Shear
+};
+
+/**
+ * In the sheared space, the ray hits the triangle if the 2D edge functions
+ * of its vertices relative to the origin share a sign. They are evaluated
+ * with \ref differenceOfProducts, whose sign is exact, so a ray through an
+ * edge or a vertex shared by triangles hits at least one of them.
+ *
+ * The test relies on fused multiply-adds, which are evaluated in software,
+ * and much more slowly, on targets without FMA.
+ *
+ * @brief Watertight ray-triangle intersection
+ * @param[inout] ray Its extent is shrunk to the intersection, if any.
+ * @param[out] b Barycentric coordinates of the intersection relative to p0,
+ *  p1 and p2
+ * @return true if the ray hits the triangle within its extent
+ */
+bool intersectWatertight(WatertightRay const&, RenderRay<3>* const ray,
+                         Point<3> const& p0, Point<3> const& p1,
+                         Point<3> const& p2, real* const b);
+
+/**
+ * Vertex attributes are stored as structures of arrays, each array aligned
+ * to PHOTINO_MEMALIGN bytes, and triangles as triplets of vertex indices.
+ * Vertices are transformed to world space once, at construction, with the
+ * batch methods of \ref Transform.
+ *
+ * @brief Indexed triangle mesh in world space
+ */
+class TriangleMesh final
+{
+public:
+	/**
+	 * @param[in] objectToWorld Transform applied to the vertices
+	 * @param[in] nTriangles Number of triangles
+	 * @param[in] indices Vertex indices of the triangles, 3 per triangle
+	 * @param[in] nVertices Number of vertices
+	 * @param[in] p Positions in object space, p[j][k] being coordinate j of
+	 *  vertex k
+	 * @param[in] n Normals in object space, or null
+	 * @param[in] uv Texture coordinates, or null
+	 */
+	TriangleMesh(TransformAffine<3> const& objectToWorld,
+	             std::size_t nTriangles, uint32_t const* indices,
+	             std::size_t nVertices, real const* const p[3],
+	             real const* const n[3] = nullptr,
+	             real const* const uv[2] = nullptr);
+	~TriangleMesh();
+	TriangleMesh(TriangleMesh const&) = delete;
+	TriangleMesh& operator=(TriangleMesh const&) = delete;
+
+	std::size_t nTriangles() const;
+	std::size_t nVertices() const;
+	bool hasNormals() const;
+	bool hasUVs() const;
+
+	/**
+	 * @brief Indices of the 3 vertices of a triangle
+	 */
+	uint32_t const* triangle(std::size_t) const;
+	Point<3> position(uint32_t vertex) const;
+	/**
+	 * @warning The mesh must have normals. They are not normalised.
+	 */
+	Normal<3> normal(uint32_t vertex) const;
+	/**
+	 * @warning The mesh must have texture coordinates.
+	 */
+	Point<2> uv(uint32_t vertex) const;
+
+	BoxAxisAligned<3> bounds(std::size_t triangle) const;
+	/**
+	 * @brief Bounds of all the triangles, e.g. to build a \ref BVH
+	 * @param[out] bounds Array of \ref nTriangles boxes
+	 */
+	void bounds(BoxAxisAligned<3>* const bounds) const;
+
+	/**
+	 * @brief See \ref intersectWatertight
+	 */
+	bool intersect(std::size_t triangle, WatertightRay const&,
+	               RenderRay<3>* const, real* const b) const;
+
+private:
+	std::size_t nTris;
+	std::size_t nVerts;
+	uint32_t* indices;
+	real* positions[3];
+	real* normals[3]; ///< Null if the mesh has no normals
+	real* uvs[2]; ///< Null if the mesh has no texture coordinates
+};
+
+/**
+ * @brief Vertices of up to width triangles, in SIMD lanes. Unused lanes
+ *  hold NaN vertices, which fail every test.
+ */
+template <int width>
+struct alignas(PHOTINO_MEMALIGN) TriangleBlock
+{
+	static constexpr uint32_t const invalid = UINT32_MAX;
+
+	real p[3][3][width]; ///< Coordinate j of vertex k of lane i at p[k][j][i]
+	uint32_t prim[width]; ///< Triangle of each lane, or invalid
+};
+
+/**
+ * @brief \ref intersectWatertight between one ray and the triangles of a
+ *  block
+ * @param[out] prim Triangle hit closest
+ * @param[out] b Barycentric coordinates of the intersection
+ * @return true if any triangle of the block is hit within the extent
+ */
+template <int width> bool
+intersectWatertight(TriangleBlock<width> const&, WatertightRay const&,
+                    RenderRay<3>* const ray, uint32_t* const prim,
+                    real* const b);
+
+/**
+ * The triangles of each leaf of a \ref BVH are packed into consecutive
+ * blocks, so that a leaf is intersected width triangles at a time with
+ * \ref BVH::intersectLeaves. Leaves of at most width triangles, obtained
+ * with maxPrimsInNode = width, fit in one block.
+ *
+ * @brief Triangles of a mesh precomputed for SIMD intersection
+ * @tparam width Number of lanes, 4 or 8
+ */
+template <int width>
+class TriangleBlocks final
+{
+public:
+	/**
+	 * @param[in] bvh Hierarchy built over the bounds of the triangles of the
+	 *  mesh
+	 */
+	TriangleBlocks(TriangleMesh const&, BVH const& bvh);
+	~TriangleBlocks();
+	TriangleBlocks(TriangleBlocks const&) = delete;
+	TriangleBlocks& operator=(TriangleBlocks const&) = delete;
+
+	std::size_t nBlocks() const;
+
+	/**
+	 * @brief Intersects the triangles of a leaf. Suitable as the intersector
+	 *  of \ref BVH::intersectLeaves, given the \ref WatertightRay of the ray.
+	 * @param[out] prim Triangle hit closest
+	 * @param[out] b Barycentric coordinates of the intersection
+	 */
+	bool intersect(uint32_t primOffset, uint32_t nPrims, WatertightRay const&,
+	               RenderRay<3>* const, uint32_t* const prim,
+	               real* const b) const;
+
+private:
+	TriangleBlock<width>* blocks;
+	std::size_t nBlocksTotal;
+	std::vector<uint32_t> firstBlock; ///< Indexed by the offset of a leaf
+};
+
+
+// Implementations
+
+inline std::size_t TriangleMesh::nTriangles() const
+{
+	return nTris;
+}
+inline std::size_t TriangleMesh::nVertices() const
+{
+	return nVerts;
+}
+inline bool TriangleMesh::hasNormals() const
+{
+	return normals[0] != nullptr;
+}
+inline bool TriangleMesh::hasUVs() const
+{
+	return uvs[0] != nullptr;
+}
+inline uint32_t const* TriangleMesh::triangle(std::size_t i) const
+{
+	return indices + 3 * i;
+}
+inline Point<3> TriangleMesh::position(uint32_t v) const
+{
+	return Point<3>(positions[0][v], positions[1][v], positions[2][v]);
+}
+inline Normal<3> TriangleMesh::normal(uint32_t v) const
+{
+	return Normal<3>(normals[0][v], normals[1][v], normals[2][v]);
+}
+inline Point<2> TriangleMesh::uv(uint32_t v) const
+{
+	return Point<2>(uvs[0][v], uvs[1][v]);
+}
+inline BoxAxisAligned<3> TriangleMesh::bounds(std::size_t i) const
+{
+	uint32_t const* const v = triangle(i);
+	BoxAxisAligned<3> result(position(v[0]));
+	result.extend(position(v[1]));
+	result.extend(position(v[2]));
+	return result;
+}
+inline bool TriangleMesh::intersect(std::size_t i, WatertightRay const& w,
+                                    RenderRay<3>* const ray,
+                                    real* const b) const
+{
+	uint32_t const* const v = triangle(i);
+	return intersectWatertight(w, ray, position(v[0]), position(v[1]),
+	                           position(v[2]), b);
+}
+
+inline WatertightRay::WatertightRay(RenderRay<3> const& ray)
+{
+	Vector<3> const& d = ray.direction();
+	Vector<3> const a = d.cwiseAbs();
+	kz = a[0] > a[1] ? (a[0] > a[2] ? 0 : 2) : (a[1] > a[2] ? 1 : 2);
+	kx = kz == 2 ? 0 : kz + 1;
+	ky = kx == 2 ? 0 : kx + 1;
+	// Preserves the winding of the triangles
+	if (d[kz] < 0) std::swap(kx, ky);
+	sx = d[kx] / d[kz];
+	sy = d[ky] / d[kz];
+	sz = 1 / d[kz];
+}
+
+inline bool intersectWatertight(WatertightRay const& w, RenderRay<3>* const ray,
+                                Point<3> const& p0, Point<3> const& p1,
+                                Point<3> const& p2, real* const b)
+{
+	Point<3> const& o = ray->origin();
+	Vector<3> const a0 = p0 - o, a1 = p1 - o, a2 = p2 - o;
+	/*
+	 * A vertex shared by triangles must be sheared to the same point in each
+	 * of them. An explicit fused multiply-add, unlike a * b + c, cannot be
+	 * contracted by the compiler in some places and not others.
+	 */
+	real const x0 = std::fma(-w.sx, a0[w.kz], a0[w.kx]);
+	real const y0 = std::fma(-w.sy, a0[w.kz], a0[w.ky]);
+	real const x1 = std::fma(-w.sx, a1[w.kz], a1[w.kx]);
+	real const y1 = std::fma(-w.sy, a1[w.kz], a1[w.ky]);
+	real const x2 = std::fma(-w.sx, a2[w.kz], a2[w.kx]);
+	real const y2 = std::fma(-w.sy, a2[w.kz], a2[w.ky]);
+
+	// Edge functions, each weighting the vertex opposite the edge
+	real const e0 = differenceOfProducts(x1, y2, y1, x2);
+	real const e1 = differenceOfProducts(x2, y0, y2, x0);
+	real const e2 = differenceOfProducts(x0, y1, y0, x1);
+	if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+		return false;
+	real const det = e0 + e1 + e2;
+	if (det == 0) return false;
+
+	// Distance scaled by det, compared without dividing
+	real const t = w.sz * (e0 * a0[w.kz] + e1 * a1[w.kz] + e2 * a2[w.kz]);
+	real const tMax = ray->tMax() * det;
+	if (det < 0 ? (t >= 0 || t < tMax) : (t <= 0 || t > tMax))
+		return false;
+
+	real const invDet = 1 / det;
+	b[0] = e0 * invDet;
+	b[1] = e1 * invDet;
+	b[2] = e2 * invDet;
+	ray->tMax() = t * invDet;
+	return true;
+}
+
+template <int width> inline bool
+intersectWatertight(TriangleBlock<width> const& block, WatertightRay const& w,
+                    RenderRay<3>* const ray, uint32_t* const prim,
+                    real* const b)
+{
+	typedef Pack<real, width> P;
+	Point<3> const& o = ray->origin();
+	P const sx = P::set1(-w.sx), sy = P::set1(-w.sy);
+	P x[3], y[3], z[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		z[k] = P::load(block.p[k][w.kz]) - P::set1(o[w.kz]);
+		x[k] = fmadd(sx, z[k], P::load(block.p[k][w.kx]) - P::set1(o[w.kx]));
+		y[k] = fmadd(sy, z[k], P::load(block.p[k][w.ky]) - P::set1(o[w.ky]));
+	}
+
+	P const e0 = differenceOfProducts(x[1], y[2], y[1], x[2]);
+	P const e1 = differenceOfProducts(x[2], y[0], y[2], x[0]);
+	P const e2 = differenceOfProducts(x[0], y[1], y[0], x[1]);
+	P const zero = P::set1(0);
+	int const negative = maskLess(e0, zero) | maskLess(e1, zero) |
+	                     maskLess(e2, zero);
+	int const positive = maskLess(zero, e0) | maskLess(zero, e1) |
+	                     maskLess(zero, e2);
+
+	P const det = e0 + e1 + e2;
+	P const t = P::set1(w.sz) * (e0 * z[0] + e1 * z[1] + e2 * z[2]);
+	P const tMax = P::set1(ray->tMax()) * det;
+	int const front = maskLess(zero, det) & maskLess(zero, t) &
+	                  maskLessEqual(t, tMax);
+	int const back = maskLess(det, zero) & maskLess(t, zero) &
+	                 maskLessEqual(tMax, t);
+	int const hit = (front | back) & ~(negative & positive);
+	if (!hit) return false;
+
+	// Closest lane hit
+	alignas(PHOTINO_MEMALIGN) real distances[width], dets[width];
+	(t / det).store(distances);
+	det.store(dets);
+	int closest = countTrailingZeros((uint32_t) hit);
+	for (int m = hit & (hit - 1); m; m &= m - 1)
+	{
+		int const i = countTrailingZeros((uint32_t) m);
+		if (distances[i] < distances[closest]) closest = i;
+	}
+
+	alignas(PHOTINO_MEMALIGN) real edges[3][width];
+	e0.store(edges[0]);
+	e1.store(edges[1]);
+	e2.store(edges[2]);
+	real const invDet = 1 / dets[closest];
+	for (int k = 0; k < 3; ++k)
+		b[k] = edges[k][closest] * invDet;
+	ray->tMax() = distances[closest];
+	*prim = block.prim[closest];
+	return true;
+}
+
+template <int width> inline
+TriangleBlocks<width>::TriangleBlocks(TriangleMesh const& mesh, BVH const& bvh):
+	blocks(nullptr), nBlocksTotal(0), firstBlock(bvh.nPrims())
+{
+	BVHNode const* const nodes = bvh.nodes();
+	for (std::size_t i = 0; i < bvh.nNodes(); ++i)
+		if (nodes[i].isLeaf())
+			nBlocksTotal += (nodes[i].nPrims + width - 1) / width;
+	blocks = (TriangleBlock<width>*)
+		alloc_aligned(std::max<std::size_t>(nBlocksTotal, 1) *
+		              sizeof(TriangleBlock<width>), PHOTINO_MEMALIGN);
+
+	uint32_t const* const indices = bvh.primIndices();
+	real const nan = std::numeric_limits<real>::quiet_NaN();
+	std::size_t next = 0;
+	for (std::size_t i = 0; i < bvh.nNodes(); ++i)
+	{
+		BVHNode const& node = nodes[i];
+		if (!node.isLeaf()) continue;
+		firstBlock[node.primOffset] = (uint32_t) next;
+		for (uint32_t j = 0; j < node.nPrims; j += width)
+		{
+			TriangleBlock<width>& block = blocks[next++];
+			for (int lane = 0; lane < width; ++lane)
+			{
+				bool const used = j + lane < node.nPrims;
+				uint32_t const tri = used ? indices[node.primOffset + j + lane] : 0;
+				block.prim[lane] = used ? tri : TriangleBlock<width>::invalid;
+				for (int k = 0; k < 3; ++k)
+				{
+					Point<3> const v = used ? mesh.position(mesh.triangle(tri)[k])
+					                        : Point<3>::Constant(nan);
+					for (int c = 0; c < 3; ++c)
+						block.p[k][c][lane] = v[c];
+				}
+			}
+		}
+	}
+}
+template <int width> inline
+TriangleBlocks<width>::~TriangleBlocks()
+{
+	free_aligned(blocks);
+}
+template <int width> inline std::size_t
+TriangleBlocks<width>::nBlocks() const
+{
+	return nBlocksTotal;
+}
+template <int width> inline bool
+TriangleBlocks<width>::intersect(uint32_t primOffset, uint32_t nPrims,
+                                 WatertightRay const& w,
+                                 RenderRay<3>* const ray,
+                                 uint32_t* const prim, real* const b) const
+{
+	TriangleBlock<width> const* const first = blocks + firstBlock[primOffset];
+	TriangleBlock<width> const* const last = first + (nPrims + width - 1) / width;
+	bool hit = false;
+	// Each hit shrinks the extent, so later blocks only report closer hits
+	for (TriangleBlock<width> const* block = first; block < last; ++block)
+		if (intersectWatertight(*block, w, ray, prim, b))
+			hit = true;
+	return hit;
+}
+
+} // namespace photino
+
+#endif // !PHOTINO_SHAPE_TRIANGLEMESH_HPP_